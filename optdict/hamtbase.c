@@ -0,0 +1,664 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "hamtbase.h"
+
+/*
+   Nodes.  Each level of the trie takes HAMT_BITS bits of the hash code,
+   starting from the low end, and a node has a slot for each of the
+   2**HAMT_BITS values they can take.  hn_datamap has a bit set for each slot
+   holding an entry and hn_nodemap for each holding a child: the children's
+   pointers come first, in slot order, then the hn_nentries entries, also in
+   slot order.  A child always holds at least two entries somewhere below
+   it; removing a key that leaves a child with a single entry moves the
+   entry up into the parent.  So a given set of keys has one shape whatever
+   order it was built in, and lookups never wander down a chain of nearly
+   empty nodes.
+
+   Past the last level with hash bits left are collision nodes: no maps,
+   just hn_nentries entries with the same hash code, in no order.
+   */
+
+#define HAMT_BITS 5
+#define HAMT_MASK ((1 << HAMT_BITS) - 1)
+#define HAMT_HASHBITS ((int)(sizeof(long) * CHAR_BIT))
+
+struct _hamt_node {
+    size_t hn_refcnt;
+    uint32_t hn_datamap;
+    uint32_t hn_nodemap;
+    size_t hn_nentries;
+};
+
+#if defined(__GNUC__)
+#define NODE_INCREF(n) __atomic_add_fetch(&(n)->hn_refcnt, 1, __ATOMIC_RELAXED)
+#define NODE_DECREF(n) __atomic_sub_fetch(&(n)->hn_refcnt, 1, __ATOMIC_ACQ_REL)
+#define POPCOUNT(x) ((size_t)__builtin_popcount(x))
+#else
+#define NODE_INCREF(n) (++(n)->hn_refcnt)
+#define NODE_DECREF(n) (--(n)->hn_refcnt)
+    static size_t
+POPCOUNT(uint32_t x)
+{
+    size_t n = 0;
+    while (x) {
+        x &= x - 1;
+        n++;
+    }
+    return n;
+}
+#endif
+
+#define ENTRY_ALIGN (sizeof(double) > sizeof(void *) ? sizeof(double)    \
+                                                     : sizeof(void *))
+#define ROUND_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+#define NODE_HEADER ROUND_UP(sizeof(OptHamtNode), ENTRY_ALIGN)
+#define HAMT_KEYOFFSET ROUND_UP(sizeof(long), ENTRY_ALIGN)
+
+#define FRAG(hash, shift) ((unsigned)((unsigned long)(hash) >> (shift)) & HAMT_MASK)
+#define SLOT_INDEX(map, bit) POPCOUNT((map) & ((bit) - 1))
+
+#define CHILDREN(node) ((OptHamtNode **)((char *)(node) + NODE_HEADER))
+#define ENTRY(hm, node, i)                                                \
+    ((char *)(CHILDREN(node) + POPCOUNT((node)->hn_nodemap))              \
+     + (size_t)(i) * (hm)->hm_entrysize)
+#define ENTRY_HASH(e) (*(long *)(e))
+#define ENTRY_KEY(e) ((e) + HAMT_KEYOFFSET)
+#define ENTRY_VALUE(hm, e) ((e) + (hm)->hm_valoffset)
+
+/* A node with the given maps and room for a child for each bit of nodemap
+ * and for nentries entries, which the caller fills in.
+ */
+    static OptHamtNode *
+node_new(OptHamt *hm, uint32_t datamap, uint32_t nodemap, size_t nentries)
+{
+    OptHamtNode *node = malloc(NODE_HEADER
+                               + POPCOUNT(nodemap) * sizeof(OptHamtNode *)
+                               + nentries * hm->hm_entrysize);
+
+    if (node == NULL)
+        return NULL;
+    node->hn_refcnt = 1;
+    node->hn_datamap = datamap;
+    node->hn_nodemap = nodemap;
+    node->hn_nentries = nentries;
+    return node;
+}
+
+/* Drop a reference to node, freeing it and releasing its children and
+ * values if it was the last.
+ */
+    static void
+node_decref(OptHamt *hm, OptHamtNode *node)
+{
+    size_t i, nchildren;
+
+    if (NODE_DECREF(node) != 0)
+        return;
+    nchildren = POPCOUNT(node->hn_nodemap);
+    for (i = 0; i < nchildren; i++)
+        node_decref(hm, CHILDREN(node)[i]);
+    if (hm->hm_release != NULL)
+        for (i = 0; i < node->hn_nentries; i++)
+            hm->hm_release(ENTRY_VALUE(hm, ENTRY(hm, node, i)));
+    free(node);
+}
+
+/* Copy n children from src to dst, taking a reference to each. */
+    static void
+copy_children(OptHamtNode **dst, OptHamtNode **src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = src[i];
+        NODE_INCREF(src[i]);
+    }
+}
+
+/* Copy n entries from src to dst, retaining their values. */
+    static void
+copy_entries(OptHamt *hm, char *dst, const char *src, size_t n)
+{
+    size_t i;
+
+    memcpy(dst, src, n * hm->hm_entrysize);
+    if (hm->hm_retain != NULL)
+        for (i = 0; i < n; i++)
+            hm->hm_retain(ENTRY_VALUE(hm, dst + i * hm->hm_entrysize));
+}
+
+    static void
+set_entry(OptHamt *hm, char *e, void *key, long hash, void *value)
+{
+    ENTRY_HASH(e) = hash;
+    memcpy(ENTRY_KEY(e), key, hm->hm_keysize);
+    memcpy(ENTRY_VALUE(hm, e), value, hm->hm_valsize);
+    if (hm->hm_retain != NULL)
+        hm->hm_retain(ENTRY_VALUE(hm, e));
+}
+
+/* A copy of node with entry i (of n) replaced by key and value, or with them
+ * inserted before entry i if `insert`, under the slot bit `bit`.
+ */
+    static OptHamtNode *
+node_with_entry(OptHamt *hm, OptHamtNode *node, uint32_t bit, size_t i,
+                int insert, void *key, long hash, void *value)
+{
+    size_t n = node->hn_nentries;
+    size_t es = hm->hm_entrysize;
+    OptHamtNode *new = node_new(hm, node->hn_datamap | bit, node->hn_nodemap,
+                                n + (insert != 0));
+    char *dst;
+
+    if (new == NULL)
+        return NULL;
+    copy_children(CHILDREN(new), CHILDREN(node), POPCOUNT(node->hn_nodemap));
+    dst = ENTRY(hm, new, 0);
+    copy_entries(hm, dst, ENTRY(hm, node, 0), i);
+    set_entry(hm, dst + i * es, key, hash, value);
+    if (insert)
+        copy_entries(hm, dst + (i + 1) * es, ENTRY(hm, node, i), n - i);
+    else
+        copy_entries(hm, dst + (i + 1) * es, ENTRY(hm, node, i + 1),
+                     n - i - 1);
+    return new;
+}
+
+/* A copy of node with child in slot bit, replacing the child there or, if
+ * the slot holds entry di, the entry.  The new node takes over the
+ * reference to child.
+ */
+    static OptHamtNode *
+node_with_child(OptHamt *hm, OptHamtNode *node, uint32_t bit, size_t di,
+                OptHamtNode *child)
+{
+    size_t nchildren = POPCOUNT(node->hn_nodemap);
+    size_t n = node->hn_nentries;
+    size_t ci = SLOT_INDEX(node->hn_nodemap, bit);
+    int had_entry = (node->hn_datamap & bit) != 0;
+    OptHamtNode *new = node_new(hm, node->hn_datamap & ~bit,
+                                node->hn_nodemap | bit, n - had_entry);
+    char *dst;
+
+    if (new == NULL)
+        return NULL;
+    copy_children(CHILDREN(new), CHILDREN(node), ci);
+    CHILDREN(new)[ci] = child;
+    dst = ENTRY(hm, new, 0);
+    if (had_entry) {
+        copy_children(CHILDREN(new) + ci + 1, CHILDREN(node) + ci,
+                      nchildren - ci);
+        copy_entries(hm, dst, ENTRY(hm, node, 0), di);
+        copy_entries(hm, dst + di * hm->hm_entrysize, ENTRY(hm, node, di + 1),
+                     n - di - 1);
+    }
+    else {
+        copy_children(CHILDREN(new) + ci + 1, CHILDREN(node) + ci + 1,
+                      nchildren - ci - 1);
+        copy_entries(hm, dst, ENTRY(hm, node, 0), n);
+    }
+    return new;
+}
+
+/* A copy of node without entry i, which sits in slot bit (0 in a collision
+ * node).
+ */
+    static OptHamtNode *
+node_without_entry(OptHamt *hm, OptHamtNode *node, uint32_t bit, size_t i)
+{
+    size_t n = node->hn_nentries;
+    OptHamtNode *new = node_new(hm, node->hn_datamap & ~bit, node->hn_nodemap,
+                                n - 1);
+    char *dst;
+
+    if (new == NULL)
+        return NULL;
+    copy_children(CHILDREN(new), CHILDREN(node), POPCOUNT(node->hn_nodemap));
+    dst = ENTRY(hm, new, 0);
+    copy_entries(hm, dst, ENTRY(hm, node, 0), i);
+    copy_entries(hm, dst + i * hm->hm_entrysize, ENTRY(hm, node, i + 1),
+                 n - i - 1);
+    return new;
+}
+
+/* A node at level shift holding entry e and the new key and value, whose
+ * hash codes agree on the levels above.
+ */
+    static OptHamtNode *
+node_pair(OptHamt *hm, const char *e, void *key, long hash, void *value,
+          int shift)
+{
+    OptHamtNode *node, *child;
+    unsigned f1, f2;
+
+    if (shift >= HAMT_HASHBITS) {
+        node = node_new(hm, 0, 0, 2);
+        if (node == NULL)
+            return NULL;
+        copy_entries(hm, ENTRY(hm, node, 0), e, 1);
+        set_entry(hm, ENTRY(hm, node, 1), key, hash, value);
+        return node;
+    }
+    f1 = FRAG(ENTRY_HASH(e), shift);
+    f2 = FRAG(hash, shift);
+    if (f1 == f2) {
+        child = node_pair(hm, e, key, hash, value, shift + HAMT_BITS);
+        if (child == NULL)
+            return NULL;
+        node = node_new(hm, 0, (uint32_t)1 << f1, 0);
+        if (node == NULL) {
+            node_decref(hm, child);
+            return NULL;
+        }
+        CHILDREN(node)[0] = child;
+        return node;
+    }
+    node = node_new(hm, ((uint32_t)1 << f1) | ((uint32_t)1 << f2), 0, 2);
+    if (node == NULL)
+        return NULL;
+    copy_entries(hm, ENTRY(hm, node, f1 < f2 ? 0 : 1), e, 1);
+    set_entry(hm, ENTRY(hm, node, f1 < f2 ? 1 : 0), key, hash, value);
+    return node;
+}
+
+/* A copy of node, at level shift, with key set to value, or NULL if out of
+ * memory.  Sets *added if key is new.
+ */
+    static OptHamtNode *
+node_assoc(OptHamt *hm, OptHamtNode *node, int shift, void *key, long hash,
+           void *value, int *added)
+{
+    uint32_t bit;
+    size_t i;
+    char *e;
+    OptHamtNode *child, *new;
+
+    if (shift >= HAMT_HASHBITS) {
+        for (i = 0; i < node->hn_nentries; i++) {
+            e = ENTRY(hm, node, i);
+            if (hm->hm_eqfunc(ENTRY_KEY(e), key, hm->hm_keysize))
+                return node_with_entry(hm, node, 0, i, 0, key, hash, value);
+        }
+        *added = 1;
+        return node_with_entry(hm, node, 0, i, 1, key, hash, value);
+    }
+    bit = (uint32_t)1 << FRAG(hash, shift);
+    if (node->hn_datamap & bit) {
+        i = SLOT_INDEX(node->hn_datamap, bit);
+        e = ENTRY(hm, node, i);
+        if (ENTRY_HASH(e) == hash
+            && hm->hm_eqfunc(ENTRY_KEY(e), key, hm->hm_keysize))
+            return node_with_entry(hm, node, bit, i, 0, key, hash, value);
+        *added = 1;
+        child = node_pair(hm, e, key, hash, value, shift + HAMT_BITS);
+        if (child == NULL)
+            return NULL;
+        new = node_with_child(hm, node, bit, i, child);
+    }
+    else if (node->hn_nodemap & bit) {
+        child = node_assoc(hm,
+                           CHILDREN(node)[SLOT_INDEX(node->hn_nodemap, bit)],
+                           shift + HAMT_BITS, key, hash, value, added);
+        if (child == NULL)
+            return NULL;
+        new = node_with_child(hm, node, bit, 0, child);
+    }
+    else {
+        *added = 1;
+        return node_with_entry(hm, node, bit, SLOT_INDEX(node->hn_datamap, bit),
+                               1, key, hash, value);
+    }
+    if (new == NULL)
+        node_decref(hm, child);
+    return new;
+}
+
+/* node, at level shift, without key: a new node, node itself (with a new
+ * reference) if key isn't there, or NULL if out of memory.  Sets *removed
+ * if key was there.
+ */
+    static OptHamtNode *
+node_dissoc(OptHamt *hm, OptHamtNode *node, int shift, void *key, long hash,
+            int *removed)
+{
+    uint32_t bit;
+    size_t i, ci;
+    char *e;
+    OptHamtNode *child, *new;
+
+    if (shift >= HAMT_HASHBITS) {
+        for (i = 0; i < node->hn_nentries; i++) {
+            e = ENTRY(hm, node, i);
+            if (hm->hm_eqfunc(ENTRY_KEY(e), key, hm->hm_keysize)) {
+                *removed = 1;
+                return node_without_entry(hm, node, 0, i);
+            }
+        }
+        NODE_INCREF(node);
+        return node;
+    }
+    bit = (uint32_t)1 << FRAG(hash, shift);
+    if (node->hn_datamap & bit) {
+        i = SLOT_INDEX(node->hn_datamap, bit);
+        e = ENTRY(hm, node, i);
+        if (ENTRY_HASH(e) == hash
+            && hm->hm_eqfunc(ENTRY_KEY(e), key, hm->hm_keysize)) {
+            *removed = 1;
+            return node_without_entry(hm, node, bit, i);
+        }
+    }
+    else if (node->hn_nodemap & bit) {
+        ci = SLOT_INDEX(node->hn_nodemap, bit);
+        child = node_dissoc(hm, CHILDREN(node)[ci], shift + HAMT_BITS, key,
+                            hash, removed);
+        if (child == NULL)
+            return NULL;
+        if (!*removed) {
+            node_decref(hm, child);
+            NODE_INCREF(node);
+            return node;
+        }
+        if (child->hn_nentries == 1 && child->hn_nodemap == 0) {
+            /* Move the child's last entry up into its slot here. */
+            new = node_new(hm, node->hn_datamap | bit,
+                           node->hn_nodemap & ~bit, node->hn_nentries + 1);
+            if (new != NULL) {
+                i = SLOT_INDEX(node->hn_datamap, bit);
+                copy_children(CHILDREN(new), CHILDREN(node), ci);
+                copy_children(CHILDREN(new) + ci, CHILDREN(node) + ci + 1,
+                              POPCOUNT(node->hn_nodemap) - ci - 1);
+                e = ENTRY(hm, new, 0);
+                copy_entries(hm, e, ENTRY(hm, node, 0), i);
+                copy_entries(hm, e + i * hm->hm_entrysize,
+                             ENTRY(hm, child, 0), 1);
+                copy_entries(hm, e + (i + 1) * hm->hm_entrysize,
+                             ENTRY(hm, node, i), node->hn_nentries - i);
+            }
+            node_decref(hm, child);
+            return new;
+        }
+        new = node_with_child(hm, node, bit, 0, child);
+        if (new == NULL)
+            node_decref(hm, child);
+        return new;
+    }
+    NODE_INCREF(node);
+    return node;
+}
+
+/* A new version handle for root, which it takes over. */
+    static OptHamt *
+new_version(OptHamt *hm, OptHamtNode *root, size_t size)
+{
+    OptHamt *new = malloc(sizeof(OptHamt));
+
+    if (new == NULL) {
+        node_decref(hm, root);
+        return NULL;
+    }
+    *new = *hm;
+    new->hm_root = root;
+    new->hm_size = size;
+    return new;
+}
+
+/* An empty map with like's key size and comparison and value type.  Keys
+ * are looked up by the same hash codes as in like.  retain and release, if
+ * not NULL, take and drop a reference held by a value.
+ */
+    OptHamt *
+OptHamt_New(OptDict *like, OptHamtValueFunc retain, OptHamtValueFunc release)
+{
+    OptHamt *hm = malloc(sizeof(OptHamt));
+    size_t valalign = like->ma_valtype != NULL ? like->ma_valtype->vt_align
+                                                : ENTRY_ALIGN;
+
+    if (hm == NULL)
+        return NULL;
+    hm->hm_size = 0;
+    hm->hm_eqfunc = like->eqfunc;
+    hm->hm_keysize = like->ma_keysize;
+    hm->hm_valsize = like->ma_valsize;
+    hm->hm_valtype = like->ma_valtype;
+    hm->hm_valoffset = ROUND_UP(HAMT_KEYOFFSET + hm->hm_keysize, valalign);
+    hm->hm_entrysize = ROUND_UP(hm->hm_valoffset + hm->hm_valsize,
+                                ENTRY_ALIGN);
+    hm->hm_retain = retain;
+    hm->hm_release = release;
+    hm->hm_root = node_new(hm, 0, 0, 0);
+    if (hm->hm_root == NULL) {
+        free(hm);
+        return NULL;
+    }
+    return hm;
+}
+
+/* Build the node at level shift for the n entries of mp at eps, whose hash
+ * codes agree on the levels above, sorting eps by slot with the help of
+ * scratch (room for n more).
+ */
+    static OptHamtNode *
+build_node(OptHamt *hm, OptDict *mp, OptDictEntry **eps, OptDictEntry **scratch,
+           size_t n, int shift)
+{
+    size_t counts[1 << HAMT_BITS], starts[1 << HAMT_BITS];
+    uint32_t datamap = 0, nodemap = 0;
+    OptHamtNode *node, *child;
+    size_t i, ci = 0, di = 0;
+    unsigned f;
+
+    if (shift >= HAMT_HASHBITS) {
+        node = node_new(hm, 0, 0, n);
+        if (node == NULL)
+            return NULL;
+        for (i = 0; i < n; i++)
+            set_entry(hm, ENTRY(hm, node, i), eps[i]->me_key, eps[i]->me_hash,
+                      VALUE_OF(mp, eps[i]));
+        return node;
+    }
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++)
+        counts[FRAG(eps[i]->me_hash, shift)]++;
+    for (f = 0, i = 0; f < (1 << HAMT_BITS); f++) {
+        starts[f] = i;
+        i += counts[f];
+        if (counts[f] == 1)
+            datamap |= (uint32_t)1 << f;
+        else if (counts[f] > 1)
+            nodemap |= (uint32_t)1 << f;
+    }
+    for (i = 0; i < n; i++)
+        scratch[starts[FRAG(eps[i]->me_hash, shift)]++] = eps[i];
+    memcpy(eps, scratch, n * sizeof(OptDictEntry *));
+
+    node = node_new(hm, datamap, nodemap, POPCOUNT(datamap));
+    if (node == NULL)
+        return NULL;
+    for (f = 0, i = 0; f < (1 << HAMT_BITS); i += counts[f], f++) {
+        if (counts[f] == 1) {
+            set_entry(hm, ENTRY(hm, node, di++), eps[i]->me_key,
+                      eps[i]->me_hash, VALUE_OF(mp, eps[i]));
+        }
+        else if (counts[f] > 1) {
+            child = build_node(hm, mp, eps + i, scratch + i, counts[f],
+                               shift + HAMT_BITS);
+            if (child == NULL)
+                goto fail;
+            CHILDREN(node)[ci++] = child;
+        }
+    }
+    return node;
+
+fail:
+    /* Undo only what's been filled in. */
+    while (ci > 0)
+        node_decref(hm, CHILDREN(node)[--ci]);
+    if (hm->hm_release != NULL)
+        while (di > 0)
+            hm->hm_release(ENTRY_VALUE(hm, ENTRY(hm, node, --di)));
+    free(node);
+    return NULL;
+}
+
+/* A map holding mp's items, made like OptHamt_New(mp, retain, release).
+ * The trie is built bottom up in one pass, with no intermediate versions.
+ */
+    OptHamt *
+OptHamt_FromDict(OptDict *mp, OptHamtValueFunc retain,
+                 OptHamtValueFunc release)
+{
+    OptHamt *hm = OptHamt_New(mp, retain, release);
+    size_t n = OptDict_Size(mp), pos = 0, i = 0;
+    OptDictEntry **eps;
+    OptHamtNode *root;
+
+    if (hm == NULL || n == 0)
+        return hm;
+    eps = malloc(2 * n * sizeof(OptDictEntry *));
+    if (eps == NULL) {
+        OptHamt_Dealloc(hm);
+        return NULL;
+    }
+    while (OptDict_Next(mp, &pos, NULL, NULL))
+        eps[i++] = &mp->ma_table[pos - 1];
+    assert(i == n);
+    root = build_node(hm, mp, eps, eps + n, n, 0);
+    free(eps);
+    if (root == NULL) {
+        OptHamt_Dealloc(hm);
+        return NULL;
+    }
+    node_decref(hm, hm->hm_root);
+    hm->hm_root = root;
+    hm->hm_size = n;
+    return hm;
+}
+
+/* Free this version; the nodes it shares with others live on. */
+    void
+OptHamt_Dealloc(OptHamt *hm)
+{
+    if (hm == NULL)
+        return;
+    node_decref(hm, hm->hm_root);
+    free(hm);
+}
+
+/* Return a pointer to key's value, good for as long as this version lives,
+ * or NULL if key isn't present.
+ */
+    void *
+OptHamt_GetItem(OptHamt *hm, void *key, long hash)
+{
+    OptHamtNode *node = hm->hm_root;
+    uint32_t bit;
+    size_t i;
+    char *e;
+    int shift;
+
+    for (shift = 0; shift < HAMT_HASHBITS; shift += HAMT_BITS) {
+        bit = (uint32_t)1 << FRAG(hash, shift);
+        if (node->hn_datamap & bit) {
+            e = ENTRY(hm, node, SLOT_INDEX(node->hn_datamap, bit));
+            if (ENTRY_HASH(e) == hash
+                && hm->hm_eqfunc(ENTRY_KEY(e), key, hm->hm_keysize))
+                return ENTRY_VALUE(hm, e);
+            return NULL;
+        }
+        if (!(node->hn_nodemap & bit))
+            return NULL;
+        node = CHILDREN(node)[SLOT_INDEX(node->hn_nodemap, bit)];
+    }
+    for (i = 0; i < node->hn_nentries; i++) {
+        e = ENTRY(hm, node, i);
+        if (hm->hm_eqfunc(ENTRY_KEY(e), key, hm->hm_keysize))
+            return ENTRY_VALUE(hm, e);
+    }
+    return NULL;
+}
+
+/* A new version with key set to a copy of *value, or NULL if out of memory.
+ * hm is unchanged.
+ */
+    OptHamt *
+OptHamt_Assoc(OptHamt *hm, void *key, long hash, void *value)
+{
+    int added = 0;
+    OptHamtNode *root = node_assoc(hm, hm->hm_root, 0, key, hash, value,
+                                   &added);
+
+    if (root == NULL)
+        return NULL;
+    return new_version(hm, root, hm->hm_size + added);
+}
+
+/* A new version without key, or NULL if out of memory.  If key isn't
+ * present the new version shares hm's whole trie.
+ */
+    OptHamt *
+OptHamt_Dissoc(OptHamt *hm, void *key, long hash)
+{
+    int removed = 0;
+    OptHamtNode *root = node_dissoc(hm, hm->hm_root, 0, key, hash, &removed);
+
+    if (root == NULL)
+        return NULL;
+    return new_version(hm, root, hm->hm_size - removed);
+}
+
+    size_t
+OptHamt_Size(OptHamt *hm)
+{
+    return hm->hm_size;
+}
+
+/* Iterate over a version's items, in no particular order:
+ *
+ *     OptHamtIter it;
+ *     OptHamt_Iter(hm, &it);
+ *     while (OptHamt_Next(hm, &it, &key, &value)) {
+ *         ...
+ *     }
+ *
+ * Either of pkey and pvalue may be NULL.  The pointers are good for as long
+ * as the version lives.
+ */
+    void
+OptHamt_Iter(OptHamt *hm, OptHamtIter *it)
+{
+    it->it_nodes[0] = hm->hm_root;
+    it->it_pos[0] = 0;
+    it->it_depth = 0;
+}
+
+    int
+OptHamt_Next(OptHamt *hm, OptHamtIter *it, void **pkey, void **pvalue)
+{
+    OptHamtNode *node;
+    size_t pos;
+    char *e;
+
+    while (it->it_depth >= 0) {
+        node = it->it_nodes[it->it_depth];
+        pos = it->it_pos[it->it_depth]++;
+        if (pos < node->hn_nentries) {
+            e = ENTRY(hm, node, pos);
+            if (pkey)
+                *pkey = ENTRY_KEY(e);
+            if (pvalue)
+                *pvalue = ENTRY_VALUE(hm, e);
+            return 1;
+        }
+        pos -= node->hn_nentries;
+        if (pos < POPCOUNT(node->hn_nodemap)) {
+            it->it_depth++;
+            it->it_nodes[it->it_depth] = CHILDREN(node)[pos];
+            it->it_pos[it->it_depth] = 0;
+        }
+        else
+            it->it_depth--;
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef OPTHAMT_H
+#define OPTHAMT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <limits.h>
+#include "optdictbase.h"
+
+/*
+An OptHamt is one version of a persistent map: a hash array mapped trie in
+the compressed (CHAMP) layout, keyed and valued like the OptDict it was made
+from -- the same key size and comparison, the same hash codes, and values of
+the dict's value type.  A version never changes.  OptHamt_Assoc() and
+OptHamt_Dissoc() return a new version that shares every node of the old one
+except the O(log n) on the path to the key, so a long history of versions of
+a big map costs little more than the map itself.
+
+Nodes are reference counted with atomic operations and are immutable once
+built, so any number of threads may read any versions without locking, and
+a version may be freed on any thread.  Each version is a separate handle,
+freed with OptHamt_Dealloc().
+
+Values are copied into the trie's entries.  If they hold references that
+need counting, hm_retain is called on each value as it's copied into a node
+and hm_release as a node holding it is freed.
+*/
+typedef struct _hamt_node OptHamtNode;
+
+typedef void (*OptHamtValueFunc)(void *value);
+
+typedef struct _opthamt OptHamt;
+struct _opthamt {
+    OptHamtNode *hm_root;
+    size_t hm_size;
+
+    /* The rest is the same for every version derived from one OptHamt_New()
+     * or OptHamt_FromDict().  An entry is hm_entrysize bytes: the key's
+     * hash code, the key, and the value at hm_valoffset.
+     */
+    int (*hm_eqfunc)(void *, void *, size_t);
+    size_t hm_keysize;
+    size_t hm_valsize;
+    const OptDictValueType *hm_valtype;
+    size_t hm_valoffset;
+    size_t hm_entrysize;
+    OptHamtValueFunc hm_retain;
+    OptHamtValueFunc hm_release;
+};
+
+/* Levels of bitmap nodes, 5 bits of the hash code each, plus the collision
+ * nodes below them.
+ */
+#define OPTHAMT_MAXDEPTH ((sizeof(long) * CHAR_BIT + 4) / 5 + 1)
+
+/* The state of an OptHamt_Next() iteration: the path to the next entry. */
+typedef struct {
+    OptHamtNode *it_nodes[OPTHAMT_MAXDEPTH];
+    size_t it_pos[OPTHAMT_MAXDEPTH];
+    int it_depth;
+} OptHamtIter;
+
+OptHamt *OptHamt_New(OptDict *like, OptHamtValueFunc retain,
+                     OptHamtValueFunc release);
+OptHamt *OptHamt_FromDict(OptDict *mp, OptHamtValueFunc retain,
+                          OptHamtValueFunc release);
+void OptHamt_Dealloc(OptHamt *hm);
+void *OptHamt_GetItem(OptHamt *hm, void *key, long hash);
+OptHamt *OptHamt_Assoc(OptHamt *hm, void *key, long hash, void *value);
+OptHamt *OptHamt_Dissoc(OptHamt *hm, void *key, long hash);
+size_t OptHamt_Size(OptHamt *hm);
+void OptHamt_Iter(OptHamt *hm, OptHamtIter *it);
+int OptHamt_Next(OptHamt *hm, OptHamtIter *it, void **pkey, void **pvalue);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !OPTHAMT_H */
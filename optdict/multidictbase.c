@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "multidictbase.h"
+
+    OptMultiDict *
+OptMultiDict_New(enum key_t key_type, enum elem_t elem_type)
+{
+    register OptMultiDict *mm;
+
+    if (TypedList_ItemSize(elem_type) == 0)
+        return NULL;
+    mm = malloc(sizeof(OptMultiDict));
+    if (mm == NULL)
+        return NULL;
+    mm->mm_dict = OptDict_New(key_type);
+    if (mm->mm_dict == NULL) {
+        free(mm);
+        return NULL;
+    }
+    mm->mm_type = elem_type;
+    mm->mm_nrows = 0;
+    mm->mm_rows = NULL;
+    mm->mm_rowsallocated = 0;
+    mm->mm_offsets = NULL;
+    mm->mm_values = NULL;
+    return mm;
+}
+
+    void
+OptMultiDict_Dealloc(OptMultiDict *mm)
+{
+    size_t i;
+
+    if (mm == NULL)
+        return;
+    if (mm->mm_rows != NULL) {
+        for (i = 0; i < mm->mm_nrows; i++)
+            free(mm->mm_rows[i].ls_items);
+        free(mm->mm_rows);
+    }
+    free(mm->mm_offsets);
+    TypedList_Dealloc(mm->mm_values);
+    OptDict_Dealloc(mm->mm_dict);
+    free(mm);
+}
+
+/* Make room for one more row, over-allocating like TypedList_Resize(). */
+    static int
+grow_rows(OptMultiDict *mm)
+{
+    TypedList *rows;
+    size_t n = mm->mm_nrows + 1;
+    size_t new_allocated = n + (n >> 3) + (n < 9 ? 3 : 6);
+
+    if (new_allocated > (size_t)-1 / sizeof(TypedList))
+        return ERR_NO_MEM;
+    rows = realloc(mm->mm_rows, new_allocated * sizeof(TypedList));
+    if (rows == NULL)
+        return ERR_NO_MEM;
+    mm->mm_rows = rows;
+    mm->mm_rowsallocated = new_allocated;
+    return 0;
+}
+
+/* Append a copy of *value to key's values, creating the row if key is new.
+ * This is a single lookup in mm_dict whether or not the key was present.
+ */
+    int
+OptMultiDict_Append(OptMultiDict *mm, void *key, long hash, void *value)
+{
+    OptDictValue row, *rowp;
+    TypedList *ls;
+    int inserted;
+
+    if (mm->mm_offsets != NULL)
+        return ERR_FROZEN;
+    if (mm->mm_nrows == mm->mm_rowsallocated && grow_rows(mm) != 0)
+        return ERR_NO_MEM;
+    row.v_long = (long)mm->mm_nrows;
+    rowp = OptDict_SetDefault(mm->mm_dict, key, hash, &row, &inserted);
+    if (rowp == NULL)
+        return ERR_NO_MEM;
+    ls = &mm->mm_rows[rowp->v_long];
+    if (inserted) {
+        ls->ls_items = NULL;
+        ls->ls_size = ls->ls_allocated = 0;
+        ls->ls_itemsize = TypedList_ItemSize(mm->mm_type);
+        ls->ls_type = mm->mm_type;
+        mm->mm_nrows++;
+    }
+    return TypedList_Append(ls, value);
+}
+
+/* Return a pointer to key's values, packed contiguously, and store how many
+ * there are in *n.  Returns NULL (and sets *n to 0) if key isn't present.
+ * Until the multidict is frozen the pointer is only good until the next
+ * append to the same key.
+ */
+    void *
+OptMultiDict_GetItem(OptMultiDict *mm, void *key, long hash, size_t *n)
+{
+    OptDictValue *rowp = OptDict_GetItem(mm->mm_dict, key, hash);
+    size_t row, start;
+    TypedList *ls;
+
+    if (rowp == NULL) {
+        *n = 0;
+        return NULL;
+    }
+    row = (size_t)rowp->v_long;
+    if (mm->mm_offsets != NULL) {
+        start = mm->mm_offsets[row];
+        *n = mm->mm_offsets[row + 1] - start;
+        return TypedList_GET_ITEM(mm->mm_values, start);
+    }
+    ls = &mm->mm_rows[row];
+    *n = ls->ls_size;
+    return ls->ls_items;
+}
+
+/* The number of distinct keys. */
+    size_t
+OptMultiDict_Size(OptMultiDict *mm)
+{
+    return mm->mm_nrows;
+}
+
+/* Pack every row into one array, in row (first-insertion) order, and release
+ * the per-row lists.  Freezing twice is harmless.
+ */
+    int
+OptMultiDict_Freeze(OptMultiDict *mm)
+{
+    size_t i, total = 0;
+    size_t *offsets;
+    TypedList *values;
+
+    if (mm->mm_offsets != NULL)
+        return 0;
+    for (i = 0; i < mm->mm_nrows; i++)
+        total += mm->mm_rows[i].ls_size;
+    offsets = malloc((mm->mm_nrows + 1) * sizeof(size_t));
+    if (offsets == NULL)
+        return ERR_NO_MEM;
+    values = TypedList_NewPresized(mm->mm_type, total);
+    if (values == NULL) {
+        free(offsets);
+        return ERR_NO_MEM;
+    }
+    values->ls_size = total;
+    total = 0;
+    for (i = 0; i < mm->mm_nrows; i++) {
+        offsets[i] = total;
+        if (mm->mm_rows[i].ls_size > 0)
+            memcpy(TypedList_GET_ITEM(values, total), mm->mm_rows[i].ls_items,
+                   mm->mm_rows[i].ls_size * values->ls_itemsize);
+        total += mm->mm_rows[i].ls_size;
+        free(mm->mm_rows[i].ls_items);
+    }
+    offsets[mm->mm_nrows] = total;
+    free(mm->mm_rows);
+    mm->mm_rows = NULL;
+    mm->mm_rowsallocated = 0;
+    mm->mm_offsets = offsets;
+    mm->mm_values = values;
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef OPTMULTIDICT_H
+#define OPTMULTIDICT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "optdictbase.h"
+#include "typedlistbase.h"
+
+/*
+An OptMultiDict maps each key to a sequence of values of one element type:
+the typed version of
+
+    d.setdefault(key, []).append(value)
+
+The keys live in an OptDict whose value (v_long) is the key's row number.
+While the multidict is being built, row i's values are in the growable
+mm_rows[i].  OptMultiDict_Freeze() packs all rows into a single array in
+compressed sparse row (CSR) layout -- row i is mm_values[mm_offsets[i] :
+mm_offsets[i+1]] -- and frees the per-row storage; a frozen multidict can't
+be appended to.
+*/
+typedef struct _optmultidict OptMultiDict;
+struct _optmultidict {
+    OptDict *mm_dict;
+    enum elem_t mm_type;
+    size_t mm_nrows;
+
+    /* Building: mm_rows has room for mm_rowsallocated rows. */
+    TypedList *mm_rows;
+    size_t mm_rowsallocated;
+
+    /* Frozen: mm_nrows + 1 offsets into mm_values. */
+    size_t *mm_offsets;
+    TypedList *mm_values;
+};
+
+OptMultiDict *OptMultiDict_New(enum key_t, enum elem_t);
+void OptMultiDict_Dealloc(OptMultiDict *mm);
+int OptMultiDict_Append(OptMultiDict *mm, void *key, long hash, void *value);
+void *OptMultiDict_GetItem(OptMultiDict *mm, void *key, long hash, size_t *n);
+size_t OptMultiDict_Size(OptMultiDict *mm);
+int OptMultiDict_Freeze(OptMultiDict *mm);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !OPTMULTIDICT_H */
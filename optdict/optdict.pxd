@@ -1,16 +1,221 @@
 cdef extern from "optdictbase.h":
     
+    ctypedef union OptDictValue:
+        void *v_ptr
+        long v_long
+        double v_double
+
     ctypedef struct OptDictEntry:
         pass
 
-    ctypedef struct _OptDict "OptDict":
+    ctypedef struct OptDictAllocator:
         pass
 
+    ctypedef struct OptDictValueType:
+        size_t vt_size
+        size_t vt_align
+        const char *vt_format
+
+    const OptDictValueType OptDict_Int8, OptDict_UInt8
+    const OptDictValueType OptDict_Int16, OptDict_UInt16
+    const OptDictValueType OptDict_Int32, OptDict_UInt32
+    const OptDictValueType OptDict_Int64, OptDict_UInt64
+    const OptDictValueType OptDict_Float32, OptDict_Float64
+    const OptDictValueType OptDict_Complex64, OptDict_Complex128
+
+    enum value_layout:
+        VALUES_IN_ENTRIES
+        VALUES_WITH_KEYS
+        VALUES_SEPARATE
+
+    enum reduce_op:
+        REDUCE_SUM
+        REDUCE_MIN
+        REDUCE_MAX
+
+    enum merge_policy:
+        MERGE_OVERWRITE
+        MERGE_KEEP
+        MERGE_SUM
+        MERGE_MIN
+        MERGE_MAX
+        MERGE_SUM_DOUBLE
+        MERGE_MIN_DOUBLE
+        MERGE_MAX_DOUBLE
+
+    ctypedef int (*OptDictVisitFunc)(void *key, void *value,
+                                     void *arg) noexcept nogil
+
+    const OptDictAllocator OptDict_Pool
+
+    ctypedef struct _OptDict "OptDict":
+        size_t ma_mask
+        OptDictEntry *ma_table
+        int ma_frozen
+        size_t *ma_counts
+        const OptDictValueType *ma_valtype
+
     enum key_t:
         INT_KEY
         FLOAT_KEY
         DOUBLE_KEY
+        BYTES_KEY
 
-    _OptDict *OptDict_New(int)
-    int OptDict_SetItem(_OptDict *mp, void *key, long hash, void *value, void *oldvalue)
+    enum:
+        optdict_CACHESIZE
+        ERR_NO_MEM
+        ERR_FROZEN
+        ERR_NO_KEY
+        ERR_KEY_TYPE
+        ERR_VALUE_TYPE
+        ERR_NOT_SORTED
+        OPTDICT_TABLE_MMAP
+        OPTDICT_TABLE_HUGETLB
+        OPTDICT_TABLE_THP
+        OPTDICT_TABLE_INTERLEAVE
+        OPTDICT_TABLE_BIND
+
+    _OptDict *OptDict_New(key_t)
+    _OptDict *OptDict_NewBytes(size_t keysize)
+    _OptDict *OptDict_NewEx(key_t, size_t keysize,
+                            const OptDictAllocator *allocator)
+    void OptDict_Dealloc(_OptDict *mp)
+    void *OptDict_GetItem(_OptDict *mp, void *key, long hash)
+    int OptDict_SetItem(_OptDict *mp, void *key, long hash, void *value)
+    void *OptDict_SetDefault(_OptDict *mp, void *key, long hash,
+                             void *defaultvalue, int *inserted)
+    int OptDict_DelItem(_OptDict *mp, void *key, long hash)
+    int OptDict_Pop(_OptDict *mp, void *key, long hash, void *oldvalue)
+    size_t OptDict_Size(_OptDict *mp) nogil
+    int OptDict_EnableCache(_OptDict *mp, size_t nways)
+    void OptDict_CacheStats(_OptDict *mp, size_t *hits, size_t *misses)
+    int OptDict_EnableFilter(_OptDict *mp, int enable)
+    int OptDict_Freeze(_OptDict *mp)
+    int OptDict_SampleAccesses(_OptDict *mp, size_t period)
+    int OptDict_Optimize(_OptDict *mp, const size_t *access_counts)
+    int OptDict_CompilePerfect(_OptDict *mp)
+    void OptDict_SetResizeStep(_OptDict *mp, size_t step)
+    void OptDict_FinishResize(_OptDict *mp)
+    int OptDict_SetTableAlloc(_OptDict *mp, int flags, int node)
+    int OptDict_Compact(_OptDict *mp)
+    int OptDict_SetShrinkPolicy(_OptDict *mp, double maxdummies, double minfill)
+    int OptDict_SetValueType(_OptDict *mp, const OptDictValueType *vt,
+                             value_layout layout)
+    int OptDict_Increment(_OptDict *mp, void *key, long hash, long delta)
+    int OptDict_AddDouble(_OptDict *mp, void *key, long hash, double delta)
+    int OptDict_MinLong(_OptDict *mp, void *key, long hash, long x)
+    int OptDict_MaxLong(_OptDict *mp, void *key, long hash, long x)
+    int OptDict_MinDouble(_OptDict *mp, void *key, long hash, double x)
+    int OptDict_MaxDouble(_OptDict *mp, void *key, long hash, double x)
+    int OptDict_CountArray(_OptDict *mp, void *keys, size_t n)
+    int OptDict_SetMany(_OptDict *mp, const void *keys, const void *values,
+                        size_t n)
+    void OptDict_SetPrefetch(_OptDict *mp, size_t distance)
+    int OptDict_Reserve(_OptDict *mp, size_t n) nogil
+    int OptDict_Factorize(_OptDict *mp, const void *keys, size_t n,
+                          long *groups) nogil
+    void OptDict_GetMany(_OptDict *mp, const void *keys, size_t n,
+                         void **values) nogil
+    size_t OptDict_Keys(_OptDict *mp, void *out)
+    size_t OptDict_Values(_OptDict *mp, void *out)
+    int OptDict_Next(_OptDict *mp, size_t *ppos, void **pkey, void **pvalue)
+    size_t OptDict_NextBlock(_OptDict *mp, size_t *ppos, void *keys,
+                             void *values, size_t max)
+    int OptDict_Merge(_OptDict *mp, _OptDict *other, merge_policy policy)
+    _OptDict *OptDict_Copy(_OptDict *mp)
+    size_t OptDict_Join(_OptDict *a, _OptDict *b, void *keys, void *avalues,
+                        void *bvalues)
+    int OptDict_ReduceLong(_OptDict *mp, reduce_op op, size_t nthreads,
+                           long *result) nogil
+    int OptDict_ReduceDouble(_OptDict *mp, reduce_op op, size_t nthreads,
+                             double *result) nogil
+    int OptDict_ParallelForEach(_OptDict *mp, size_t nthreads,
+                                OptDictVisitFunc func, void *args,
+                                size_t argsize)
+    size_t OptDict_ParallelCount(_OptDict *mp, size_t nthreads,
+                                 OptDictVisitFunc pred, void *arg)
+    _OptDict *OptDict_ParallelFilter(_OptDict *mp, size_t nthreads,
+                                     OptDictVisitFunc pred, void *arg)
     long int_hash(int)
+    long double_hash(double)
+    long bytes_hash(void *, size_t)
+
+cdef extern from "typedlistbase.h":
+
+    ctypedef struct _TypedList "TypedList":
+        char *ls_items
+        size_t ls_size
+        size_t ls_allocated
+        size_t ls_itemsize
+
+    enum elem_t:
+        INT_ELEM
+        LONG_ELEM
+        FLOAT_ELEM
+        DOUBLE_ELEM
+
+    _TypedList *TypedList_New(elem_t)
+    void TypedList_Dealloc(_TypedList *ls)
+    int TypedList_Reserve(_TypedList *ls, size_t minallocated)
+    int TypedList_Append(_TypedList *ls, void *item)
+    int TypedList_Extend(_TypedList *ls, void *items, size_t n)
+    void *TypedList_GetItem(_TypedList *ls, size_t i)
+    int TypedList_SetItem(_TypedList *ls, size_t i, void *item)
+    void TypedList_Clear(_TypedList *ls)
+
+cdef extern from "multidictbase.h":
+
+    ctypedef struct _OptMultiDict "OptMultiDict":
+        pass
+
+    _OptMultiDict *OptMultiDict_New(key_t, elem_t)
+    void OptMultiDict_Dealloc(_OptMultiDict *mm)
+    int OptMultiDict_Append(_OptMultiDict *mm, void *key, long hash, void *value)
+    void *OptMultiDict_GetItem(_OptMultiDict *mm, void *key, long hash, size_t *n)
+    size_t OptMultiDict_Size(_OptMultiDict *mm)
+    int OptMultiDict_Freeze(_OptMultiDict *mm)
+
+cdef extern from "hamtbase.h":
+
+    ctypedef struct _OptHamt "OptHamt":
+        pass
+
+    ctypedef struct OptHamtIter:
+        pass
+
+    ctypedef void (*OptHamtValueFunc)(void *value)
+
+    _OptHamt *OptHamt_New(_OptDict *like, OptHamtValueFunc retain,
+                          OptHamtValueFunc release)
+    _OptHamt *OptHamt_FromDict(_OptDict *mp, OptHamtValueFunc retain,
+                               OptHamtValueFunc release)
+    void OptHamt_Dealloc(_OptHamt *hm)
+    void *OptHamt_GetItem(_OptHamt *hm, void *key, long hash)
+    _OptHamt *OptHamt_Assoc(_OptHamt *hm, void *key, long hash, void *value)
+    _OptHamt *OptHamt_Dissoc(_OptHamt *hm, void *key, long hash)
+    size_t OptHamt_Size(_OptHamt *hm)
+    void OptHamt_Iter(_OptHamt *hm, OptHamtIter *it)
+    int OptHamt_Next(_OptHamt *hm, OptHamtIter *it, void **pkey, void **pvalue)
+
+cdef extern from "sorteddictbase.h":
+
+    ctypedef struct _OptSortedDict "OptSortedDict":
+        pass
+
+    ctypedef struct OptSortedIter:
+        pass
+
+    _OptSortedDict *OptSortedDict_New(key_t, size_t keysize,
+                                      const OptDictValueType *vt)
+    void OptSortedDict_Dealloc(_OptSortedDict *sd)
+    void *OptSortedDict_GetItem(_OptSortedDict *sd, const void *key)
+    int OptSortedDict_SetItem(_OptSortedDict *sd, const void *key,
+                              const void *value)
+    int OptSortedDict_DelItem(_OptSortedDict *sd, const void *key)
+    size_t OptSortedDict_Size(_OptSortedDict *sd)
+    int OptSortedDict_FromSorted(_OptSortedDict *sd, const void *keys,
+                                 const void *values, size_t n)
+    void OptSortedDict_Range(_OptSortedDict *sd, OptSortedIter *it,
+                             const void *lo, const void *hi)
+    int OptSortedDict_Next(_OptSortedDict *sd, OptSortedIter *it, void **pkey,
+                           void **pvalue)
@@ -1,35 +1,2302 @@
-from libc.stdlib cimport malloc, free
+from libc.stdlib cimport malloc, calloc, free
+from libc.string cimport memcpy, memset
+from libc.stdint cimport (int8_t, uint8_t, int16_t, uint16_t, int32_t,
+        uint32_t, int64_t, uint64_t, INT64_MIN, INT64_MAX)
 from cpython.ref cimport Py_INCREF, Py_DECREF
+from cpython.long cimport PyLong_AsLongLongAndOverflow
+from cpython.buffer cimport (PyObject_CheckBuffer, PyObject_GetBuffer,
+        PyBuffer_Release, PyBUF_FORMAT, PyBUF_C_CONTIGUOUS)
+import math
+import operator
+
+# Table allocation options for OptDict.set_table_alloc().
+TABLE_MMAP = OPTDICT_TABLE_MMAP
+TABLE_HUGETLB = OPTDICT_TABLE_HUGETLB
+TABLE_THP = OPTDICT_TABLE_THP
+TABLE_INTERLEAVE = OPTDICT_TABLE_INTERLEAVE
+TABLE_BIND = OPTDICT_TABLE_BIND
+
+# NumPy dtype kind and item size -> struct format character
+cdef dict _struct_codes = {
+    ('b', 1): '?',
+    ('i', 1): 'b', ('i', 2): 'h', ('i', 4): 'i', ('i', 8): 'q',
+    ('u', 1): 'B', ('u', 2): 'H', ('u', 4): 'I', ('u', 8): 'Q',
+    ('f', 2): 'e', ('f', 4): 'f', ('f', 8): 'd',
+}
+
+cdef object _dtype_struct(dtype):
+    """
+    Return a struct.Struct that packs a tuple of dtype's fields (or a single
+    value of a plain dtype) into dtype's memory layout, with NULs for the
+    padding, so that equal records are equal byte for byte.
+    """
+    import struct
+    fields = [(dtype, 0)] if dtype.fields is None else sorted(
+            (f[:2] for f in dtype.fields.values()), key=lambda f: f[1])
+    fmt = []
+    order = None
+    end = 0
+    for ftype, offset in fields:
+        if ftype.kind in 'SV' and ftype.fields is None and ftype.subdtype is None:
+            code = '{}s'.format(ftype.itemsize)
+        else:
+            code = _struct_codes.get((ftype.kind, ftype.itemsize))
+            if code is None or ftype.subdtype is not None:
+                raise TypeError("can't store {} fields".format(ftype))
+            if ftype.byteorder in '<>':
+                if order not in (None, ftype.byteorder):
+                    raise TypeError("mixed byte orders in {}".format(dtype))
+                order = ftype.byteorder
+        if offset < end:
+            raise TypeError("overlapping fields in {}".format(dtype))
+        if offset > end:
+            fmt.append('{}x'.format(offset - end))
+        fmt.append(code)
+        end = offset + ftype.itemsize
+    if dtype.itemsize > end:
+        fmt.append('{}x'.format(dtype.itemsize - end))
+    return struct.Struct((order or '=') + ''.join(fmt))
+
+cdef int _pack(object st, bytearray buf, object ob) except -1:
+    if isinstance(ob, tuple):
+        st.pack_into(buf, 0, *ob)
+    elif PyObject_CheckBuffer(ob):
+        # A record already in the dtype's layout: bytes, a NumPy scalar.
+        view = memoryview(ob).cast('B')
+        if len(view) != len(buf):
+            raise ValueError("expected {} bytes, got {}".format(len(buf),
+                             len(view)))
+        buf[:] = view
+    else:
+        st.pack_into(buf, 0, ob)
+    return 0
 
 cdef class OptDict:
+    """
+    OptDict(pooled=False, keytype=None, valtype=None, hash_fields=None)
+
+    Maps C int keys to Python objects by default.  keytype and valtype are
+    NumPy dtypes (structured or not) for keys and values stored as raw
+    records of that layout instead: a key is then a tuple of its fields, a
+    plain value, or anything holding its bytes (a NumPy record), and
+    compares equal byte for byte.  hash_fields names the fields of keytype
+    to hash, if not all of them.  Records are read back as tuples, and
+    keys() and values() return them as structured arrays.
+    """
 
     cdef _OptDict *od
+    cdef int int_key
+    cdef readonly object keytype
+    cdef readonly object valtype
+    cdef object keystruct, valstruct
+    cdef bytearray keybuf, valbuf
+    cdef OptDictValueType vt
+    cdef size_t nhash
+    cdef size_t *hashranges
 
-    def __cinit__(self):
-        self.od = OptDict_New(INT_KEY)
+    def __cinit__(self, bint pooled=False, keytype=None, valtype=None,
+                  hash_fields=None):
+        # pooled: take memory from per-thread free lists, which is cheaper
+        # for many short-lived dicts.
+        cdef const OptDictAllocator *allocator = &OptDict_Pool if pooled else NULL
+        cdef size_t i
+        if keytype is None:
+            if hash_fields is not None:
+                raise TypeError("hash_fields needs a structured keytype")
+            self.od = OptDict_NewEx(INT_KEY, 0, allocator)
+        else:
+            import numpy
+            self.keytype = numpy.dtype(keytype)
+            self.keystruct = _dtype_struct(self.keytype)
+            self.keybuf = bytearray(self.keytype.itemsize)
+            if hash_fields is not None:
+                hash_fields = list(hash_fields)
+                if self.keytype.fields is None or not hash_fields:
+                    raise TypeError("hash_fields needs a structured keytype")
+                self.hashranges = <size_t*>malloc(2 * len(hash_fields)
+                                                  * sizeof(size_t))
+                if self.hashranges == NULL:
+                    raise MemoryError()
+                for i, name in enumerate(hash_fields):
+                    ftype, offset = self.keytype.fields[name][:2]
+                    self.hashranges[2*i] = offset
+                    self.hashranges[2*i + 1] = ftype.itemsize
+                self.nhash = len(hash_fields)
+            self.od = OptDict_NewEx(BYTES_KEY, self.keytype.itemsize, allocator)
+        if self.od == NULL:
+            raise MemoryError()
+        if valtype is not None:
+            import numpy
+            self.valtype = numpy.dtype(valtype)
+            self.valstruct = _dtype_struct(self.valtype)
+            self.valbuf = bytearray(self.valtype.itemsize)
+            self.vt.vt_size = self.valtype.itemsize
+            self.vt.vt_align = min(self.valtype.alignment, 8)
+            self.vt.vt_format = NULL
+            if OptDict_SetValueType(self.od, &self.vt,
+                    VALUES_IN_ENTRIES if self.vt.vt_size <= sizeof(OptDictValue)
+                    else VALUES_WITH_KEYS):
+                raise ValueError("can't store {} values".format(self.valtype))
+
+    cdef void *_key(self, object key, long *hash) except NULL:
+        # Return a pointer to key in C form, and its hash in *hash.
+        cdef char *p
+        cdef unsigned long x, mult
+        cdef size_t i
+        if self.keystruct is None:
+            self.int_key = key
+            hash[0] = int_hash(self.int_key)
+            return &self.int_key
+        _pack(self.keystruct, self.keybuf, key)
+        p = self.keybuf
+        if self.hashranges == NULL:
+            hash[0] = bytes_hash(p, len(self.keybuf))
+            return p
+        # Combine the fields' hashes like a tuple's.
+        x = 0x345678UL
+        mult = 1000003UL
+        for i in range(self.nhash):
+            x = (x ^ <unsigned long>bytes_hash(p + self.hashranges[2*i],
+                                               self.hashranges[2*i + 1])) * mult
+            mult += 82520UL + 2 * (self.nhash - i - 1)
+        x += 97531UL
+        hash[0] = -2 if <long>x == -1 else <long>x
+        return p
+
+    cdef object _record(self, void *p):
+        values = self.valstruct.unpack((<char*>p)[:self.vt.vt_size])
+        return values if self.valtype.fields is not None else values[0]
 
     def __setitem__(self, key, value):
-        # XXX: BUG: if key is alreay in the dictionary, then we just replace
-        # value, and do not modify key.  In this case, do not malloc new memory
-        # and store a copy of the key's contents!  Should OptDict_SetItem() be
-        # responsible for allocating new memory and storing the result?
-        cdef int int_key = key
-        cdef int *int_key_p = <int*>malloc(sizeof(int))
-        cdef object oldvalue = None
-        if not int_key_p:
-            raise RuntimeError("")
-        # XXX: BUG: *int_key_p != int_key (!)  How to do the copy in Cython
-        # without a temp variable?
-        cdef int err = OptDict_SetItem(self.od, int_key_p, int_hash(int_key),
-                <void*>value, <void*>oldvalue)
+        cdef long hash
+        cdef void *k = self._key(key, &hash)
+        cdef OptDictValue newvalue
+        cdef OptDictValue *slot
+        cdef void *oldvalue
+        cdef int inserted, err
+        if self.valstruct is not None:
+            _pack(self.valstruct, self.valbuf, value)
+            err = OptDict_SetItem(self.od, k, hash, <char*>self.valbuf)
+            if err == ERR_FROZEN:
+                raise TypeError("can't add a key to a frozen OptDict")
+            elif err:
+                raise MemoryError()
+            return
+        newvalue.v_ptr = <void*>value
+        slot = <OptDictValue*>OptDict_SetDefault(self.od, k, hash, &newvalue,
+                                                 &inserted)
+        if slot == NULL:
+            if self.od.ma_frozen:
+                raise TypeError("can't add a key to a frozen OptDict")
+            raise MemoryError()
+        Py_INCREF(value)
+        if not inserted:
+            # Store the new value before letting go of the old one: the
+            # DECREF can run arbitrary code, including code that touches
+            # this dict.
+            oldvalue = slot.v_ptr
+            slot.v_ptr = <void*>value
+            Py_DECREF(<object>oldvalue)
+
+    def __getitem__(self, key):
+        cdef long hash
+        cdef void *k = self._key(key, &hash)
+        cdef OptDictValue *slot = <OptDictValue*>OptDict_GetItem(self.od, k,
+                                                                 hash)
+        if slot == NULL:
+            raise KeyError(key)
+        if self.valstruct is not None:
+            return self._record(slot)
+        return <object>slot.v_ptr
+
+    def __delitem__(self, key):
+        cdef long hash
+        cdef void *k = self._key(key, &hash)
+        cdef OptDictValue oldvalue
+        cdef int err
+        if self.valstruct is not None:
+            err = OptDict_Pop(self.od, k, hash, NULL)
+        else:
+            err = OptDict_Pop(self.od, k, hash, &oldvalue)
+        if err == ERR_FROZEN:
+            raise TypeError("can't delete a key from a frozen OptDict")
         if err:
-            raise RuntimeError("")
+            raise KeyError(key)
+        if self.valstruct is None:
+            Py_DECREF(<object>oldvalue.v_ptr)
+
+    def __contains__(self, key):
+        cdef long hash
+        cdef void *k = self._key(key, &hash)
+        return OptDict_GetItem(self.od, k, hash) != NULL
+
+    cdef object _key_object(self, void *p):
+        if self.keystruct is None:
+            return (<int*>p)[0]
+        keys = self.keystruct.unpack((<char*>p)[:self.keystruct.size])
+        return keys if self.keytype.fields is not None else keys[0]
+
+    cdef object _value_object(self, void *p):
+        if self.valstruct is None:
+            return <object>(<OptDictValue*>p).v_ptr
+        return self._record(p)
+
+    def _iterate(self, int what):
+        # what: 0 for keys, 1 for values, 2 for (key, value) pairs.
+        cdef size_t pos = 0
+        cdef size_t size = OptDict_Size(self.od)
+        cdef void *k
+        cdef void *v
+        while True:
+            if OptDict_Size(self.od) != size:
+                raise RuntimeError("OptDict changed size during iteration")
+            if not OptDict_Next(self.od, &pos, &k, &v):
+                return
+            if what == 0:
+                yield self._key_object(k)
+            elif what == 1:
+                yield self._value_object(v)
+            else:
+                yield self._key_object(k), self._value_object(v)
+
+    def __iter__(self):
+        return self._iterate(0)
+
+    def items(self):
+        """An iterator over the (key, value) pairs."""
+        return self._iterate(2)
+
+    def keys(self):
+        """
+        The keys, as an array of keytype if the dict has one, else as an
+        iterator.
+        """
+        import numpy
+        cdef unsigned char[::1] out
+        if self.keytype is None:
+            return self._iterate(0)
+        keys = numpy.empty(OptDict_Size(self.od), self.keytype)
+        if len(keys):
+            out = keys.view(numpy.uint8)
+            OptDict_Keys(self.od, &out[0])
+        return keys
+
+    def values(self):
+        """
+        The values, as an array of valtype if the dict has one, else as an
+        iterator, in the same order as keys().
+        """
+        import numpy
+        cdef unsigned char[::1] out
+        if self.valtype is None:
+            return self._iterate(1)
+        values = numpy.empty(OptDict_Size(self.od), self.valtype)
+        if len(values):
+            out = values.view(numpy.uint8)
+            OptDict_Values(self.od, &out[0])
+        return values
+
+    def __len__(self):
+        return OptDict_Size(self.od)
+
+    def copy(self):
+        """
+        A copy of the dict.  Its table is shared with this one until either
+        is changed (see OptDict_Copy()), so copying takes the same time
+        whatever the size -- except to count the new references to object
+        values.
+        """
+        cdef OptDict new_od = OptDict.__new__(OptDict)
+        cdef size_t pos = 0
+        cdef void *v
+        cdef _OptDict *od = OptDict_Copy(self.od)
+        if od == NULL:
+            raise MemoryError()
+        OptDict_Dealloc(new_od.od)
+        new_od.od = od
+        new_od.keytype = self.keytype
+        new_od.valtype = self.valtype
+        new_od.keystruct = self.keystruct
+        new_od.valstruct = self.valstruct
+        if self.keybuf is not None:
+            new_od.keybuf = bytearray(len(self.keybuf))
+        if self.valbuf is not None:
+            new_od.valbuf = bytearray(len(self.valbuf))
+        if self.hashranges != NULL:
+            new_od.hashranges = <size_t*>malloc(2 * self.nhash * sizeof(size_t))
+            if new_od.hashranges == NULL:
+                raise MemoryError()
+            memcpy(new_od.hashranges, self.hashranges,
+                   2 * self.nhash * sizeof(size_t))
+            new_od.nhash = self.nhash
+        if self.valstruct is not None:
+            new_od.vt = self.vt
+            od.ma_valtype = &new_od.vt
+        else:
+            while OptDict_Next(od, &pos, NULL, &v):
+                Py_INCREF(<object>(<OptDictValue*>v).v_ptr)
+        return new_od
+
+    def enable_cache(self, size_t nways=1):
+        """
+        Remember the nways (at most 4) entries most recently looked up and
+        check them before probing the table; nways=0 turns the cache off.
+        Helps when the same key is used several times in a row, as in
+        `if k in d: d[k] = ...`.
+        """
+        if OptDict_EnableCache(self.od, nways):
+            raise ValueError("nways must be at most {}".format(optdict_CACHESIZE))
+
+    def cache_stats(self):
+        """Return (hits, misses) of the lookup cache since it was enabled."""
+        cdef size_t hits, misses
+        OptDict_CacheStats(self.od, &hits, &misses)
+        return hits, misses
+
+    def enable_filter(self, bint enable=True):
+        """
+        Keep a Bloom filter of the keys, checked before the table on each
+        lookup, so that most lookups of missing keys cost one cache miss
+        instead of a probe sequence.  Worth it when lookups mostly miss;
+        freeze() fits it to the final keys.
+        """
+        if OptDict_EnableFilter(self.od, enable):
+            raise MemoryError()
+
+    def set_resize_step(self, size_t step):
+        """
+        Grow the table incrementally: after a resize, each insertion moves
+        `step` old slots to the new table, so no single insertion pays for
+        rehashing everything.  step=0 (the default) resizes all at once.
+        """
+        OptDict_SetResizeStep(self.od, step)
+
+    def set_table_alloc(self, int flags, int node=-1):
+        """
+        Choose how big tables (2 MB and up) are allocated from now on: flags
+        is 0 for the default, or a combination of TABLE_MMAP (fresh mappings,
+        zeroed lazily by the kernel), TABLE_HUGETLB or TABLE_THP (huge
+        pages), and TABLE_INTERLEAVE or TABLE_BIND (NUMA placement, the
+        latter on `node`).
+        """
+        if OptDict_SetTableAlloc(self.od, flags, node):
+            raise ValueError("table allocation options not supported here")
+
+    def compact(self):
+        """
+        Rebuild the table to fit the keys left after deletions, dropping
+        the dummy entries deleted keys leave behind, and free the memory of
+        the deleted keys.
+        """
+        if OptDict_Compact(self.od):
+            raise MemoryError()
+
+    def set_shrink_policy(self, double max_dummies=0.0, double min_fill=0.0):
+        """
+        Have deletions compact() the dict when more than max_dummies of the
+        table's slots hold deleted entries, or fewer than min_fill (< 0.25)
+        are in use.  0 turns a test off.
+        """
+        if OptDict_SetShrinkPolicy(self.od, max_dummies, min_fill):
+            raise ValueError("need 0 <= max_dummies < 1, 0 <= min_fill < 0.25")
+
+    def freeze(self):
+        """
+        Fix the set of keys: values can still be replaced, but adding or
+        deleting a key raises TypeError.  Lookups in a frozen dict are a
+        little cheaper.
+        """
+        if OptDict_Freeze(self.od):
+            raise MemoryError()
+
+    def sample_accesses(self, size_t period=1):
+        """
+        Count one of every `period` successful lookups in this frozen dict,
+        for a later optimize(); period=0 stops counting.
+        """
+        if not self.od.ma_frozen:
+            raise TypeError("sample_accesses() needs a frozen OptDict")
+        if OptDict_SampleAccesses(self.od, period):
+            raise MemoryError()
+
+    def optimize(self, counts=None):
+        """
+        Freeze the dict and rearrange its table so that the most often used
+        keys are found on the first probe.  counts maps keys to their access
+        frequency; without it, the counts gathered since sample_accesses()
+        are used.
+        """
+        cdef size_t *slot_counts
+        cdef void *k
+        cdef long hash
+        cdef char *slot
+        if counts is None:
+            if self.od.ma_counts == NULL:
+                raise ValueError("no counts given and none sampled")
+            if OptDict_Optimize(self.od, NULL):
+                raise MemoryError()
+            return
+        if self.vt.vt_size > sizeof(OptDictValue):
+            raise TypeError("optimize(counts) needs values that fit in the "
+                            "entries; use sample_accesses()")
+        self.freeze()
+        slot_counts = <size_t*>calloc(self.od.ma_mask + 1, sizeof(size_t))
+        if slot_counts == NULL:
+            raise MemoryError()
+        try:
+            for key, count in counts.items():
+                k = self._key(key, &hash)
+                slot = <char*>OptDict_GetItem(self.od, k, hash)
+                if slot == NULL:
+                    raise KeyError(key)
+                # The value pointer is inside the key's entry, so this
+                # rounds down to the entry's index in the table.
+                slot_counts[(slot - <char*>self.od.ma_table)
+                            // sizeof(OptDictEntry)] += count
+            if OptDict_Optimize(self.od, slot_counts):
+                raise MemoryError()
+        finally:
+            free(slot_counts)
+
+    def compile_perfect(self):
+        """
+        Freeze the dict and rebuild it around a minimal perfect hash: every
+        lookup is one probe and one key comparison, and the table has no
+        empty slots.  For key sets that never change, like symbol tables.
+        """
+        if OptDict_CompilePerfect(self.od):
+            raise MemoryError()
+
+    def __dealloc__(self):
+        cdef size_t pos = 0
+        cdef void *v
+        if self.od != NULL and self.valstruct is None:
+            while OptDict_Next(self.od, &pos, NULL, &v):
+                Py_DECREF(<object>(<OptDictValue*>v).v_ptr)
+        OptDict_Dealloc(self.od)
+        free(self.hashranges)
+
+
+# A range of OptCounter values, for the parallel scans' callbacks.
+cdef struct _interval:
+    bint isdouble
+    long llo, lhi
+    double dlo, dhi
+
+cdef int _in_interval(void *key, void *value, void *arg) noexcept nogil:
+    cdef _interval *iv = <_interval *>arg
+    cdef OptDictValue *v = <OptDictValue *>value
+    if iv.isdouble:
+        return iv.dlo <= v.v_double < iv.dhi
+    return iv.llo <= v.v_long < iv.lhi
+
+cdef int _clip_value(void *key, void *value, void *arg) noexcept nogil:
+    cdef _interval *iv = <_interval *>arg
+    cdef OptDictValue *v = <OptDictValue *>value
+    if iv.isdouble:
+        if v.v_double < iv.dlo:
+            v.v_double = iv.dlo
+        elif v.v_double > iv.dhi:
+            v.v_double = iv.dhi
+    elif v.v_long < iv.llo:
+        v.v_long = iv.llo
+    elif v.v_long > iv.lhi:
+        v.v_long = iv.lhi
+    return 0
+
+cdef class OptCounter:
+    """
+    OptCounter(typecode='l')
+
+    A dict of int keys to C long ('l') or double ('d') values, updated in
+    place: add(), update_min() and update_max() each look the key up once
+    and modify the stored value, adding the key if it's missing.
+    count_array() counts a whole array of keys in one call.  sum(), min()
+    and max() reduce the values on several threads, and count(), select()
+    and clip() scan them on several threads.
+    """
+
+    cdef _OptDict *od
+    cdef bint isdouble
+    cdef readonly object typecode
+
+    def __cinit__(self, typecode='l'):
+        if typecode not in ('l', 'd'):
+            raise ValueError("bad typecode {!r} (must be 'l' or 'd')".format(
+                             typecode))
+        self.typecode = typecode
+        self.isdouble = typecode == 'd'
+        self.od = OptDict_New(INT_KEY)
+        if self.od == NULL:
+            raise MemoryError()
+
+    def __dealloc__(self):
+        OptDict_Dealloc(self.od)
+
+    def add(self, key, delta=1):
+        """self[key] = self.get(key, 0) + delta, with one lookup."""
+        cdef int int_key = key
+        cdef int err
+        if self.isdouble:
+            err = OptDict_AddDouble(self.od, &int_key, int_hash(int_key), delta)
+        else:
+            err = OptDict_Increment(self.od, &int_key, int_hash(int_key), delta)
+        if err:
+            raise MemoryError()
+
+    def update_min(self, key, x):
+        """self[key] = min(self[key], x), or x if key is missing."""
+        cdef int int_key = key
+        cdef int err
+        if self.isdouble:
+            err = OptDict_MinDouble(self.od, &int_key, int_hash(int_key), x)
+        else:
+            err = OptDict_MinLong(self.od, &int_key, int_hash(int_key), x)
+        if err:
+            raise MemoryError()
+
+    def update_max(self, key, x):
+        """self[key] = max(self[key], x), or x if key is missing."""
+        cdef int int_key = key
+        cdef int err
+        if self.isdouble:
+            err = OptDict_MaxDouble(self.od, &int_key, int_hash(int_key), x)
+        else:
+            err = OptDict_MaxLong(self.od, &int_key, int_hash(int_key), x)
+        if err:
+            raise MemoryError()
+
+    def count_array(self, const int[::1] keys):
+        """
+        Add 1 to the count of each key in keys, a contiguous buffer of C ints
+        (e.g. a NumPy int32 array).
+        """
+        if self.isdouble:
+            raise TypeError("count_array() needs an OptCounter of typecode 'l'")
+        if keys.shape[0] > 0 and OptDict_CountArray(self.od, <void*>&keys[0],
+                                                    keys.shape[0]):
+            raise MemoryError()
+
+    cdef object _reduce(self, reduce_op op, size_t nthreads):
+        cdef long l
+        cdef double d
+        cdef int err
+        # The scan runs on threads of its own already; it keeps the GIL so
+        # that no other Python thread can add to (and resize) the table
+        # under it.
+        if self.isdouble:
+            err = OptDict_ReduceDouble(self.od, op, nthreads, &d)
+        else:
+            err = OptDict_ReduceLong(self.od, op, nthreads, &l)
+        if err == ERR_NO_KEY:
+            raise ValueError("empty OptCounter")
+        elif err:
+            raise MemoryError()
+        return d if self.isdouble else l
+
+    cdef int _bounds(self, object lo, object hi, _interval *iv) except -1:
+        iv.isdouble = self.isdouble
+        if self.isdouble:
+            iv.dlo = lo
+            iv.dhi = hi
+        else:
+            iv.llo = lo
+            iv.lhi = hi
+        return 0
+
+    def count(self, lo, hi, size_t nthreads=0):
+        """The number of values with lo <= value < hi, as for sum()."""
+        cdef _interval iv
+        cdef size_t n
+        self._bounds(lo, hi, &iv)
+        n = OptDict_ParallelCount(self.od, nthreads, _in_interval, &iv)
+        if n == <size_t>-1:
+            raise MemoryError()
+        return n
+
+    def select(self, lo, hi, size_t nthreads=0):
+        """
+        A new OptCounter of the items with lo <= value < hi, picked out on
+        nthreads threads as for sum().
+        """
+        cdef _interval iv
+        cdef OptCounter result = OptCounter(self.typecode)
+        cdef _OptDict *od
+        self._bounds(lo, hi, &iv)
+        od = OptDict_ParallelFilter(self.od, nthreads, _in_interval, &iv)
+        if od == NULL:
+            raise MemoryError()
+        OptDict_Dealloc(result.od)
+        result.od = od
+        return result
+
+    def clip(self, lo, hi, size_t nthreads=0):
+        """
+        Clamp every value to lo <= value <= hi in place, on nthreads threads
+        as for sum().
+        """
+        cdef _interval iv
+        if lo > hi:
+            raise ValueError("lo must be at most hi")
+        self._bounds(lo, hi, &iv)
+        if OptDict_ParallelForEach(self.od, nthreads, _clip_value, &iv, 0):
+            raise MemoryError()
+
+    def merge(self, OptCounter other, policy='sum'):
+        """
+        Merge other, an OptCounter of the same typecode, into this one.
+        Keys only in other are copied; for keys in both, policy picks the
+        new value: 'sum', 'min' or 'max' of the two, 'overwrite' (other's)
+        or 'keep' (this one's).
+        """
+        cdef merge_policy p = _policy(policy, self.isdouble)
+        if other.typecode != self.typecode:
+            raise TypeError("can't merge an OptCounter of typecode {!r} into "
+                            "one of {!r}".format(other.typecode, self.typecode))
+        if OptDict_Merge(self.od, other.od, p):
+            raise MemoryError()
+
+    def sum(self, size_t nthreads=0):
+        """
+        The sum of the values, added up on nthreads threads (0 for one per
+        CPU).  Sums of longs wrap around.
+        """
+        return self._reduce(REDUCE_SUM, nthreads)
+
+    def min(self, size_t nthreads=0):
+        """The smallest value, as for sum()."""
+        return self._reduce(REDUCE_MIN, nthreads)
+
+    def max(self, size_t nthreads=0):
+        """The largest value, as for sum()."""
+        return self._reduce(REDUCE_MAX, nthreads)
+
+    def __getitem__(self, key):
+        cdef int int_key = key
+        cdef OptDictValue *slot = <OptDictValue*>OptDict_GetItem(self.od,
+                &int_key, int_hash(int_key))
+        if slot == NULL:
+            raise KeyError(key)
+        if self.isdouble:
+            return slot.v_double
+        return slot.v_long
+
+    def __contains__(self, key):
+        cdef int int_key = key
+        return OptDict_GetItem(self.od, &int_key, int_hash(int_key)) != NULL
+
+    def __len__(self):
+        return OptDict_Size(self.od)
+
+
+# typecode of OptTypedDict -> its value type
+cdef const OptDictValueType *_valuetype(typecode) except NULL:
+    if typecode == 'b': return &OptDict_Int8
+    if typecode == 'B': return &OptDict_UInt8
+    if typecode == 'h': return &OptDict_Int16
+    if typecode == 'H': return &OptDict_UInt16
+    if typecode == 'i': return &OptDict_Int32
+    if typecode == 'I': return &OptDict_UInt32
+    if typecode == 'q': return &OptDict_Int64
+    if typecode == 'Q': return &OptDict_UInt64
+    if typecode == 'f': return &OptDict_Float32
+    if typecode == 'd': return &OptDict_Float64
+    if typecode == 'Zf': return &OptDict_Complex64
+    if typecode == 'Zd': return &OptDict_Complex128
+    raise ValueError("bad typecode {!r}".format(typecode))
+
+# merge() policy -> merge_policy, and its v_double version
+cdef dict _policies = {
+    'overwrite': (MERGE_OVERWRITE, MERGE_OVERWRITE),
+    'keep': (MERGE_KEEP, MERGE_KEEP),
+    'sum': (MERGE_SUM, MERGE_SUM_DOUBLE),
+    'min': (MERGE_MIN, MERGE_MIN_DOUBLE),
+    'max': (MERGE_MAX, MERGE_MAX_DOUBLE),
+}
+
+cdef merge_policy _policy(policy, bint isdouble) except *:
+    if policy not in _policies:
+        raise ValueError("bad policy {!r} (must be 'overwrite', 'keep', "
+                         "'sum', 'min' or 'max')".format(policy))
+    return _policies[policy][isdouble]
+
+cdef dict _layouts = {
+    'entries': VALUES_IN_ENTRIES,
+    'keys': VALUES_WITH_KEYS,
+    'separate': VALUES_SEPARATE,
+}
+
+cdef class OptTypedDict:
+    """
+    OptTypedDict(typecode='d', layout=None)
+
+    A dict of int keys to values of one C type, stored by value.  typecode is
+    'b', 'h', 'i' or 'q' (8- to 64-bit ints; 'B', 'H', 'I', 'Q' unsigned),
+    'f' or 'd' (float, double), 'Zf' or 'Zd' (complex), or 'Ns' for strings
+    of N bytes, padded with NULs.  layout says where the values go:
+    'entries' (in the hash table itself, for values of up to 8 bytes),
+    'keys' (next to each key) or 'separate' (packed on their own).  The
+    default is 'entries' if the values fit, else 'keys'.  merge() and join()
+    combine two OptTypedDicts without going through Python objects.
+    """
+
+    cdef _OptDict *od
+    cdef OptDictValueType vt
+    cdef char kind
+    cdef void *scratch
+    cdef readonly object typecode
+    cdef readonly object layout
+
+    def __cinit__(self, typecode='d', layout=None):
+        if typecode.endswith('s') and typecode[:-1].isdigit():
+            self.vt.vt_size = int(typecode[:-1])
+            self.vt.vt_align = 1
+            self.vt.vt_format = NULL
+            self.kind = b's'
+            if self.vt.vt_size == 0:
+                raise ValueError("bad typecode {!r}".format(typecode))
+        else:
+            self.vt = _valuetype(typecode)[0]
+            self.kind = ord(typecode[-1].upper() if typecode[0] == 'Z'
+                            else typecode)
+        if layout is None:
+            layout = 'entries' if self.vt.vt_size <= sizeof(OptDictValue) else 'keys'
+        if layout not in _layouts:
+            raise ValueError("bad layout {!r} (must be 'entries', 'keys' or "
+                             "'separate')".format(layout))
+        self.typecode = typecode
+        self.layout = layout
+        self.scratch = malloc(self.vt.vt_size)
+        self.od = OptDict_New(INT_KEY)
+        if self.scratch == NULL or self.od == NULL:
+            raise MemoryError()
+        if OptDict_SetValueType(self.od, &self.vt, _layouts[layout]):
+            raise ValueError("{!r} values don't fit in the entries".format(
+                             typecode))
+
+    def __dealloc__(self):
+        OptDict_Dealloc(self.od)
+        free(self.scratch)
+
+    cdef int _unbox(self, object ob, void *p) except -1:
+        cdef bytes b
+        cdef double complex z
+        if self.kind == b'b': (<int8_t *>p)[0] = ob
+        elif self.kind == b'B': (<uint8_t *>p)[0] = ob
+        elif self.kind == b'h': (<int16_t *>p)[0] = ob
+        elif self.kind == b'H': (<uint16_t *>p)[0] = ob
+        elif self.kind == b'i': (<int32_t *>p)[0] = ob
+        elif self.kind == b'I': (<uint32_t *>p)[0] = ob
+        elif self.kind == b'q': (<int64_t *>p)[0] = ob
+        elif self.kind == b'Q': (<uint64_t *>p)[0] = ob
+        elif self.kind == b'f': (<float *>p)[0] = ob
+        elif self.kind == b'd': (<double *>p)[0] = ob
+        elif self.kind == b'F':
+            z = ob
+            (<float *>p)[0] = z.real
+            (<float *>p)[1] = z.imag
+        elif self.kind == b'D':
+            z = ob
+            (<double *>p)[0] = z.real
+            (<double *>p)[1] = z.imag
+        else:
+            b = ob
+            if <size_t>len(b) > self.vt.vt_size:
+                raise ValueError("value longer than {} bytes".format(
+                                 self.vt.vt_size))
+            memset(p, 0, self.vt.vt_size)
+            memcpy(p, <char *>b, len(b))
+        return 0
+
+    cdef object _box(self, void *p):
+        if self.kind == b'b': return (<int8_t *>p)[0]
+        if self.kind == b'B': return (<uint8_t *>p)[0]
+        if self.kind == b'h': return (<int16_t *>p)[0]
+        if self.kind == b'H': return (<uint16_t *>p)[0]
+        if self.kind == b'i': return (<int32_t *>p)[0]
+        if self.kind == b'I': return (<uint32_t *>p)[0]
+        if self.kind == b'q': return (<int64_t *>p)[0]
+        if self.kind == b'Q': return (<uint64_t *>p)[0]
+        if self.kind == b'f': return (<float *>p)[0]
+        if self.kind == b'd': return (<double *>p)[0]
+        if self.kind == b'F': return complex((<float *>p)[0], (<float *>p)[1])
+        if self.kind == b'D': return complex((<double *>p)[0], (<double *>p)[1])
+        return (<char *>p)[:self.vt.vt_size]
+
+    cdef bint _accepts(self, const char *format):
+        # Whether a buffer of this struct format (of the right item size)
+        # holds values of our type.  Ints of either C name for a size match.
+        cdef str f = (format.decode('ascii') if format != NULL else 'B').lstrip('@=')
+        cdef str k = chr(self.kind)
+        if k == 's':
+            return f.endswith('s') and f[:-1].isdigit() or f == 's'
+        if k in 'FD':
+            return f == 'Z' + k.lower()
+        if k in 'bhiq':
+            return len(f) == 1 and f in 'bhilq'
+        if k in 'BHIQ':
+            return len(f) == 1 and f in 'BHILQ'
+        return f == k
+
+    def set_many(self, const int[::1] keys, values, size_t prefetch=8):
+        """
+        self[keys[i]] = values[i] for each i, in one call: keys is a
+        contiguous buffer of C ints, values one of as many values in their C
+        form (e.g. NumPy arrays of int32 and of the matching dtype).  The
+        table is grown once up front, and prefetch is how many keys ahead
+        the table is prefetched.
+        """
+        cdef Py_buffer view
+        cdef int err
+        PyObject_GetBuffer(values, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)
+        try:
+            if (<size_t>view.itemsize != self.vt.vt_size
+                    or view.len // view.itemsize != keys.shape[0]):
+                raise ValueError("need {} values of {} bytes".format(
+                                 keys.shape[0], self.vt.vt_size))
+            if not self._accepts(view.format):
+                raise TypeError("can't store {!r} values as {!r}".format(
+                                view.format.decode('ascii') if view.format != NULL
+                                else 'B', self.typecode))
+            if keys.shape[0] == 0:
+                return
+            OptDict_SetPrefetch(self.od, prefetch)
+            err = OptDict_SetMany(self.od, &keys[0], view.buf, keys.shape[0])
+            if err == ERR_FROZEN:
+                raise TypeError("can't add a key to a frozen OptTypedDict")
+            elif err:
+                raise MemoryError()
+        finally:
+            PyBuffer_Release(&view)
+
+    cdef object _dtype(self):
+        if self.kind == b's':
+            return 'S{}'.format(self.vt.vt_size)
+        return {'Zf': 'c8', 'Zd': 'c16'}.get(self.typecode, self.typecode)
+
+    def merge(self, OptTypedDict other, policy='overwrite'):
+        """
+        Merge other into this dict.  Keys only in other are copied; for keys
+        in both, policy picks the new value: 'overwrite' (other's), 'keep'
+        (this one's), or for numbers 'sum', 'min' or 'max' of the two
+        (complex numbers can only be summed).  The values must be of the
+        same type; their layouts may differ.
+        """
+        cdef int err = OptDict_Merge(self.od, other.od, _policy(policy, False))
+        if err == ERR_VALUE_TYPE and other.typecode == self.typecode:
+            raise TypeError("can't take the {} of {!r} values".format(
+                            policy, self.typecode))
+        elif err == ERR_VALUE_TYPE:
+            raise TypeError("can't merge {!r} values into {!r} ones".format(
+                            other.typecode, self.typecode))
+        elif err == ERR_FROZEN:
+            raise TypeError("can't add a key to a frozen OptTypedDict")
+        elif err:
+            raise MemoryError()
+
+    def join(self, OptTypedDict other):
+        """
+        The keys in both dicts, with their values here and in other, as
+        three NumPy arrays, in no particular order.
+        """
+        import numpy
+        cdef size_t n = min(OptDict_Size(self.od), OptDict_Size(other.od))
+        cdef int[::1] k
+        cdef unsigned char[::1] a, b
+        keys = numpy.empty(n, numpy.intc)
+        avalues = numpy.empty(n, self._dtype())
+        bvalues = numpy.empty(n, other._dtype())
+        if n == 0:
+            return keys, avalues, bvalues
+        k = keys
+        a = avalues.view(numpy.uint8)
+        b = bvalues.view(numpy.uint8)
+        n = OptDict_Join(self.od, other.od, &k[0], &a[0], &b[0])
+        return keys[:n], avalues[:n], bvalues[:n]
+
+    def __setitem__(self, key, value):
+        cdef int int_key = key
+        self._unbox(value, self.scratch)
+        if OptDict_SetItem(self.od, &int_key, int_hash(int_key), self.scratch):
+            raise MemoryError()
+
+    def __getitem__(self, key):
+        cdef int int_key = key
+        cdef void *p = OptDict_GetItem(self.od, &int_key, int_hash(int_key))
+        if p == NULL:
+            raise KeyError(key)
+        return self._box(p)
+
+    def __delitem__(self, key):
+        cdef int int_key = key
+        if OptDict_DelItem(self.od, &int_key, int_hash(int_key)):
+            raise KeyError(key)
+
+    def __contains__(self, key):
+        cdef int int_key = key
+        return OptDict_GetItem(self.od, &int_key, int_hash(int_key)) != NULL
+
+    def __len__(self):
+        return OptDict_Size(self.od)
+
+
+cdef union _elem:
+    int i
+    long l
+    float f
+    double d
+
+# typecode -> (elem_t, buffer format, buffer formats accepted by extend())
+cdef dict _typecodes = {
+    'i': (INT_ELEM, b'i', 'i'),
+    'l': (LONG_ELEM, b'l', 'lq'),
+    'f': (FLOAT_ELEM, b'f', 'f'),
+    'd': (DOUBLE_ELEM, b'd', 'd'),
+}
+
+cdef int _unbox(elem_t elemtype, object ob, _elem *item) except -1:
+    if elemtype == INT_ELEM:
+        item.i = ob
+    elif elemtype == LONG_ELEM:
+        item.l = ob
+    elif elemtype == FLOAT_ELEM:
+        item.f = ob
+    else:
+        item.d = ob
+    return 0
+
+cdef object _box(elem_t elemtype, void *p):
+    if elemtype == INT_ELEM:
+        return (<int *>p)[0]
+    elif elemtype == LONG_ELEM:
+        return (<long *>p)[0]
+    elif elemtype == FLOAT_ELEM:
+        return (<float *>p)[0]
+    return (<double *>p)[0]
+
+cdef class TypedList:
+    """
+    TypedList(typecode='d', init=None)
+
+    A growable list of fixed-size numbers stored contiguously, like
+    array.array.  typecode is one of 'i' (C int), 'l' (C long), 'f' (float)
+    or 'd' (double).  A TypedList exports its storage through the buffer
+    protocol, so numpy.asarray(tl) is a view, not a copy; while such a view
+    is alive the list cannot change size.
+    """
+
+    cdef _TypedList *ls
+    cdef elem_t elemtype
+    cdef readonly object typecode
+    cdef bytes format
+    cdef object accepts
+    cdef Py_ssize_t shape[1]
+    cdef Py_ssize_t strides[1]
+    cdef int exports
+
+    def __cinit__(self, typecode='d', init=None):
+        try:
+            self.elemtype, self.format, self.accepts = _typecodes[typecode]
+        except KeyError:
+            raise ValueError("bad typecode {!r} (must be one of 'i', 'l', "
+                             "'f', 'd')".format(typecode))
+        self.typecode = typecode
+        self.ls = TypedList_New(self.elemtype)
+        if self.ls == NULL:
+            raise MemoryError()
+
+    def __init__(self, typecode='d', init=None):
+        if init is not None:
+            self.extend(init)
+
+    def __dealloc__(self):
+        TypedList_Dealloc(self.ls)
+
+    cdef int _check_resizable(self) except -1:
+        if self.exports > 0:
+            raise BufferError("cannot resize a TypedList with exported buffers")
+        return 0
+
+    cdef size_t _index(self, Py_ssize_t i) except? 0:
+        if i < 0:
+            i += <Py_ssize_t>self.ls.ls_size
+        if i < 0 or <size_t>i >= self.ls.ls_size:
+            raise IndexError("TypedList index out of range")
+        return <size_t>i
+
+    def __len__(self):
+        return self.ls.ls_size
+
+    def __getitem__(self, Py_ssize_t i):
+        return _box(self.elemtype, TypedList_GetItem(self.ls, self._index(i)))
+
+    def __setitem__(self, Py_ssize_t i, value):
+        cdef _elem item
+        cdef size_t j = self._index(i)
+        _unbox(self.elemtype, value, &item)
+        TypedList_SetItem(self.ls, j, &item)
+
+    def append(self, value):
+        cdef _elem item
+        self._check_resizable()
+        _unbox(self.elemtype, value, &item)
+        if TypedList_Append(self.ls, &item):
+            raise MemoryError()
+
+    def extend(self, iterable):
+        """
+        Append all items from iterable.  A C-contiguous buffer (NumPy array,
+        array.array, another TypedList) of a matching element type is copied
+        in one memcpy; anything else is appended item by item.
+        """
+        cdef Py_buffer view
+        cdef int err
+        self._check_resizable()
+        if PyObject_CheckBuffer(iterable):
+            PyObject_GetBuffer(iterable, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)
+            try:
+                if (<size_t>view.itemsize == self.ls.ls_itemsize and
+                        view.format != NULL and
+                        view.format.lstrip(b'@=').decode('ascii') in self.accepts):
+                    err = TypedList_Extend(self.ls, view.buf,
+                                           <size_t>(view.len // view.itemsize))
+                    if err:
+                        raise MemoryError()
+                    return
+            finally:
+                PyBuffer_Release(&view)
+        for value in iterable:
+            self.append(value)
+
+    def reserve(self, size_t n):
+        """Preallocate room for n items in total."""
+        self._check_resizable()
+        if TypedList_Reserve(self.ls, n):
+            raise MemoryError()
+
+    def clear(self):
+        self._check_resizable()
+        TypedList_Clear(self.ls)
+
+    def __repr__(self):
+        return "TypedList({!r}, {!r})".format(self.typecode,
+                [self[i] for i in range(len(self))])
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        self.shape[0] = self.ls.ls_size
+        self.strides[0] = self.ls.ls_itemsize
+        buffer.buf = self.ls.ls_items
+        buffer.format = NULL
+        if flags & PyBUF_FORMAT:
+            buffer.format = self.format
+        buffer.internal = NULL
+        buffer.itemsize = self.ls.ls_itemsize
+        buffer.len = self.ls.ls_size * self.ls.ls_itemsize
+        buffer.ndim = 1
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+        self.exports += 1
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        self.exports -= 1
+
+
+cdef class OptMultiDict:
+    """
+    OptMultiDict(typecode='l')
+
+    Maps int keys to lists of numbers of one type (typecode as for
+    TypedList): a typed d.setdefault(key, []).append(value) that does one
+    lookup per append.  freeze() packs all the values into one array and
+    disallows further appends.
+    """
+
+    cdef _OptMultiDict *mm
+    cdef elem_t elemtype
+    cdef readonly object typecode
+
+    def __cinit__(self, typecode='l'):
+        try:
+            self.elemtype = _typecodes[typecode][0]
+        except KeyError:
+            raise ValueError("bad typecode {!r} (must be one of 'i', 'l', "
+                             "'f', 'd')".format(typecode))
+        self.typecode = typecode
+        self.mm = OptMultiDict_New(INT_KEY, self.elemtype)
+        if self.mm == NULL:
+            raise MemoryError()
+
+    def __dealloc__(self):
+        OptMultiDict_Dealloc(self.mm)
+
+    def append(self, key, value):
+        cdef int int_key = key
+        cdef _elem item
+        cdef int err
+        _unbox(self.elemtype, value, &item)
+        err = OptMultiDict_Append(self.mm, &int_key, int_hash(int_key), &item)
+        if err == ERR_FROZEN:
+            raise TypeError("can't append to a frozen OptMultiDict")
+        elif err:
+            raise MemoryError()
+
+    def __getitem__(self, key):
+        """Return a copy of key's values as a TypedList."""
+        cdef int int_key = key
+        cdef size_t n
+        cdef void *items = OptMultiDict_GetItem(self.mm, &int_key,
+                int_hash(int_key), &n)
+        cdef TypedList result
+        if items == NULL:
+            raise KeyError(key)
+        result = TypedList(self.typecode)
+        if TypedList_Extend(result.ls, items, n):
+            raise MemoryError()
+        return result
+
+    def __contains__(self, key):
+        cdef int int_key = key
+        cdef size_t n
+        return OptMultiDict_GetItem(self.mm, &int_key, int_hash(int_key),
+                                    &n) != NULL
+
+    def __len__(self):
+        return OptMultiDict_Size(self.mm)
+
+    def freeze(self):
+        if OptMultiDict_Freeze(self.mm):
+            raise MemoryError()
+
+
+cdef union _native:
+    int64_t q
+    double d
+
+cdef int _typecheck(object ob, object type) except -1:
+    if not isinstance(ob, type):
+        raise TypeError("{} is not a {}".format(ob, type.__name__))
+    return 0
+
+cdef object _missing = object()
+
+cdef void _release(_OptDict *od, char vkind):
+    # Dealloc a TypedDict's table, dropping its references to the values.
+    cdef size_t pos = 0
+    cdef void *v
+    if vkind == b'O':
+        while OptDict_Next(od, &pos, NULL, &v):
+            Py_DECREF(<object>(<OptDictValue*>v).v_ptr)
+    OptDict_Dealloc(od)
+
+cdef bint _array_pair(ob):
+    # Whether ob is a (keys, values) pair of 1-d NumPy arrays.
+    if type(ob) is not tuple or len(ob) != 2:
+        return False
+    import numpy
+    return all(isinstance(a, numpy.ndarray) and a.ndim == 1 for a in ob)
+
+cdef object _native_dtype(char kind):
+    import numpy
+    return numpy.int64 if kind == b'q' else numpy.float64
+
+cdef bint _native_array(a, char kind):
+    # Whether every element of a converts exactly to kind: an integer or
+    # boolean array with no uint64 beyond int64, or a float array.
+    if kind == b'd':
+        return a.dtype.kind == 'f' and a.dtype.itemsize <= sizeof(double)
+    if a.dtype.kind in 'ib' or (a.dtype.kind == 'u' and a.dtype.itemsize < 8):
+        return True
+    return a.dtype.kind == 'u' and (len(a) == 0 or a.max() <= INT64_MAX)
+
+cdef class TypedDict:
+    """
+    TypedDict(init=None, keytype=object, valtype=object)
+
+    A dict whose keys must be instances of keytype and values of valtype,
+    else TypeError.  With int or float keys the items live in an OptDict:
+    each key, and each int or float value, is checked and converted once to
+    a C int64 or double (ints must fit in 64 bits), and read back as a
+    plain int or float.  Other keys go in a Python dict.  update() checks
+    all of its items before storing any.  A copy() of an OptDict-backed
+    TypedDict shares its table with the original until either changes.
+    """
+
+    cdef _OptDict *od
+    cdef dict d
+    cdef char kkind, vkind
+    cdef _native kbuf, vbuf
+    cdef readonly object keytype
+    cdef readonly object valtype
+
+    def __cinit__(self, init=None, keytype=object, valtype=object):
+        self.keytype = keytype
+        self.valtype = valtype
+        self.kkind = b'q' if keytype is int else b'd' if keytype is float else b'O'
+        self.vkind = b'q' if valtype is int else b'd' if valtype is float else b'O'
+        if self.kkind == b'O':
+            self.d = {}
+        else:
+            self.od = self._new_table()
+
+    def __init__(self, init=None, keytype=object, valtype=object):
+        if init is not None:
+            self.update(init)
+
+    def __dealloc__(self):
+        if self.od != NULL:
+            _release(self.od, self.vkind)
+
+    cdef _OptDict *_new_table(self) except NULL:
+        cdef _OptDict *od = (OptDict_NewBytes(sizeof(int64_t))
+                             if self.kkind == b'q' else OptDict_New(DOUBLE_KEY))
+        if od == NULL:
+            raise MemoryError()
+        if self.vkind != b'O' and OptDict_SetValueType(od,
+                &OptDict_Int64 if self.vkind == b'q' else &OptDict_Float64,
+                VALUES_IN_ENTRIES):
+            OptDict_Dealloc(od)
+            raise MemoryError()
+        return od
+
+    cdef long _hash(self, _native *k):
+        if self.kkind == b'q':
+            return bytes_hash(&k.q, sizeof(int64_t))
+        return double_hash(k.d)
+
+    cdef int _convert(self, char kind, object ob, _native *p) except -1:
+        if kind == b'q':
+            p.q = ob
+        else:
+            p.d = ob
+        return 0
+
+    cdef int _convert_key(self, object key, _native *p) except -1:
+        # NaN equals nothing, itself included, so it would go in afresh each
+        # time and could never be found again.
+        self._convert(self.kkind, key, p)
+        if self.kkind == b'd' and p.d != p.d:
+            raise ValueError("NaN can't be a TypedDict key")
+        return 0
+
+    cdef bint _find(self, object key, long *hash) except -1:
+        # Convert key into kbuf for a lookup.  Like a dict, look an int up
+        # by an equal float and vice versa; a key that can't be equal to
+        # any the dict holds is just missing.
+        cdef int overflow = 0
+        if self.kkind == b'q':
+            if isinstance(key, float):
+                if not key.is_integer():
+                    return False
+                key = int(key)
+            elif not isinstance(key, int):
+                try:
+                    key = operator.index(key)
+                except TypeError:
+                    return False
+            self.kbuf.q = PyLong_AsLongLongAndOverflow(key, &overflow)
+            if overflow:
+                return False
+        elif isinstance(key, float):
+            self.kbuf.d = key
+        elif isinstance(key, int):
+            try:
+                self.kbuf.d = key
+            except OverflowError:
+                return False
+            if self.kbuf.d != key:
+                return False
+        else:
+            return False
+        hash[0] = self._hash(&self.kbuf)
+        return True
+
+    cdef object _box(self, void *p):
+        if self.vkind == b'q':
+            return (<int64_t *>p)[0]
+        if self.vkind == b'd':
+            return (<double *>p)[0]
+        return <object>(<OptDictValue*>p).v_ptr
+
+    cdef object _key_object(self, void *k):
+        if self.kkind == b'q':
+            return (<int64_t *>k)[0]
+        return (<double *>k)[0]
+
+    cdef void *_get(self, object key) except? NULL:
+        cdef long hash
+        if not self._find(key, &hash):
+            return NULL
+        return OptDict_GetItem(self.od, &self.kbuf, hash)
+
+    cdef int _set(self, _native *key, long hash, object value) except -1:
+        # Store a checked key and value.
+        cdef OptDictValue newvalue
+        cdef OptDictValue *slot
+        cdef void *oldvalue
+        cdef int inserted
+        if self.vkind != b'O':
+            self._convert(self.vkind, value, &self.vbuf)
+            if OptDict_SetItem(self.od, key, hash, &self.vbuf):
+                raise MemoryError()
+            return 0
+        newvalue.v_ptr = <void*>value
+        slot = <OptDictValue*>OptDict_SetDefault(self.od, key, hash,
+                                                 &newvalue, &inserted)
+        if slot == NULL:
+            raise MemoryError()
         Py_INCREF(value)
-        if oldvalue:
-            Py_DECREF(oldvalue)
+        if not inserted:
+            oldvalue = slot.v_ptr
+            slot.v_ptr = <void*>value
+            Py_DECREF(<object>oldvalue)
+        return 0
+
+    cdef int _update(self, list keys, list values) except -1:
+        # Check and convert every item, then store them all.
+        cdef Py_ssize_t i, n = len(keys)
+        cdef _native *k
+        cdef _native *v = NULL
+        if self.od == NULL:
+            for i in range(n):
+                _typecheck(keys[i], self.keytype)
+                _typecheck(values[i], self.valtype)
+            for i in range(n):
+                self.d[keys[i]] = values[i]
+            return 0
+        k = <_native *>malloc(max(n, 1) * sizeof(_native))
+        if self.vkind != b'O':
+            v = <_native *>malloc(max(n, 1) * sizeof(_native))
+        try:
+            if k == NULL or (self.vkind != b'O' and v == NULL):
+                raise MemoryError()
+            for i in range(n):
+                _typecheck(keys[i], self.keytype)
+                _typecheck(values[i], self.valtype)
+                self._convert_key(keys[i], &k[i])
+                if v != NULL:
+                    self._convert(self.vkind, values[i], &v[i])
+            if OptDict_Reserve(self.od, n):
+                raise MemoryError()
+            if v != NULL:
+                if n and OptDict_SetMany(self.od, k, v, n):
+                    raise MemoryError()
+            else:
+                for i in range(n):
+                    self._set(&k[i], self._hash(&k[i]), values[i])
+        finally:
+            free(k)
+            free(v)
+        return 0
+
+    cdef int _update_typed(self, TypedDict other) except -1:
+        # other holds the same types, so its items need no checks.
+        cdef size_t pos = 0
+        cdef void *k
+        cdef void *v
+        if other is self:
+            return 0
+        if self.od == NULL:
+            self.d.update(other.d)
+            return 0
+        if self.vkind != b'O':
+            if OptDict_Merge(self.od, other.od, MERGE_OVERWRITE):
+                raise MemoryError()
+            return 0
+        if OptDict_Reserve(self.od, OptDict_Size(other.od)):
+            raise MemoryError()
+        while OptDict_Next(other.od, &pos, &k, &v):
+            self._set(<_native *>k, self._hash(<_native *>k),
+                      <object>(<OptDictValue*>v).v_ptr)
+        return 0
+
+    cdef int _update_arrays(self, keys, values) except -1:
+        # Store arrays of keys and values, converting them as arrays if
+        # their dtypes hold only ints or floats as the case may be.
+        import numpy
+        cdef const unsigned char[::1] k
+        cdef const unsigned char[::1] v
+        cdef Py_ssize_t n = len(keys)
+        if len(values) != n:
+            raise ValueError("keys and values must be the same length")
+        if (self.od == NULL or self.vkind == b'O'
+                or not _native_array(keys, self.kkind)
+                or not _native_array(values, self.vkind)):
+            return self._update(keys.tolist(), values.tolist())
+        if n == 0:
+            return 0
+        if self.kkind == b'd' and numpy.isnan(keys).any():
+            raise ValueError("NaN can't be a TypedDict key")
+        k = numpy.ascontiguousarray(keys, _native_dtype(self.kkind)).view(numpy.uint8)
+        v = numpy.ascontiguousarray(values, _native_dtype(self.vkind)).view(numpy.uint8)
+        if OptDict_Reserve(self.od, n) or OptDict_SetMany(self.od, &k[0], &v[0], n):
+            raise MemoryError()
+        return 0
+
+    def update(self, other, **kwargs):
+        """
+        Add the items of a mapping, an iterable of (key, value) pairs, or a
+        tuple of two 1-d NumPy arrays (keys, values).
+        """
+        cdef list keys, values
+        if isinstance(other, TypedDict) and (
+                (<TypedDict>other).keytype is self.keytype and
+                (<TypedDict>other).valtype is self.valtype):
+            self._update_typed(other)
+        elif isinstance(other, (dict, TypedDict)):
+            self._update(list(other.keys()), list(other.values()))
+        elif _array_pair(other):
+            self._update_arrays(other[0], other[1])
+        else:
+            keys = []
+            values = []
+            if isinstance(other, OptDict):
+                other = other.items()
+            elif hasattr(other, 'keys'):
+                keys = list(other.keys())
+                values = [other[k] for k in keys]
+                other = ()
+            for k, v in other:
+                keys.append(k)
+                values.append(v)
+            self._update(keys, values)
+        if kwargs:
+            self._update(list(kwargs), list(kwargs.values()))
+
+    def __repr__(self):
+        return "TypedDict(keytype={}, valtype={}, {!r})".format(
+                self.keytype.__name__, self.valtype.__name__,
+                dict(self.items()))
+
+    def __getitem__(self, item):
+        cdef void *p
+        if self.od == NULL:
+            return self.d[item]
+        p = self._get(item)
+        if p == NULL:
+            raise KeyError(item)
+        return self._box(p)
+
+    def __setitem__(self, item, val):
+        _typecheck(item, self.keytype)
+        _typecheck(val, self.valtype)
+        if self.od == NULL:
+            self.d[item] = val
+            return
+        self._convert_key(item, &self.kbuf)
+        self._set(&self.kbuf, self._hash(&self.kbuf), val)
+
+    def __delitem__(self, item):
+        if self.pop(item, _missing) is _missing:
+            raise KeyError(item)
+
+    def __contains__(self, ob):
+        if self.od == NULL:
+            return ob in self.d
+        return self._get(ob) != NULL
+
+    def __len__(self):
+        if self.od == NULL:
+            return len(self.d)
+        return OptDict_Size(self.od)
+
+    def __iter__(self):
+        return iter(self.keys())
+
+    def get(self, k, d=None):
+        cdef void *p
+        if self.od == NULL:
+            return self.d.get(k, d)
+        p = self._get(k)
+        return d if p == NULL else self._box(p)
+
+    def setdefault(self, k, d=None):
+        cdef void *p
+        if self.od == NULL:
+            if k not in self.d:
+                _typecheck(k, self.keytype)
+                _typecheck(d, self.valtype)
+            return self.d.setdefault(k, d)
+        p = self._get(k)
+        if p != NULL:
+            return self._box(p)
+        self[k] = d
+        return self[k]
+
+    def clear(self):
+        cdef _OptDict *od = self.od
+        if od == NULL:
+            self.d.clear()
+            return
+        # Swap in an empty table before dropping the old values, whose
+        # DECREFs may run code that looks at this dict.
+        self.od = self._new_table()
+        _release(od, self.vkind)
+
+    def copy(self):
+        cdef TypedDict new_td = TypedDict(keytype=self.keytype,
+                                          valtype=self.valtype)
+        cdef size_t pos = 0
+        cdef void *v
+        cdef _OptDict *od
+        if self.od == NULL:
+            new_td.d = self.d.copy()
+            return new_td
+        od = OptDict_Copy(self.od)
+        if od == NULL:
+            raise MemoryError()
+        OptDict_Dealloc(new_td.od)
+        new_td.od = od
+        if self.vkind == b'O':
+            while OptDict_Next(od, &pos, NULL, &v):
+                Py_INCREF(<object>(<OptDictValue*>v).v_ptr)
+        return new_td
+
+    def items(self):
+        cdef size_t pos = 0
+        cdef void *k
+        cdef void *v
+        if self.od == NULL:
+            return list(self.d.items())
+        items = []
+        while OptDict_Next(self.od, &pos, &k, &v):
+            items.append((self._key_object(k), self._box(v)))
+        return items
+
+    def keys(self):
+        cdef size_t pos = 0
+        cdef void *k
+        if self.od == NULL:
+            return list(self.d)
+        keys = []
+        while OptDict_Next(self.od, &pos, &k, NULL):
+            keys.append(self._key_object(k))
+        return keys
+
+    def values(self):
+        cdef size_t pos = 0
+        cdef void *v
+        if self.od == NULL:
+            return list(self.d.values())
+        values = []
+        while OptDict_Next(self.od, &pos, NULL, &v):
+            values.append(self._box(v))
+        return values
+
+    def pop(self, k, d=None):
+        cdef long hash
+        cdef OptDictValue old
+        if self.od == NULL:
+            return self.d.pop(k, d)
+        if not self._find(k, &hash):
+            return d
+        if self.vkind == b'O':
+            if OptDict_Pop(self.od, &self.kbuf, hash, &old):
+                return d
+            value = <object>old.v_ptr
+            Py_DECREF(value)
+            return value
+        if OptDict_Pop(self.od, &self.kbuf, hash, &self.vbuf):
+            return d
+        return self._box(&self.vbuf)
+
+    def popitem(self):
+        cdef size_t pos = 0
+        cdef void *k
+        if self.od == NULL:
+            return self.d.popitem()
+        if not OptDict_Next(self.od, &pos, &k, NULL):
+            raise KeyError("popitem(): dictionary is empty")
+        key = self._key_object(k)
+        return key, self.pop(key)
+
+
+
+cdef void _retain_object(void *v) noexcept:
+    Py_INCREF(<object>(<OptDictValue*>v).v_ptr)
+
+cdef void _release_object(void *v) noexcept:
+    Py_DECREF(<object>(<OptDictValue*>v).v_ptr)
+
+cdef class PersistentDict:
+    """
+    PersistentDict(init=None, keytype=int, valtype=object)
 
-        # err = OptDict_SetItem(self.od, )
-    # int OptDict_SetItem(OptDict *mp, void *key, long hash, void *value, void *oldvalue)
+    An immutable mapping with int or float keys, checked and converted like
+    a TypedDict's.  assoc() and dissoc() return a new version that shares
+    all but O(log n) of its storage with this one (an OptHamt), so keeping
+    many versions of a big mapping costs little more than keeping one.
+    """
+
+    cdef _OptHamt *hm
+    cdef TypedDict td
+    cdef readonly object keytype
+    cdef readonly object valtype
+
+    def __cinit__(self, init=None, keytype=int, valtype=object):
+        cdef OptHamtValueFunc retain = NULL
+        cdef OptHamtValueFunc release = NULL
+        if init is _missing:
+            # A new version, filled in by _version().
+            return
+        if keytype is not int and keytype is not float:
+            raise TypeError("keytype must be int or float")
+        self.keytype = keytype
+        self.valtype = valtype
+        # td checks and converts keys and values, and builds the first
+        # version, then stays empty.
+        self.td = TypedDict(init, keytype, valtype)
+        if self.td.vkind == b'O':
+            retain = _retain_object
+            release = _release_object
+        self.hm = OptHamt_FromDict(self.td.od, retain, release)
+        self.td.clear()
+        if self.hm == NULL:
+            raise MemoryError()
 
     def __dealloc__(self):
-        pass
+        if self.hm != NULL:
+            OptHamt_Dealloc(self.hm)
+
+    cdef PersistentDict _version(self, _OptHamt *hm):
+        cdef PersistentDict new
+        if hm == NULL:
+            raise MemoryError()
+        new = PersistentDict.__new__(PersistentDict, _missing)
+        new.hm = hm
+        new.td = self.td
+        new.keytype = self.keytype
+        new.valtype = self.valtype
+        return new
+
+    cdef void *_get(self, object key) except? NULL:
+        cdef long hash
+        if not self.td._find(key, &hash):
+            return NULL
+        return OptHamt_GetItem(self.hm, &self.td.kbuf, hash)
+
+    def assoc(self, key, value):
+        """Return a new version with key set to value."""
+        cdef TypedDict td = self.td
+        cdef OptDictValue v
+        cdef void *p = &v
+        _typecheck(key, self.keytype)
+        _typecheck(value, self.valtype)
+        td._convert_key(key, &td.kbuf)
+        if td.vkind == b'O':
+            v.v_ptr = <void*>value
+        else:
+            td._convert(td.vkind, value, &td.vbuf)
+            p = &td.vbuf
+        return self._version(OptHamt_Assoc(self.hm, &td.kbuf,
+                                           td._hash(&td.kbuf), p))
+
+    def dissoc(self, key):
+        """Return a new version without key, or this one if key is absent."""
+        cdef long hash
+        cdef _OptHamt *hm
+        if not self.td._find(key, &hash):
+            return self
+        hm = OptHamt_Dissoc(self.hm, &self.td.kbuf, hash)
+        if hm != NULL and OptHamt_Size(hm) == OptHamt_Size(self.hm):
+            OptHamt_Dealloc(hm)
+            return self
+        return self._version(hm)
+
+    def __repr__(self):
+        return "PersistentDict(keytype={}, valtype={}, {!r})".format(
+                self.keytype.__name__, self.valtype.__name__,
+                dict(self.items()))
+
+    def __getitem__(self, item):
+        cdef void *p = self._get(item)
+        if p == NULL:
+            raise KeyError(item)
+        return self.td._box(p)
+
+    def __contains__(self, ob):
+        return self._get(ob) != NULL
+
+    def __len__(self):
+        return OptHamt_Size(self.hm)
+
+    def __iter__(self):
+        return iter(self.keys())
+
+    def get(self, k, d=None):
+        cdef void *p = self._get(k)
+        return d if p == NULL else self.td._box(p)
+
+    def items(self):
+        cdef OptHamtIter it
+        cdef void *k
+        cdef void *v
+        items = []
+        OptHamt_Iter(self.hm, &it)
+        while OptHamt_Next(self.hm, &it, &k, &v):
+            items.append((self.td._key_object(k), self.td._box(v)))
+        return items
+
+    def keys(self):
+        cdef OptHamtIter it
+        cdef void *k
+        keys = []
+        OptHamt_Iter(self.hm, &it)
+        while OptHamt_Next(self.hm, &it, &k, NULL):
+            keys.append(self.td._key_object(k))
+        return keys
+
+    def values(self):
+        cdef OptHamtIter it
+        cdef void *v
+        values = []
+        OptHamt_Iter(self.hm, &it)
+        while OptHamt_Next(self.hm, &it, NULL, &v):
+            values.append(self.td._box(v))
+        return values
+
+
+cdef void _pack_int64(int64_t q, unsigned char *b):
+    # A SortedDict's int key: big-endian with the sign bit flipped, so that
+    # the order of the bytes (BYTES_KEY) is the order of the numbers.
+    cdef uint64_t u = <uint64_t>q ^ (<uint64_t>1 << 63)
+    cdef int i
+    for i in range(8):
+        b[i] = <unsigned char>(u >> (56 - 8 * i))
+
+cdef int64_t _unpack_int64(const unsigned char *b):
+    cdef uint64_t u = 0
+    cdef int i
+    for i in range(8):
+        u = (u << 8) | b[i]
+    return <int64_t>(u ^ (<uint64_t>1 << 63))
+
+cdef class SortedDict:
+    """
+    SortedDict(init=None, keytype=int, valtype=object)
+
+    A typed dict kept in key order (an OptSortedDict, a B+ tree), for range
+    queries: keys(), values() and items() take optional bounds lo and hi and
+    cover lo <= key < hi.  keytype is int (64-bit) or float, and keys and
+    values are checked and converted as a TypedDict's are.  from_arrays()
+    builds one from sorted NumPy arrays in one pass.
+    """
+
+    cdef _OptSortedDict *sd
+    cdef char kkind, vkind
+    cdef unsigned char kbuf[8]
+    cdef _native vbuf
+    cdef readonly object keytype
+    cdef readonly object valtype
+
+    def __cinit__(self, init=None, keytype=int, valtype=object):
+        cdef const OptDictValueType *vt = NULL
+        if keytype is not int and keytype is not float:
+            raise TypeError("keytype must be int or float")
+        self.keytype = keytype
+        self.valtype = valtype
+        self.kkind = b'q' if keytype is int else b'd'
+        self.vkind = b'q' if valtype is int else b'd' if valtype is float else b'O'
+        if self.vkind != b'O':
+            vt = &OptDict_Int64 if self.vkind == b'q' else &OptDict_Float64
+        self.sd = (OptSortedDict_New(BYTES_KEY, sizeof(int64_t), vt)
+                   if self.kkind == b'q' else OptSortedDict_New(DOUBLE_KEY, 0, vt))
+        if self.sd == NULL:
+            raise MemoryError()
+
+    def __init__(self, init=None, keytype=int, valtype=object):
+        if init is not None:
+            self.update(init)
+
+    def __dealloc__(self):
+        cdef OptSortedIter it
+        cdef void *v
+        if self.sd == NULL:
+            return
+        if self.vkind == b'O':
+            OptSortedDict_Range(self.sd, &it, NULL, NULL)
+            while OptSortedDict_Next(self.sd, &it, NULL, &v):
+                Py_DECREF(<object>(<OptDictValue*>v).v_ptr)
+        OptSortedDict_Dealloc(self.sd)
+
+    @staticmethod
+    def from_arrays(keys, values):
+        """
+        from_arrays(keys, values) -> SortedDict
+
+        Build a SortedDict from 1-d NumPy arrays of numbers, the keys
+        strictly increasing.  The key and value types are int or float
+        after the arrays' dtypes.
+        """
+        import numpy
+        cdef SortedDict sd
+        cdef const unsigned char[::1] kb
+        cdef const unsigned char[::1] vb
+        cdef Py_ssize_t n = len(keys)
+        cdef int err
+        keys = numpy.asarray(keys)
+        values = numpy.asarray(values)
+        if keys.ndim != 1 or values.ndim != 1 or len(values) != n:
+            raise ValueError("keys and values must be 1-d and the same length")
+        if keys.dtype.kind not in 'iubf' or values.dtype.kind not in 'iubf':
+            raise TypeError("keys and values must be numbers")
+        sd = SortedDict(keytype=float if keys.dtype.kind == 'f' else int,
+                        valtype=float if values.dtype.kind == 'f' else int)
+        if not _native_array(keys, sd.kkind) or not _native_array(values,
+                                                                  sd.vkind):
+            raise OverflowError("values out of range")
+        keys = numpy.ascontiguousarray(keys, dtype=_native_dtype(sd.kkind))
+        values = numpy.ascontiguousarray(values,
+                                         dtype=_native_dtype(sd.vkind))
+        if n == 0:
+            return sd
+        if sd.kkind == b'q':
+            keys = (keys.view(numpy.uint64) ^ numpy.uint64(1 << 63)).astype('>u8')
+        kb = keys.view(numpy.uint8)
+        vb = values.view(numpy.uint8)
+        err = OptSortedDict_FromSorted(sd.sd, &kb[0], &vb[0], n)
+        if err == ERR_NOT_SORTED:
+            raise ValueError("keys must be strictly increasing")
+        elif err:
+            raise MemoryError()
+        return sd
+
+    cdef bint _find(self, object key, unsigned char *buf) except -1:
+        # Convert key into buf for a lookup.  Like a dict, look an int up by
+        # an equal float and vice versa; a key that can't be equal to any
+        # the map holds is just missing.
+        cdef int overflow = 0
+        cdef int64_t q
+        cdef double d
+        if self.kkind == b'q':
+            if isinstance(key, float):
+                if not key.is_integer():
+                    return False
+                key = int(key)
+            elif not isinstance(key, int):
+                try:
+                    key = operator.index(key)
+                except TypeError:
+                    return False
+            q = PyLong_AsLongLongAndOverflow(key, &overflow)
+            if overflow:
+                return False
+            _pack_int64(q, buf)
+            return True
+        if isinstance(key, float):
+            d = key
+        elif isinstance(key, int):
+            try:
+                d = key
+            except OverflowError:
+                return False
+            if d != key:
+                return False
+        else:
+            return False
+        if d != d:
+            return False
+        memcpy(buf, &d, sizeof(double))
+        return True
+
+    cdef int _bound(self, object bound, unsigned char *buf) except -1:
+        # Convert a range bound into buf and return 0, or for int keys
+        # return 1 if it's below every int64 and 2 if above.  As keys >= x
+        # and keys < x are the same as keys >= ceil(x) and keys < ceil(x)
+        # for int keys, a float bound is rounded up.
+        cdef double d
+        if self.kkind == b'q':
+            if isinstance(bound, float):
+                if bound != bound:
+                    raise ValueError("a range bound can't be NaN")
+                if math.isinf(bound):
+                    return 1 if bound < 0 else 2
+                bound = math.ceil(bound)
+            if bound < INT64_MIN:
+                return 1
+            if bound > INT64_MAX:
+                return 2
+            _pack_int64(bound, buf)
+            return 0
+        d = bound
+        if d != d:
+            raise ValueError("a range bound can't be NaN")
+        memcpy(buf, &d, sizeof(double))
+        return 0
+
+    cdef object _box(self, void *p):
+        if self.vkind == b'q':
+            return (<int64_t *>p)[0]
+        if self.vkind == b'd':
+            return (<double *>p)[0]
+        return <object>(<OptDictValue*>p).v_ptr
+
+    cdef object _key_object(self, void *k):
+        if self.kkind == b'q':
+            return _unpack_int64(<unsigned char *>k)
+        return (<double *>k)[0]
+
+    cdef void *_get(self, object key) except? NULL:
+        if not self._find(key, self.kbuf):
+            return NULL
+        return OptSortedDict_GetItem(self.sd, self.kbuf)
+
+    cdef int _convert(self, object key, object value, unsigned char *kbuf,
+                      _native *v) except -1:
+        # Check an item and convert the key into kbuf and a number value
+        # into *v, storing nothing.
+        cdef double d
+        _typecheck(key, self.keytype)
+        _typecheck(value, self.valtype)
+        if self.kkind == b'q':
+            _pack_int64(key, kbuf)
+        else:
+            d = key
+            if d != d:
+                raise ValueError("NaN can't be a SortedDict key")
+            memcpy(kbuf, &d, sizeof(double))
+        if self.vkind == b'q':
+            v.q = value
+        elif self.vkind == b'd':
+            v.d = value
+        return 0
+
+    cdef int _set(self, const unsigned char *kbuf, object value,
+                  _native *v) except -1:
+        # Store an item converted by _convert().
+        cdef OptDictValue newvalue
+        cdef OptDictValue *slot
+        cdef void *oldvalue
+        if self.vkind != b'O':
+            if OptSortedDict_SetItem(self.sd, kbuf, v):
+                raise MemoryError()
+            return 0
+        slot = <OptDictValue*>OptSortedDict_GetItem(self.sd, kbuf)
+        if slot != NULL:
+            oldvalue = slot.v_ptr
+            Py_INCREF(value)
+            slot.v_ptr = <void*>value
+            Py_DECREF(<object>oldvalue)
+            return 0
+        newvalue.v_ptr = <void*>value
+        if OptSortedDict_SetItem(self.sd, kbuf, &newvalue):
+            raise MemoryError()
+        Py_INCREF(value)
+        return 0
+
+    def update(self, other):
+        """Add other's items, all checked before any is stored."""
+        cdef Py_ssize_t i, n
+        cdef unsigned char *k
+        cdef _native *v
+        items = list(other.items()) if hasattr(other, 'items') else list(other)
+        n = len(items)
+        k = <unsigned char *>malloc(max(n, 1) * 8)
+        v = <_native *>malloc(max(n, 1) * sizeof(_native))
+        try:
+            if k == NULL or v == NULL:
+                raise MemoryError()
+            for i in range(n):
+                key, value = items[i]
+                self._convert(key, value, &k[8 * i], &v[i])
+            for i in range(n):
+                self._set(&k[8 * i], items[i][1], &v[i])
+        finally:
+            free(k)
+            free(v)
+
+    def __repr__(self):
+        return "SortedDict(keytype={}, valtype={}, {!r})".format(
+                self.keytype.__name__, self.valtype.__name__,
+                dict(self.items()))
+
+    def __getitem__(self, item):
+        cdef void *p = self._get(item)
+        if p == NULL:
+            raise KeyError(item)
+        return self._box(p)
+
+    def __setitem__(self, item, val):
+        self._convert(item, val, self.kbuf, &self.vbuf)
+        self._set(self.kbuf, val, &self.vbuf)
+
+    def __delitem__(self, item):
+        cdef void *p = self._get(item)
+        if p == NULL:
+            raise KeyError(item)
+        value = self._box(p)
+        OptSortedDict_DelItem(self.sd, self.kbuf)
+        if self.vkind == b'O':
+            Py_DECREF(value)
+
+    def __contains__(self, ob):
+        return self._get(ob) != NULL
+
+    def __len__(self):
+        return OptSortedDict_Size(self.sd)
+
+    def __iter__(self):
+        return iter(self.keys())
+
+    def get(self, k, d=None):
+        cdef void *p = self._get(k)
+        return d if p == NULL else self._box(p)
+
+    cdef _range(self, lo, hi, bint want_keys, bint want_values):
+        cdef unsigned char lobuf[8]
+        cdef unsigned char hibuf[8]
+        cdef OptSortedIter it
+        cdef void *k
+        cdef void *v
+        cdef int lopos = 1, hipos = 2
+        if lo is not None:
+            lopos = self._bound(lo, lobuf)
+        if hi is not None:
+            hipos = self._bound(hi, hibuf)
+        result = []
+        if lopos == 2 or hipos == 1:
+            return result
+        OptSortedDict_Range(self.sd, &it, NULL if lopos else lobuf,
+                            NULL if hipos else hibuf)
+        while OptSortedDict_Next(self.sd, &it, &k, &v):
+            if want_keys and want_values:
+                result.append((self._key_object(k), self._box(v)))
+            elif want_keys:
+                result.append(self._key_object(k))
+            else:
+                result.append(self._box(v))
+        return result
+
+    def items(self, lo=None, hi=None):
+        """The items with lo <= key < hi, in key order."""
+        return self._range(lo, hi, True, True)
+
+    def keys(self, lo=None, hi=None):
+        """The keys with lo <= key < hi, in order."""
+        return self._range(lo, hi, True, False)
+
+    def values(self, lo=None, hi=None):
+        """The values of the keys with lo <= key < hi, in key order."""
+        return self._range(lo, hi, False, True)
+
+# Group-by and join over NumPy arrays of integer keys, numbering the keys
+# with a typed OptDict (OptDict_Factorize()) and probing it in batches.
+
+ctypedef fused _number:
+    int64_t
+    double
+
+cdef _OptDict *_key_dict(dtype) except NULL:
+    cdef _OptDict *od
+    if dtype.kind not in 'iub':
+        raise TypeError("keys must be integers, not {}".format(dtype))
+    if dtype.kind == 'i' and dtype.itemsize == sizeof(int):
+        od = OptDict_New(INT_KEY)
+    else:
+        od = OptDict_NewBytes(dtype.itemsize)
+    if od == NULL:
+        raise MemoryError()
+    return od
+
+cdef int _factorize(_OptDict *od, keys, long[::1] groups) except -1:
+    # Number keys into groups.  If the first keys are mostly distinct, so
+    # are the rest, probably: make room for them all at once.
+    import numpy
+    cdef const unsigned char[::1] k = keys.view(numpy.uint8)
+    cdef size_t n = groups.shape[0]
+    cdef size_t head = n if n < 65536 else 65536
+    cdef size_t keysize = keys.dtype.itemsize
+    cdef int err = 0
+    if n == 0:
+        return 0
+    with nogil:
+        err = OptDict_Factorize(od, &k[0], head, &groups[0])
+        if not err and OptDict_Size(od) * 2 > head:
+            err = OptDict_Reserve(od, n - head)
+        if not err and n > head:
+            err = OptDict_Factorize(od, &k[head * keysize], n - head,
+                                    &groups[head])
+    if err:
+        raise MemoryError()
+    return 0
+
+cdef int _aggregate(const long[::1] groups, const _number[::1] values,
+                    _number[::1] out, Py_ssize_t[::1] first,
+                    int op) except -1 nogil:
+    # op: 0 sum, 1 min, 2 max.  A group's first value is the one at which
+    # its number comes up for the first time.
+    cdef Py_ssize_t i, ng = 0
+    cdef long g
+    for i in range(groups.shape[0]):
+        g = groups[i]
+        if g == ng:
+            out[g] = values[i]
+            first[g] = i
+            ng += 1
+        elif op == 0:
+            out[g] += values[i]
+        elif op == 1:
+            if values[i] < out[g]:
+                out[g] = values[i]
+        elif values[i] > out[g]:
+            out[g] = values[i]
+    return 0
+
+cdef dict _aggs = {'sum': 0, 'min': 1, 'max': 2, 'mean': 0, 'count': 0}
+
+def group_by(keys, values=None, agg='sum'):
+    """
+    group_by(keys, values=None, agg='sum') -> (unique_keys, results)
+
+    Group values by keys, 1-d arrays of the same length (keys of an integer
+    dtype), and reduce each group with agg: 'sum', 'min', 'max', 'mean' or
+    'count' (which takes no values).  The groups come in order of their
+    keys' first appearance.  Results are int64 for the count, and the sum,
+    min or max of integers, else float64.
+    """
+    import numpy
+    cdef _OptDict *od
+    cdef long[::1] g
+    cdef Py_ssize_t[::1] first
+    cdef Py_ssize_t[::1] count
+    cdef Py_ssize_t i
+    cdef size_t ng
+    if agg not in _aggs:
+        raise ValueError("bad agg {!r} (must be 'sum', 'min', 'max', 'mean' "
+                         "or 'count')".format(agg))
+    keys = numpy.ascontiguousarray(keys)
+    if keys.ndim != 1:
+        raise ValueError("keys must be 1-d")
+    if agg != 'count':
+        if values is None:
+            raise TypeError("group_by() needs values to take the {}".format(
+                            agg))
+        values = numpy.ascontiguousarray(values)
+        if values.shape != keys.shape:
+            raise ValueError("keys and values differ in shape")
+        if values.dtype.kind in 'iub' and agg != 'mean':
+            values = values.astype(numpy.int64, copy=False)
+        else:
+            values = values.astype(numpy.float64, copy=False)
+    groups = numpy.empty(len(keys), 'l')
+    od = _key_dict(keys.dtype)
+    try:
+        _factorize(od, keys, groups)
+        ng = OptDict_Size(od)
+    finally:
+        OptDict_Dealloc(od)
+    g = groups
+    firsts = numpy.empty(ng, numpy.intp)
+    first = firsts
+    if agg in ('count', 'mean'):
+        counts = numpy.zeros(ng, numpy.intp)
+        count = counts
+        with nogil:
+            for i in range(g.shape[0]):
+                if count[g[i]] == 0:
+                    first[g[i]] = i
+                count[g[i]] += 1
+    if agg == 'count':
+        return keys[firsts], counts.astype(numpy.int64, copy=False)
+    results = numpy.empty(ng, values.dtype)
+    if values.dtype == numpy.int64:
+        _aggregate[int64_t](g, values, results, first, _aggs[agg])
+    else:
+        _aggregate[double](g, values, results, first, _aggs[agg])
+    if agg == 'mean':
+        results /= counts
+    return keys[firsts], results
+
+cdef object _join_dtype(a, b):
+    # The type to compare two arrays of keys as.  NumPy makes int64 and
+    # uint64 float64, which loses precision: compare them as int64 if the
+    # unsigned keys all fit, else as uint64 if no signed key is negative.
+    import numpy
+    dtype = numpy.promote_types(a.dtype, b.dtype)
+    if dtype.kind != 'f' or {a.dtype.kind, b.dtype.kind} != {'i', 'u'}:
+        return dtype
+    u, i = (a, b) if a.dtype.kind == 'u' else (b, a)
+    if u.size == 0 or u.max() <= INT64_MAX:
+        return numpy.dtype(numpy.int64)
+    if i.size == 0 or i.min() >= 0:
+        return numpy.dtype(numpy.uint64)
+    raise TypeError("can't join {} keys with {} keys: there are both negative "
+                    "keys and unsigned keys above 2**63 - 1".format(a.dtype,
+                                                                    b.dtype))
+
+def hash_join(left_keys, right_keys):
+    """
+    hash_join(left_keys, right_keys) -> (left_index, right_index)
+
+    The inner join of two 1-d arrays of integer keys: every pair (i, j)
+    with left_keys[i] == right_keys[j], as two index arrays, ordered by i
+    and then j.  A hash table of right_keys is built, sized for all of
+    them, and probed with left_keys.
+    """
+    import numpy
+    cdef _OptDict *od
+    cdef long[::1] rg
+    cdef Py_ssize_t[::1] count, offset, order, li, ri
+    cdef const unsigned char[::1] k
+    cdef void **found = NULL
+    cdef Py_ssize_t i, j, n, total = 0
+    cdef long g
+    left_keys = numpy.asarray(left_keys)
+    right_keys = numpy.asarray(right_keys)
+    dtype = _join_dtype(left_keys, right_keys)
+    left_keys = numpy.ascontiguousarray(left_keys, dtype)
+    right_keys = numpy.ascontiguousarray(right_keys, dtype)
+    if left_keys.ndim != 1 or right_keys.ndim != 1:
+        raise ValueError("keys must be 1-d")
+    n = len(left_keys)
+    groups = numpy.empty(len(right_keys), 'l')
+    od = _key_dict(dtype)
+    try:
+        if OptDict_Reserve(od, len(right_keys)):
+            raise MemoryError()
+        _factorize(od, right_keys, groups)
+        # The right rows of each key, in order: right_keys[order[offset[g]:
+        # offset[g+1]]] are all key number g.
+        rg = groups
+        counts = numpy.bincount(groups, minlength=OptDict_Size(od)).astype(
+                numpy.intp)
+        offsets = numpy.zeros(len(counts) + 1, numpy.intp)
+        numpy.cumsum(counts, out=offsets[1:])
+        orders = numpy.argsort(groups, kind='stable').astype(numpy.intp)
+        count = counts
+        offset = offsets
+        order = orders
+        found = <void **>malloc(max(n, 1) * sizeof(void *))
+        if found == NULL:
+            raise MemoryError()
+        if n > 0:
+            k = left_keys.view(numpy.uint8)
+            with nogil:
+                OptDict_GetMany(od, &k[0], n, found)
+        lgroups = numpy.empty(n, 'l')
+        rg = lgroups
+        with nogil:
+            for i in range(n):
+                rg[i] = -1 if found[i] == NULL else (<OptDictValue*>found[i]).v_long
+                if found[i] != NULL:
+                    total += count[rg[i]]
+    finally:
+        free(found)
+        OptDict_Dealloc(od)
+    left_index = numpy.empty(total, numpy.intp)
+    right_index = numpy.empty(total, numpy.intp)
+    li = left_index
+    ri = right_index
+    total = 0
+    with nogil:
+        for i in range(n):
+            g = rg[i]
+            if g < 0:
+                continue
+            for j in range(offset[g], offset[g + 1]):
+                li[total] = i
+                ri[total] = order[j]
+                total += 1
+    return left_index, right_index
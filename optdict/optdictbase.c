@@ -1,7 +1,40 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(_WIN64)
+#include <immintrin.h>
+#define HAVE_HASH_KERNELS 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef MAP_ANONYMOUS
+#define HAVE_MMAP 1
+#endif
+#endif
+#if defined(__linux__) && defined(HAVE_MMAP) && !defined(__STRICT_ANSI__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#define HAVE_MBIND 1
+#ifdef SYS_memfd_create
+#define HAVE_MEMFD 1
+#endif
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_PTHREADS 1
+#endif
 #include "optdictbase.h"
 
 /* See large comment block below.  This must be >= 1. */
@@ -112,7 +145,8 @@ practice, this probably won't make a lick of difference for many years (at
 */
 
 /* Object used as dummy key to fill deleted entries */
-static void *dummy = NULL; /* Initialized by first call to optdict_new() */
+static char dummy_key[] = "<dummy key>";
+#define dummy ((void *)dummy_key)
 
 /* [> forward declarations <] */
 /* static PyDictEntry * */
@@ -187,527 +221,2891 @@ static void *dummy = NULL; /* Initialized by first call to optdict_new() */
     INIT_NONZERO_DICT_SLOTS(mp);                                        \
 } while(0)
 
-/* Dictionary reuse scheme to save calls to malloc, free, and memset */
+/* An entry is active if it holds a key that hasn't been deleted.  (CPython
+   tests me_value != NULL instead, but our values are stored inline and zero
+   is a perfectly good value.) */
+#define ACTIVE_ENTRY(ep) ((ep)->me_key != NULL && (ep)->me_key != dummy)
+
+/* Why OptDict_SetDefault() returned NULL: a key can't be added to a frozen
+   dict, and otherwise we ran out of memory. */
+#define SETDEFAULT_ERROR(mp) ((mp)->ma_frozen ? ERR_FROZEN : ERR_NO_MEM)
+
+/* Give mp a table of its own, if it shares one with a copy, before writing
+   to it (see "Copy-on-write").  0, or ERR_NO_MEM. */
+#define UNSHARE(mp) ((mp)->ma_tableshared ? unshare_table(mp) : 0)
+
+/* Key slots (and those of separately stored values) are a multiple of the
+   strictest alignment a key or value type may need, and at least a pointer
+   wide so a free slot can link to the next one. */
+#define KEYSLOT_ALIGN (sizeof(double) > sizeof(void *) ? sizeof(double)   \
+                                                       : sizeof(void *))
+#define KEYSLOT_ROUND(n) (((n) + KEYSLOT_ALIGN - 1) / KEYSLOT_ALIGN * KEYSLOT_ALIGN)
+#define KEYBLOCK_HEADER KEYSLOT_ROUND(sizeof(OptDictKeyBlock))
+#define KEYBLOCK_MAXSLOTS ((size_t)1 << 16)
+
+/* Words of the occupancy bitmap of a table of nslots slots (see
+   mark_entry()). */
+#define OCCUPIED_WORDS(nslots) (((nslots) + 63) / 64)
+
+/* Batched operations hash this many keys at a time (see OptDict_HashArray()). */
+#define HASH_CHUNK 256
+
+/* How many keys ahead OptDict_SetMany() prefetches, unless told otherwise. */
+#define PREFETCH_DISTANCE 8
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch((p), 1)
+#else
+#define PREFETCH(p) ((void)(p))
+#endif
+
+/*
+   Allocators.  Every allocation a dict makes -- the OptDict itself, its
+   tables (other than mappings, see table_alloc()), key blocks and scratch
+   space -- goes through the OptDictAllocator it was created with, by way of
+   dict_alloc() and dict_free().  free is told the size of the block, so an
+   allocator needn't keep headers.
+
+   OptDict_Pool is a built-in allocator that plays the part of CPython's dict
+   free list ("Dictionary reuse scheme to save calls to malloc, free, and
+   memset"): freed blocks of up to POOL_MAXSIZE bytes are kept on free lists,
+   one per power-of-two size class and per thread, and handed out again
+   before malloc() is asked.  A thread that keeps creating and destroying
+   small dicts stops calling malloc() once its lists are warm, and there is
+   no locking.  Each list holds at most PyDict_MAXFREELIST blocks;
+   OptDict_PoolClear() empties the calling thread's lists (call it before a
+   thread exits, or the blocks on them are leaked).  Without compiler support
+   for thread-local storage the pool is just malloc().
+   */
 #ifndef PyDict_MAXFREELIST
 #define PyDict_MAXFREELIST 80
 #endif
-/* static OptDict *free_list[PyDict_MAXFREELIST]; */
-/* static int numfree = 0; */
 
-    /* void */
-/* PyDict_Fini(void) */
-/* { */
-    /* OptDict *op; */
+#define POOL_MINSIZE 32
+#define POOL_NCLASSES 8
+#define POOL_MAXSIZE (POOL_MINSIZE << (POOL_NCLASSES - 1))
 
-    /* while (numfree) { */
-        /* op = free_list[--numfree]; */
-        /* assert(PyDict_CheckExact(op)); */
-        /* PyObject_GC_Del(op); */
-    /* } */
-/* } */
+#if defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#endif
 
-int
-init_dummy() 
+    static void *
+default_alloc(void *ctx, size_t size)
 {
-    char *init = "<dummy key>";
-    char *alias = NULL;
-    if (dummy == NULL) {
-        dummy = malloc(12 * sizeof(char));
-        if (dummy == NULL)
-            return 0;
+    return malloc(size);
+}
+
+    static void *
+default_realloc(void *ctx, void *p, size_t oldsize, size_t newsize)
+{
+    return realloc(p, newsize);
+}
+
+    static void
+default_free(void *ctx, void *p, size_t size)
+{
+    free(p);
+}
+
+static const OptDictAllocator default_allocator = {
+    default_alloc, default_realloc, default_free, NULL
+};
+
+#ifdef THREAD_LOCAL
+static THREAD_LOCAL void *pool_free[POOL_NCLASSES];
+static THREAD_LOCAL int pool_nfree[POOL_NCLASSES];
+
+/* The size class of a block of size bytes, or -1 if it's too big. */
+    static int
+pool_class(size_t size)
+{
+    int c;
+    size_t classsize = POOL_MINSIZE;
+
+    for (c = 0; c < POOL_NCLASSES; c++, classsize <<= 1)
+        if (size <= classsize)
+            return c;
+    return -1;
+}
+
+    static void *
+pool_alloc(void *ctx, size_t size)
+{
+    int c = pool_class(size);
+    void *p;
+
+    if (c < 0)
+        return malloc(size);
+    if (pool_nfree[c] > 0) {
+        p = pool_free[c];
+        pool_free[c] = *(void **)p;
+        pool_nfree[c]--;
+        return p;
     }
-    alias = dummy;
-    while(*init) {
-        *alias = *init;
-        ++alias;
-        ++init;
+    return malloc((size_t)POOL_MINSIZE << c);
+}
+
+    static void
+pool_release(void *ctx, void *p, size_t size)
+{
+    int c = pool_class(size);
+
+    if (c < 0 || pool_nfree[c] >= PyDict_MAXFREELIST) {
+        free(p);
+        return;
     }
-    *alias = '\0';
-    return 1;
+    *(void **)p = pool_free[c];
+    pool_free[c] = p;
+    pool_nfree[c]++;
+}
+
+    static void *
+pool_realloc(void *ctx, void *p, size_t oldsize, size_t newsize)
+{
+    int c = pool_class(oldsize);
+    void *newp;
+
+    if (c < 0 && pool_class(newsize) < 0)
+        return realloc(p, newsize);
+    if (c >= 0 && c == pool_class(newsize))
+        return p;
+    newp = pool_alloc(ctx, newsize);
+    if (newp == NULL)
+        return NULL;
+    memcpy(newp, p, oldsize < newsize ? oldsize : newsize);
+    pool_release(ctx, p, oldsize);
+    return newp;
+}
+
+const OptDictAllocator OptDict_Pool = {
+    pool_alloc, pool_realloc, pool_release, NULL
+};
+
+    void
+OptDict_PoolClear(void)
+{
+    int c;
+    void *p;
+
+    for (c = 0; c < POOL_NCLASSES; c++) {
+        while (pool_nfree[c] > 0) {
+            p = pool_free[c];
+            pool_free[c] = *(void **)p;
+            pool_nfree[c]--;
+            free(p);
+        }
+    }
+}
+#else
+const OptDictAllocator OptDict_Pool = {
+    default_alloc, default_realloc, default_free, NULL
+};
+
+    void
+OptDict_PoolClear(void)
+{
+}
+#endif
+
+    static void *
+dict_alloc(OptDict *mp, size_t size)
+{
+    return mp->ma_allocator.alloc(mp->ma_allocator.ctx, size);
+}
+
+/* dict_alloc() of n zeroed items of the given size. */
+    static void *
+dict_calloc(OptDict *mp, size_t n, size_t size)
+{
+    void *p;
+
+    if (mp->ma_allocator.alloc == default_alloc)
+        return calloc(n, size);
+    if (size != 0 && n > (size_t)-1 / size)
+        return NULL;
+    p = dict_alloc(mp, n * size);
+    if (p != NULL)
+        memset(p, 0, n * size);
+    return p;
+}
+
+/* Free a block of the given size from dict_alloc(); NULL is ignored. */
+    static void
+dict_free(OptDict *mp, void *p, size_t size)
+{
+    if (p != NULL)
+        mp->ma_allocator.free(mp->ma_allocator.ctx, p, size);
 }
 
     static int
-eqint(void *a, void *b)
+eqint(void *a, void *b, size_t size)
 {
     return *(int*)a == *(int*)b;
 }
 
     static int
-eqfloat(void *a, void *b)
+eqfloat(void *a, void *b, size_t size)
 {
     return *(float*)a == *(float*)b;
 }
 
     static int
-eqdouble(void *a, void *b)
+eqdouble(void *a, void *b, size_t size)
 {
     return *(double*)a == *(double*)b;
 }
 
-/* forward declaration */
+    static int
+eqbytes(void *a, void *b, size_t size)
+{
+    return memcmp(a, b, size) == 0;
+}
+
+/* forward declarations */
     static OptDictEntry *
 lookdict(OptDict *mp, void *key, register long hash);
-
+    static OptDictEntry *
+lookdict_small(OptDict *mp, void *key, register long hash);
+static int dictresize(OptDict *mp, size_t minused);
+static void migrate(OptDict *mp, size_t n);
+static void store_init(OptDictStore *st, size_t size);
+static void store_free_blocks(OptDict *mp, OptDictKeyBlock *kb,
+                              size_t slotsize);
+static void table_free(OptDict *mp, OptDictEntry *table, size_t nslots,
+                       int mapped);
+static int unshare_table(OptDict *mp);
+static void release_shared(OptDict *mp, OptDictShared *sh);
+static long hashint(void *key, size_t size);
+static long hashfloat(void *key, size_t size);
+static long hashdouble(void *key, size_t size);
+static long hashbytes(void *key, size_t size);
+static void bloom_insert(OptDict *mp, long hash);
+static void bloom_free(OptDict *mp);
+
+/* Create a dict whose memory comes from allocator (malloc() and friends if
+ * it's NULL).  keysize is the width of BYTES_KEY keys, and is ignored for the
+ * other key types.
+ */
     OptDict *
-OptDict_New(enum key_t key_type)
+OptDict_NewEx(enum key_t key_type, size_t keysize,
+              const OptDictAllocator *allocator)
 {
     register OptDict *mp;
-    if (dummy == NULL) { /* Auto-initialize dummy */
-        if (!init_dummy())
-            return NULL;
-    }
-    mp = malloc(sizeof(OptDict));
+
+    if (key_type == BYTES_KEY && keysize == 0)
+        return NULL;
+    if (allocator == NULL)
+        allocator = &default_allocator;
+    mp = allocator->alloc(allocator->ctx, sizeof(OptDict));
     if (mp == NULL)
         return NULL;
+    mp->ma_allocator = *allocator;
     EMPTY_TO_MINSIZE(mp);
-    mp->ma_lookup = lookdict;
+    mp->ma_small = 1;
+    mp->ma_lookup = lookdict_small;
+    mp->ma_keytype = key_type;
     switch(key_type) {
         case INT_KEY:
             mp->eqfunc = eqint;
+            mp->hashfunc = hashint;
+            mp->ma_keysize = sizeof(int);
             break;
         case FLOAT_KEY:
             mp->eqfunc = eqfloat;
+            mp->hashfunc = hashfloat;
+            mp->ma_keysize = sizeof(float);
             break;
         case DOUBLE_KEY:
             mp->eqfunc = eqdouble;
+            mp->hashfunc = hashdouble;
+            mp->ma_keysize = sizeof(double);
+            break;
+        case BYTES_KEY:
+            mp->eqfunc = eqbytes;
+            mp->hashfunc = hashbytes;
+            mp->ma_keysize = keysize;
             break;
     }
+    store_init(&mp->ma_keys, mp->ma_keysize);
+    mp->ma_valsize = sizeof(OptDictValue);
+    mp->ma_valtype = NULL;
+    mp->ma_vallayout = VALUES_IN_ENTRIES;
+    mp->ma_valoffset = 0;
+    store_init(&mp->ma_values, 0);
+    mp->ma_ncache = 0;
+    mp->ma_cachehits = mp->ma_cachemisses = 0;
+    mp->ma_filter = NULL;
+    mp->ma_filtermem = NULL;
+    mp->ma_filtermask = mp->ma_filterkeys = mp->ma_filtercap = 0;
+    mp->ma_frozen = 0;
+    mp->ma_counts = NULL;
+    mp->ma_pilots = NULL;
+    mp->ma_nbuckets = 0;
+    mp->ma_resizestep = 0;
+    mp->ma_oldtable = NULL;
+    mp->ma_tableflags = 0;
+    mp->ma_tablemapped = 0;
+    mp->ma_maxdummies = mp->ma_minfill = 0.0;
+    mp->ma_prefetch = PREFETCH_DISTANCE;
+    mp->ma_occupied = NULL;
+    mp->ma_shared = NULL;
+    mp->ma_tableshared = 0;
     return mp;
 }
 
-long
-int_hash(int x)
+/* Use OptDict_NewBytes() for BYTES_KEY. */
+    OptDict *
+OptDict_New(enum key_t key_type)
 {
-    long y = (long) x;
-    if (-1 == y)
-        y = -2;
-    return y;
+    return OptDict_NewEx(key_type, 0, NULL);
 }
 
-/*
-   The basic lookup function used by all operations.
-   This is based on Algorithm D from Knuth Vol. 3, Sec. 6.4.
-   Open addressing is preferred over chaining since the link overhead for
-   chaining would be substantial (100% with typical malloc overhead).
-
-   The initial probe index is computed as hash mod the table size. Subsequent
-   probe indices are computed as explained earlier.
+/* A dict whose keys are strings of exactly keysize bytes, compared with
+ * memcmp() -- NumPy's 'S' dtype, say, with shorter strings padded with NULs.
+ */
+    OptDict *
+OptDict_NewBytes(size_t keysize)
+{
+    return OptDict_NewEx(BYTES_KEY, keysize, NULL);
+}
 
-   All arithmetic on hash should ignore overflow.
+/* Value types.  The complex types are pairs of floats or doubles, laid out
+ * like C99's float complex and double complex.
+ */
+#define ALIGNOF(type) offsetof(struct { char c; type x; }, x)
+#define VALUETYPE(type, format) { sizeof(type), ALIGNOF(type), format }
+
+typedef struct { float re, im; } complex64;
+typedef struct { double re, im; } complex128;
+
+const OptDictValueType OptDict_Int8 = VALUETYPE(int8_t, "b");
+const OptDictValueType OptDict_UInt8 = VALUETYPE(uint8_t, "B");
+const OptDictValueType OptDict_Int16 = VALUETYPE(int16_t, "h");
+const OptDictValueType OptDict_UInt16 = VALUETYPE(uint16_t, "H");
+const OptDictValueType OptDict_Int32 = VALUETYPE(int32_t, "i");
+const OptDictValueType OptDict_UInt32 = VALUETYPE(uint32_t, "I");
+const OptDictValueType OptDict_Int64 = VALUETYPE(int64_t, "q");
+const OptDictValueType OptDict_UInt64 = VALUETYPE(uint64_t, "Q");
+const OptDictValueType OptDict_Float32 = VALUETYPE(float, "f");
+const OptDictValueType OptDict_Float64 = VALUETYPE(double, "d");
+const OptDictValueType OptDict_Complex64 = VALUETYPE(complex64, "Zf");
+const OptDictValueType OptDict_Complex128 = VALUETYPE(complex128, "Zd");
+
+/* Give the empty dict mp values of type vt, stored according to layout;
+ * vt == NULL restores the default (OptDictValue, VALUES_IN_ENTRIES).  With
+ * VALUES_IN_ENTRIES a value can be at most sizeof(OptDictValue) bytes; the
+ * other layouts take any size.  Returns 0, ERR_VALUE_TYPE for a bad type or
+ * layout, or -1 if the dict has ever held a key.  The fused updates
+ * (OptDict_Increment() and the like) only work with the default.
+ */
+    int
+OptDict_SetValueType(OptDict *mp, const OptDictValueType *vt,
+                     enum value_layout layout)
+{
+    size_t size = sizeof(OptDictValue), offset = 0;
 
-   (The details in this version are due to Tim Peters, building on many past
-   contributions by Reimer Behrends, Jyrki Alakuijala, Vladimir Marangozov and
-   Christian Tismer).
+    if (mp->ma_used != 0 || mp->ma_keys.st_blocks != NULL)
+        return -1;
+    if (vt != NULL) {
+        if (vt->vt_size == 0 || vt->vt_align == 0
+                || (vt->vt_align & (vt->vt_align - 1)) != 0
+                || vt->vt_align > KEYSLOT_ALIGN)
+            return ERR_VALUE_TYPE;
+        size = vt->vt_size;
+    }
+    switch (layout) {
+        case VALUES_IN_ENTRIES:
+            if (size > sizeof(OptDictValue))
+                return ERR_VALUE_TYPE;
+            break;
+        case VALUES_WITH_KEYS:
+            if (vt == NULL)
+                return ERR_VALUE_TYPE;
+            offset = (mp->ma_keysize + vt->vt_align - 1)
+                     / vt->vt_align * vt->vt_align;
+            break;
+        case VALUES_SEPARATE:
+            if (vt == NULL)
+                return ERR_VALUE_TYPE;
+            break;
+        default:
+            return ERR_VALUE_TYPE;
+    }
+    mp->ma_valsize = size;
+    mp->ma_valtype = vt;
+    mp->ma_vallayout = layout;
+    mp->ma_valoffset = offset;
+    store_init(&mp->ma_keys, layout == VALUES_WITH_KEYS ? offset + size
+                                                        : mp->ma_keysize);
+    store_init(&mp->ma_values, layout == VALUES_SEPARATE ? size : 0);
+    return 0;
+}
 
-   lookdict() is general-purpose, and may return NULL if (and only if) a
-   comparison raises an exception (this was new in Python 2.5).
-   lookdict_string() below is specialized to string keys, comparison of which can
-   never raise an exception; that function can never return NULL.  For both, when
-   the key isn't found a PyDictEntry* is returned for which the me_value field is
-   NULL; this is the slot in the dict at which the key would have been found, and
-   the caller can (if it wishes) add the <key, value> pair to the returned
-   PyDictEntry*.
-   */
+    void
+OptDict_Dealloc(OptDict *mp)
+{
+    if (mp == NULL)
+        return;
+    store_free_blocks(mp, mp->ma_keys.st_blocks, mp->ma_keys.st_slot);
+    store_free_blocks(mp, mp->ma_values.st_blocks, mp->ma_values.st_slot);
+    if (!mp->ma_tableshared) {
+        if (mp->ma_table != mp->ma_smalltable)
+            table_free(mp, mp->ma_table, mp->ma_mask + 1, mp->ma_tablemapped);
+        dict_free(mp, mp->ma_pilots, mp->ma_nbuckets * sizeof(unsigned int));
+        dict_free(mp, mp->ma_occupied,
+                  OCCUPIED_WORDS(mp->ma_mask + 1) * sizeof(uint64_t));
+    }
+    if (mp->ma_oldtable != NULL && mp->ma_oldtable != mp->ma_smalltable)
+        table_free(mp, mp->ma_oldtable, mp->ma_oldmask + 1,
+                   mp->ma_oldtablemapped);
+    dict_free(mp, mp->ma_counts, (mp->ma_mask + 1) * sizeof(size_t));
+    bloom_free(mp);
+    release_shared(mp, mp->ma_shared);
+    dict_free(mp, mp, sizeof(OptDict));
+}
 
-    static OptDictEntry *
-lookdict(OptDict *mp, void *key, register long hash)
+    static void
+store_init(OptDictStore *st, size_t size)
 {
-    register size_t i;
-    register size_t perturb;
-    register OptDictEntry *freeslot;
-    register size_t mask = (size_t)mp->ma_mask;
-    OptDictEntry *ep0 = mp->ma_table;
-    register OptDictEntry *ep;
+    st->st_size = size;
+    st->st_slot = KEYSLOT_ROUND(size);
+    st->st_blocks = NULL;
+    st->st_next = NULL;
+    st->st_left = 0;
+    st->st_free = NULL;
+}
 
-    i = hash & mask;
-    ep = &ep0[i];
-    if (ep->me_key == NULL || ep->me_key == key)
-        return ep;
-    if (ep->me_key == dummy)
-        freeslot = ep;
-    else {
-        if (ep->me_hash == hash && mp->eqfunc(ep->me_key, key))
-            return ep;
-        freeslot = NULL;
+/* Return a new slot from st, or NULL if no memory.  The first block holds
+ * optdict_MINSIZE items, and each new block is as large as all the previous
+ * ones together (up to KEYBLOCK_MAXSLOTS), so there are O(log n) blocks for
+ * n items.
+ */
+    static void *
+store_alloc(OptDict *mp, OptDictStore *st)
+{
+    void *slot;
+    size_t nslots;
+    OptDictKeyBlock *kb;
+
+    if (st->st_free != NULL) {
+        slot = st->st_free;
+        st->st_free = *(void **)slot;
+        return slot;
     }
-
-    /* In the loop, me_key == dummy is by far (factor of 100s) the
-       least likely outcome, so test for that last. */
-    for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
-        i = (i << 2) + i + perturb + 1;
-        ep = &ep0[i & mask];
-        if (ep->me_key == NULL)
-            return freeslot == NULL ? ep : freeslot;
-        if (ep->me_key == key
-                || (ep->me_hash == hash
-                    && ep->me_key != dummy
-                    && mp->eqfunc(ep->me_key, key)))
-            return ep;
-        if (ep->me_key == dummy && freeslot == NULL)
-            freeslot = ep;
+    if (st->st_left == 0) {
+        nslots = mp->ma_used;
+        if (nslots < optdict_MINSIZE)
+            nslots = optdict_MINSIZE;
+        if (nslots > KEYBLOCK_MAXSLOTS)
+            nslots = KEYBLOCK_MAXSLOTS;
+        kb = dict_alloc(mp, KEYBLOCK_HEADER + nslots * st->st_slot);
+        if (kb == NULL)
+            return NULL;
+        kb->kb_next = st->st_blocks;
+        kb->kb_nslots = nslots;
+        st->st_blocks = kb;
+        st->st_next = (char *)kb + KEYBLOCK_HEADER;
+        st->st_left = nslots;
     }
-    assert(0);          /* NOT REACHED */
-    return 0;
+    slot = st->st_next;
+    st->st_next += st->st_slot;
+    st->st_left--;
+    return slot;
 }
 
-/* #ifdef SHOW_TRACK_COUNT */
-/* #define INCREASE_TRACK_COUNT \ */
-    /* (count_tracked++, count_untracked--); */
-/* #define DECREASE_TRACK_COUNT \ */
-    /* (count_tracked--, count_untracked++); */
-/* #else */
-/* #define INCREASE_TRACK_COUNT */
-/* #define DECREASE_TRACK_COUNT */
-/* #endif */
+/* Give a slot obtained from store_alloc() back for reuse. */
+    static void
+store_free(OptDictStore *st, void *slot)
+{
+    *(void **)slot = st->st_free;
+    st->st_free = slot;
+}
 
-/* #define MAINTAIN_TRACKING(mp, key, value) \ */
-    /* do { \ */
-        /* if (!_PyObject_GC_IS_TRACKED(mp)) { \ */
-            /* if (_PyObject_GC_MAY_BE_TRACKED(key) || \ */
-                    /* _PyObject_GC_MAY_BE_TRACKED(value)) { \ */
-                /* _PyObject_GC_TRACK(mp); \ */
-                /* INCREASE_TRACK_COUNT \ */
-            /* } \ */
-        /* } \ */
-    /* } while(0) */
+/* Free a chain of blocks of slotsize-byte slots. */
+    static void
+store_free_blocks(OptDict *mp, OptDictKeyBlock *kb, size_t slotsize)
+{
+    OptDictKeyBlock *next;
 
-    /* void */
-/* _PyDict_MaybeUntrack(PyObject *op) */
-/* { */
-    /* OptDict *mp; */
-    /* PyObject *value; */
-    /* Py_ssize_t mask, i; */
-    /* PyDictEntry *ep; */
+    for (; kb != NULL; kb = next) {
+        next = kb->kb_next;
+        dict_free(mp, kb, KEYBLOCK_HEADER + kb->kb_nslots * slotsize);
+    }
+}
 
-    /* if (!PyDict_CheckExact(op) || !_PyObject_GC_IS_TRACKED(op)) */
-        /* return; */
+/* Return a copy of the ma_keysize bytes at key in the dict's key storage, or
+ * NULL if no memory.
+ */
+    static void *
+copy_key(OptDict *mp, void *key)
+{
+    void *slot = store_alloc(mp, &mp->ma_keys);
 
-    /* mp = (OptDict *) op; */
-    /* ep = mp->ma_table; */
-    /* mask = mp->ma_mask; */
-    /* for (i = 0; i <= mask; i++) { */
-        /* if ((value = ep[i].me_value) == NULL) */
-            /* continue; */
-        /* if (_PyObject_GC_MAY_BE_TRACKED(value) || */
-                /* _PyObject_GC_MAY_BE_TRACKED(ep[i].me_key)) */
-            /* return; */
-    /* } */
-    /* DECREASE_TRACK_COUNT */
-        /* _PyObject_GC_UNTRACK(op); */
-/* } */
+    if (slot != NULL)
+        memcpy(slot, key, mp->ma_keysize);
+    return slot;
+}
 
+/* Occupancy bitmap.  Bit i of ma_occupied is set while ma_table[i] is
+ * active, so iteration (OptDict_Next()) can skip runs of empty and dummy
+ * slots a word at a time instead of reading every entry.  It exists for
+ * ordinary tables only: a small table is dense, a perfect one full, and
+ * while a resize is in progress it covers ma_table, not ma_oldtable.
+ */
+    static void
+mark_entry(OptDict *mp, OptDictEntry *ep, int active)
+{
+    size_t i;
 
-/*
-   Internal routine to insert a new item into the table.
-   Used both by the internal resize routine and by the public insert routine.
-   Eats a reference to key and one to value.
-   Returns -1 if an error occurred, or 0 on success.
-   */
+    if (mp->ma_occupied == NULL || ep < mp->ma_table
+            || ep > mp->ma_table + mp->ma_mask)
+        return;
+    i = (size_t)(ep - mp->ma_table);
+    if (active)
+        mp->ma_occupied[i / 64] |= (uint64_t)1 << (i % 64);
+    else
+        mp->ma_occupied[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+/* Store key, hash and a copy of the value at `value` in ep, an unused or
+ * dummy entry.  Returns 0, or ERR_NO_MEM and leaves ep alone.
+ */
     static int
-insertdict(register OptDict *mp, void *key, long hash, void *value, void *oldvalue)
+fill_entry(OptDict *mp, OptDictEntry *ep, void *key, long hash, void *value)
 {
-    register OptDictEntry *ep;
-    typedef OptDictEntry *(*lookupfunc)(OptDict *, void *, long);
+    void *newkey = copy_key(mp, key);
 
-    oldvalue = NULL;
-
-    assert(mp->ma_lookup != NULL);
-    ep = mp->ma_lookup(mp, key, hash);
-    if (ep == NULL) {
-        return -1;
-    }
-    /* For Python garbage collection tracking */
-    /* MAINTAIN_TRACKING(mp, key, value); */
-    if (ep->me_value != NULL) {
-        oldvalue = ep->me_value;
-        ep->me_value = value;
+    if (newkey == NULL)
+        return ERR_NO_MEM;
+    if (mp->ma_vallayout == VALUES_SEPARATE) {
+        void *newvalue = store_alloc(mp, &mp->ma_values);
+        if (newvalue == NULL) {
+            store_free(&mp->ma_keys, newkey);
+            return ERR_NO_MEM;
+        }
+        ep->me_value.v_ptr = newvalue;
     }
+    if (ep->me_key == NULL)
+        mp->ma_fill++;
     else {
-        if (ep->me_key == NULL)
-            mp->ma_fill++;
-        else {
-            assert(ep->me_key == dummy);
-        }
-        ep->me_key = key;
-        ep->me_hash = hash;
-        ep->me_value = value;
-        mp->ma_used++;
+        assert(ep->me_key == dummy);
     }
+    ep->me_key = newkey;
+    ep->me_hash = hash;
+    memcpy(VALUE_OF(mp, ep), value, mp->ma_valsize);
+    mark_entry(mp, ep, 1);
+    mp->ma_used++;
+    if (mp->ma_filter != NULL)
+        bloom_insert(mp, hash);
     return 0;
 }
 
-/* Internal routine used by dictresize() to insert an item which is known to be
- * absent from the dict.  This routine also assumes that the dict contains no
- * deleted entries.  Besides the performance benefit, using insertdict() in
- * dictresize() is dangerous (SF bug #1456209).  Note that no refcounts are
- * changed by this routine; if needed, the caller is responsible for incref'ing
- * `key` and `value`. 
- */
-    static void
-insertdict_clean(register OptDict *mp, void *key, long hash,
-        void *value)
+long
+int_hash(int x)
 {
-    register size_t i;
-    register size_t perturb;
+    long y = (long) x;
+    if (-1 == y)
+        y = -2;
+    return y;
+}
+
+/* This is _Py_HashDouble() from CPython, except that integral values too big
+ * for a C long are hashed like any other double instead of like a Python
+ * long.  Equal doubles hash equal (0.0 and -0.0 in particular), and doubles
+ * holding an int hash the same as that int.
+ */
+long
+double_hash(double v)
+{
+    double intpart, fractpart;
+    int expo;
+    long hipart;
+    long x;             /* the final hash value */
+
+    if (!isfinite(v)) {
+        if (isinf(v))
+            return v < 0 ? -271828 : 314159;
+        else
+            return 0;
+    }
+    fractpart = modf(v, &intpart);
+    if (fractpart == 0.0 && intpart <= LONG_MAX/2 && -intpart <= LONG_MAX/2) {
+        /* Fits in a C long, so is its own hash. */
+        x = (long)intpart;
+        if (x == -1)
+            x = -2;
+        return x;
+    }
+    /* Use frexp to get at the bits in the double.  Each of the two parts
+     * may have as many as 56 significant bits; frexp and multiplication
+     * break them into longs.
+     */
+    v = frexp(v, &expo);
+    v *= 2147483648.0;          /* 2**31 */
+    hipart = (long)v;           /* take the top 32 bits */
+    v = (v - (double)hipart) * 2147483648.0; /* get the next 32 bits */
+    x = hipart + (long)v + (expo << 15);
+    if (x == -1)
+        x = -2;
+    return x;
+}
+
+long
+float_hash(float x)
+{
+    return double_hash((double)x);
+}
+
+/* string_hash() from CPython 2.7, without the randomization. */
+long
+bytes_hash(const void *s, size_t len)
+{
+    register const unsigned char *p = s;
+    register unsigned long x;
+    size_t n;
+
+    if (len == 0)
+        return 0;
+    x = (unsigned long)*p << 7;
+    for (n = len; n > 0; n--)
+        x = (1000003UL*x) ^ *p++;
+    x ^= len;
+    if ((long)x == -1)
+        x = (unsigned long)-2;
+    return (long)x;
+}
+
+    static long
+hashint(void *key, size_t size)
+{
+    return int_hash(*(int*)key);
+}
+
+    static long
+hashfloat(void *key, size_t size)
+{
+    return float_hash(*(float*)key);
+}
+
+    static long
+hashdouble(void *key, size_t size)
+{
+    return double_hash(*(double*)key);
+}
+
+    static long
+hashbytes(void *key, size_t size)
+{
+    return bytes_hash(key, size);
+}
+
+/*
+   Bulk hashing.  The batched entry points (OptDict_CountArray() and the
+   like) hash all their keys in one pass before touching the table, and that
+   pass is worth vectorizing: int_hash() is a sign extension, and
+   double_hash() of an integral double is a conversion.  The *_hash_array()
+   functions give exactly the values of the scalar hash functions.  On
+   x86-64 they use AVX2 or AVX-512 kernels when the CPU has them (chosen at
+   run time, on first use), and otherwise the scalar loops below (ints still
+   get SSE2, which every x86-64 has).
+
+   Doubles take a vector path only for finite values: integral ones that fit
+   a conversion, and (with AVX2) normal non-integral ones, whose frexp() the
+   kernel does with bit operations.  A group of keys with anything else in
+   it -- NaN, infinities, denormals, huge integers -- is hashed with
+   double_hash().  Byte strings are hashed four keys at a time but with
+   scalar code: each key's hash is a serial chain of 64-bit multiplies, and
+   vector lanes (which AVX2 can only multiply 32 bits at a time, and AVX-512
+   with a long latency) came out slower than interleaving the chains.
+   */
+
+    static void
+int_hash_scalar(const int *keys, size_t n, long *hashes)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    /* int_hash(-1) is -2, which still fits in an int, so fix that up
+     * before sign-extending to 64 bits. */
+    if (sizeof(long) == 8) {
+        const __m128i minus1 = _mm_set1_epi32(-1);
+        for (; i + 4 <= n; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+            __m128i sign;
+            v = _mm_add_epi32(v, _mm_cmpeq_epi32(v, minus1));
+            sign = _mm_srai_epi32(v, 31);
+            _mm_storeu_si128((__m128i *)(hashes + i), _mm_unpacklo_epi32(v, sign));
+            _mm_storeu_si128((__m128i *)(hashes + i + 2),
+                             _mm_unpackhi_epi32(v, sign));
+        }
+    }
+#endif
+    for (; i < n; i++)
+        hashes[i] = int_hash(keys[i]);
+}
+
+    static void
+float_hash_scalar(const float *keys, size_t n, long *hashes)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        hashes[i] = float_hash(keys[i]);
+}
+
+    static void
+double_hash_scalar(const double *keys, size_t n, long *hashes)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        hashes[i] = double_hash(keys[i]);
+}
+
+/* Four keys at a time, so that four independent multiply chains overlap. */
+    static void
+bytes_hash_scalar(const unsigned char *keys, size_t keysize, size_t n,
+                  long *hashes)
+{
+    register unsigned long x0, x1, x2, x3;
+    const unsigned char *p;
+    size_t i = 0, j;
+
+    if (keysize == 0) {
+        memset(hashes, 0, n * sizeof(long));
+        return;
+    }
+    for (; i + 4 <= n; i += 4) {
+        p = keys + i * keysize;
+        x0 = (unsigned long)p[0] << 7;
+        x1 = (unsigned long)p[keysize] << 7;
+        x2 = (unsigned long)p[2*keysize] << 7;
+        x3 = (unsigned long)p[3*keysize] << 7;
+        for (j = 0; j < keysize; j++) {
+            x0 = (1000003UL*x0) ^ p[j];
+            x1 = (1000003UL*x1) ^ p[keysize + j];
+            x2 = (1000003UL*x2) ^ p[2*keysize + j];
+            x3 = (1000003UL*x3) ^ p[3*keysize + j];
+        }
+        x0 ^= keysize;
+        x1 ^= keysize;
+        x2 ^= keysize;
+        x3 ^= keysize;
+        hashes[i] = (long)x0 == -1 ? -2 : (long)x0;
+        hashes[i + 1] = (long)x1 == -1 ? -2 : (long)x1;
+        hashes[i + 2] = (long)x2 == -1 ? -2 : (long)x2;
+        hashes[i + 3] = (long)x3 == -1 ? -2 : (long)x3;
+    }
+    for (; i < n; i++)
+        hashes[i] = bytes_hash(keys + i * keysize, keysize);
+}
+
+typedef struct {
+    void (*ints)(const int *keys, size_t n, long *hashes);
+    void (*floats)(const float *keys, size_t n, long *hashes);
+    void (*doubles)(const double *keys, size_t n, long *hashes);
+    void (*bytes)(const unsigned char *keys, size_t keysize, size_t n,
+                  long *hashes);
+} hash_kernels;
+
+static const hash_kernels scalar_kernels = {
+    int_hash_scalar, float_hash_scalar, double_hash_scalar, bytes_hash_scalar
+};
+
+#ifdef HAVE_HASH_KERNELS
+
+    __attribute__((target("avx2"))) static void
+int_hash_avx2(const int *keys, size_t n, long *hashes)
+{
+    const __m128i minus1 = _mm_set1_epi32(-1);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+        v = _mm_add_epi32(v, _mm_cmpeq_epi32(v, minus1));
+        _mm256_storeu_si256((__m256i *)(hashes + i), _mm256_cvtepi32_epi64(v));
+    }
+    for (; i < n; i++)
+        hashes[i] = int_hash(keys[i]);
+}
+
+/* Hash the four doubles in v into out, or return 0 if one of them needs
+ * double_hash(). */
+    __attribute__((target("avx2"))) static int
+double_hash4_avx2(__m256d v, long *out)
+{
+    const __m256d absmask = _mm256_castsi256_pd(
+            _mm256_set1_epi64x(0x7fffffffffffffffLL));
+    const __m256d two51 = _mm256_set1_pd(2251799813685248.0);
+    const __m256d magic = _mm256_set1_pd(6755399441055744.0);  /* 2**52 + 2**51 */
+    const __m256d two31 = _mm256_set1_pd(2147483648.0);
+    const __m256i expmask = _mm256_set1_epi64x(0x7ff0000000000000LL);
+    __m256d a = _mm256_and_pd(v, absmask);
+    __m256d t = _mm256_round_pd(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m256d integral = _mm256_and_pd(_mm256_cmp_pd(v, t, _CMP_EQ_OQ),
+                                     _mm256_cmp_pd(a, two51, _CMP_LT_OQ));
+    __m256d normal = _mm256_and_pd(
+            _mm256_cmp_pd(v, t, _CMP_NEQ_OQ),
+            _mm256_cmp_pd(a, _mm256_set1_pd(2.2250738585072014e-308), _CMP_GE_OQ));
+    __m256i x, y, bits, expo;
+    __m256d m, hi, lo;
+
+    if (_mm256_movemask_pd(_mm256_or_pd(integral, normal)) != 0xf)
+        return 0;
+    /* Integral values below 2**51 convert exactly by adding magic and
+     * subtracting its bits. */
+    x = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(v, magic)),
+                         _mm256_castpd_si256(magic));
+    /* frexp(v): the mantissa is v with the exponent of 0.5, and the
+     * exponent the rest. */
+    bits = _mm256_castpd_si256(v);
+    expo = _mm256_sub_epi64(
+            _mm256_srli_epi64(_mm256_and_si256(bits, expmask), 52),
+            _mm256_set1_epi64x(1022));
+    m = _mm256_castsi256_pd(_mm256_or_si256(
+            _mm256_andnot_si256(expmask, bits),
+            _mm256_set1_epi64x(0x3fe0000000000000LL)));
+    m = _mm256_mul_pd(m, two31);
+    hi = _mm256_round_pd(m, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    lo = _mm256_round_pd(_mm256_mul_pd(_mm256_sub_pd(m, hi), two31),
+                         _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    y = _mm256_add_epi64(
+            _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(hi, magic)),
+                             _mm256_castpd_si256(magic)),
+            _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(lo, magic)),
+                             _mm256_castpd_si256(magic)));
+    y = _mm256_add_epi64(y, _mm256_slli_epi64(expo, 15));
+    x = _mm256_castpd_si256(_mm256_blendv_pd(_mm256_castsi256_pd(y),
+                                             _mm256_castsi256_pd(x), integral));
+    x = _mm256_add_epi64(x, _mm256_cmpeq_epi64(x, _mm256_set1_epi64x(-1)));
+    _mm256_storeu_si256((__m256i *)out, x);
+    return 1;
+}
+
+    __attribute__((target("avx2"))) static void
+double_hash_avx2(const double *keys, size_t n, long *hashes)
+{
+    size_t i = 0, j;
+
+    for (; i + 4 <= n; i += 4)
+        if (!double_hash4_avx2(_mm256_loadu_pd(keys + i), hashes + i))
+            for (j = i; j < i + 4; j++)
+                hashes[j] = double_hash(keys[j]);
+    for (; i < n; i++)
+        hashes[i] = double_hash(keys[i]);
+}
+
+    __attribute__((target("avx2"))) static void
+float_hash_avx2(const float *keys, size_t n, long *hashes)
+{
+    size_t i = 0, j;
+
+    for (; i + 4 <= n; i += 4)
+        if (!double_hash4_avx2(_mm256_cvtps_pd(_mm_loadu_ps(keys + i)),
+                               hashes + i))
+            for (j = i; j < i + 4; j++)
+                hashes[j] = float_hash(keys[j]);
+    for (; i < n; i++)
+        hashes[i] = float_hash(keys[i]);
+}
+
+static const hash_kernels avx2_kernels = {
+    int_hash_avx2, float_hash_avx2, double_hash_avx2, bytes_hash_scalar
+};
+
+#define AVX512 "avx512f,avx512dq"
+
+    __attribute__((target(AVX512))) static void
+int_hash_avx512(const int *keys, size_t n, long *hashes)
+{
+    const __m256i minus1 = _mm256_set1_epi32(-1);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+        v = _mm256_add_epi32(v, _mm256_cmpeq_epi32(v, minus1));
+        _mm512_storeu_si512(hashes + i, _mm512_cvtepi32_epi64(v));
+    }
+    for (; i < n; i++)
+        hashes[i] = int_hash(keys[i]);
+}
+
+/* As double_hash4_avx2(), for eight doubles.  AVX-512 converts the whole
+ * range of a long and has frexp() in getexp and getmant, so everything
+ * finite takes the vector path. */
+    __attribute__((target(AVX512))) static int
+double_hash8_avx512(__m512d v, long *out)
+{
+    const __m512d two31 = _mm512_set1_pd(2147483648.0);
+    __m512d t = _mm512_roundscale_pd(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m512d a = _mm512_abs_pd(v);
+    __mmask8 finite = _mm512_cmp_pd_mask(a, _mm512_set1_pd(HUGE_VAL), _CMP_LT_OQ);
+    __mmask8 integral = _mm512_cmp_pd_mask(v, t, _CMP_EQ_OQ)
+                        & _mm512_cmp_pd_mask(a, _mm512_set1_pd(4611686018427387904.0),
+                                             _CMP_LE_OQ);
+    __m512i x, expo;
+    __m512d m, hi, lo;
+
+    if (finite != 0xff || (_mm512_cmp_pd_mask(v, t, _CMP_EQ_OQ) & ~integral))
+        return 0;
+    m = _mm512_mul_pd(_mm512_getmant_pd(v, _MM_MANT_NORM_p5_1, _MM_MANT_SIGN_src),
+                      two31);
+    expo = _mm512_add_epi64(_mm512_cvttpd_epi64(_mm512_getexp_pd(v)),
+                            _mm512_set1_epi64(1));
+    hi = _mm512_roundscale_pd(m, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    lo = _mm512_mul_pd(_mm512_sub_pd(m, hi), two31);
+    x = _mm512_add_epi64(_mm512_add_epi64(_mm512_cvttpd_epi64(hi),
+                                          _mm512_cvttpd_epi64(lo)),
+                         _mm512_slli_epi64(expo, 15));
+    x = _mm512_mask_mov_epi64(x, integral, _mm512_cvttpd_epi64(v));
+    x = _mm512_mask_mov_epi64(x, _mm512_cmpeq_epi64_mask(x, _mm512_set1_epi64(-1)),
+                              _mm512_set1_epi64(-2));
+    _mm512_storeu_si512(out, x);
+    return 1;
+}
+
+    __attribute__((target(AVX512))) static void
+double_hash_avx512(const double *keys, size_t n, long *hashes)
+{
+    size_t i = 0, j;
+
+    for (; i + 8 <= n; i += 8)
+        if (!double_hash8_avx512(_mm512_loadu_pd(keys + i), hashes + i))
+            for (j = i; j < i + 8; j++)
+                hashes[j] = double_hash(keys[j]);
+    for (; i < n; i++)
+        hashes[i] = double_hash(keys[i]);
+}
+
+    __attribute__((target(AVX512))) static void
+float_hash_avx512(const float *keys, size_t n, long *hashes)
+{
+    size_t i = 0, j;
+
+    for (; i + 8 <= n; i += 8)
+        if (!double_hash8_avx512(_mm512_cvtps_pd(_mm256_loadu_ps(keys + i)),
+                                 hashes + i))
+            for (j = i; j < i + 8; j++)
+                hashes[j] = float_hash(keys[j]);
+    for (; i < n; i++)
+        hashes[i] = float_hash(keys[i]);
+}
+
+static const hash_kernels avx512_kernels = {
+    int_hash_avx512, float_hash_avx512, double_hash_avx512, bytes_hash_scalar
+};
+
+#endif /* HAVE_HASH_KERNELS */
+
+static const hash_kernels *kernels;
+
+/* The best kernels this CPU runs.  Racing threads all pick the same ones. */
+    static const hash_kernels *
+get_kernels(void)
+{
+    if (kernels == NULL) {
+#ifdef HAVE_HASH_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+            kernels = &avx512_kernels;
+        else if (__builtin_cpu_supports("avx2"))
+            kernels = &avx2_kernels;
+        else
+#endif
+            kernels = &scalar_kernels;
+    }
+    return kernels;
+}
+
+/* hashes[i] = int_hash(keys[i]) for i in range(n), and so on. */
+    void
+int_hash_array(const int *keys, size_t n, long *hashes)
+{
+    get_kernels()->ints(keys, n, hashes);
+}
+
+    void
+float_hash_array(const float *keys, size_t n, long *hashes)
+{
+    get_kernels()->floats(keys, n, hashes);
+}
+
+    void
+double_hash_array(const double *keys, size_t n, long *hashes)
+{
+    get_kernels()->doubles(keys, n, hashes);
+}
+
+/* The n keys are packed, keysize bytes apiece. */
+    void
+bytes_hash_array(const void *keys, size_t keysize, size_t n, long *hashes)
+{
+    get_kernels()->bytes(keys, keysize, n, hashes);
+}
+
+/* Hash n packed keys of mp's key type with mp's hash function. */
+    void
+OptDict_HashArray(OptDict *mp, const void *keys, size_t n, long *hashes)
+{
+    if (mp->hashfunc == hashint)
+        int_hash_array(keys, n, hashes);
+    else if (mp->hashfunc == hashfloat)
+        float_hash_array(keys, n, hashes);
+    else if (mp->hashfunc == hashdouble)
+        double_hash_array(keys, n, hashes);
+    else
+        bytes_hash_array(keys, mp->ma_keysize, n, hashes);
+}
+
+/*
+   The basic lookup function used by all operations.
+   This is based on Algorithm D from Knuth Vol. 3, Sec. 6.4.
+   Open addressing is preferred over chaining since the link overhead for
+   chaining would be substantial (100% with typical malloc overhead).
+
+   The initial probe index is computed as hash mod the table size. Subsequent
+   probe indices are computed as explained earlier.
+
+   All arithmetic on hash should ignore overflow.
+
+   (The details in this version are due to Tim Peters, building on many past
+   contributions by Reimer Behrends, Jyrki Alakuijala, Vladimir Marangozov and
+   Christian Tismer).
+
+   lookdict() is general-purpose, and may return NULL if (and only if) a
+   comparison raises an exception (this was new in Python 2.5).
+   lookdict_string() below is specialized to string keys, comparison of which can
+   never raise an exception; that function can never return NULL.  For both, when
+   the key isn't found a PyDictEntry* is returned for which the me_value field is
+   NULL; this is the slot in the dict at which the key would have been found, and
+   the caller can (if it wishes) add the <key, value> pair to the returned
+   PyDictEntry*.
+   */
+
+    static OptDictEntry *
+lookdict_in(OptDict *mp, OptDictEntry *ep0, register size_t mask, void *key,
+            register long hash)
+{
+    register size_t i;
+    register size_t perturb;
+    register OptDictEntry *freeslot;
+    register OptDictEntry *ep;
+
+    i = hash & mask;
+    ep = &ep0[i];
+    if (ep->me_key == NULL || ep->me_key == key)
+        return ep;
+    if (ep->me_key == dummy)
+        freeslot = ep;
+    else {
+        if (ep->me_hash == hash && mp->eqfunc(ep->me_key, key, mp->ma_keysize))
+            return ep;
+        freeslot = NULL;
+    }
+
+    /* In the loop, me_key == dummy is by far (factor of 100s) the
+       least likely outcome, so test for that last. */
+    for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
+        i = (i << 2) + i + perturb + 1;
+        ep = &ep0[i & mask];
+        if (ep->me_key == NULL)
+            return freeslot == NULL ? ep : freeslot;
+        if (ep->me_key == key
+                || (ep->me_hash == hash
+                    && ep->me_key != dummy
+                    && mp->eqfunc(ep->me_key, key, mp->ma_keysize)))
+            return ep;
+        if (ep->me_key == dummy && freeslot == NULL)
+            freeslot = ep;
+    }
+    assert(0);          /* NOT REACHED */
+    return 0;
+}
+
+    static OptDictEntry *
+lookdict(OptDict *mp, void *key, register long hash)
+{
+    return lookdict_in(mp, mp->ma_table, mp->ma_mask, key, hash);
+}
+
+/*
+   Small dicts.  A new dict keeps its entries in ma_smalltable, packed densely
+   in insertion order -- all eight cells can be used, and there are never any
+   dummies -- until the first resize turns it into an ordinary hashed table.
+   dictnotes.txt ("Optimizing the Search of Small Dictionaries") suggests
+   exactly this: a linear search of contiguous entries is guaranteed to
+   terminate rapidly, never looks at the same entry twice, and needn't test
+   for dummies.
+
+   Rather than walk the entries, lookdict_small() compares the low 32 bits of
+   the hash against all of ma_smalltags at once (two SSE2 compares for eight
+   tags) and only looks at the entries whose tags match.
+
+   On a miss it returns the next free cell, ma_smalltable[ma_used], having
+   already stored the tag there, so a caller that fills the cell needn't know
+   about tags.  If all cells are in use it returns small_full, an unused entry
+   that must never be written: the insertion paths (insertdict() and
+   OptDict_SetDefault()) check for a full small table and resize before
+   inserting.
+   */
+
+static OptDictEntry small_full;
+
+#if defined(__GNUC__)
+#define LOWEST_BIT_INDEX(x) ((size_t)__builtin_ctz(x))
+#else
+    static size_t
+LOWEST_BIT_INDEX(unsigned int x)
+{
+    size_t i = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        i++;
+    }
+    return i;
+}
+#endif
+
+    static OptDictEntry *
+lookdict_small(OptDict *mp, void *key, register long hash)
+{
+    register unsigned int match;
+    register OptDictEntry *ep;
+    size_t i, n = mp->ma_used;
+    int tag = (int)hash;
+
+    assert(mp->ma_small && mp->ma_fill == n);
+#ifdef __SSE2__
+    {
+        __m128i t = _mm_set1_epi32(tag);
+        match = 0;
+        for (i = 0; i < optdict_MINSIZE; i += 4) {
+            __m128i eq = _mm_cmpeq_epi32(
+                _mm_loadu_si128((__m128i *)&mp->ma_smalltags[i]), t);
+            match |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+        }
+    }
+#else
+    match = 0;
+    for (i = 0; i < optdict_MINSIZE; i++)
+        match |= (unsigned int)(mp->ma_smalltags[i] == tag) << i;
+#endif
+    match &= (1u << n) - 1;
+    while (match) {
+        ep = &mp->ma_smalltable[LOWEST_BIT_INDEX(match)];
+        if (ep->me_hash == hash
+                && (ep->me_key == key || mp->eqfunc(ep->me_key, key, mp->ma_keysize)))
+            return ep;
+        match &= match - 1;
+    }
+    if (n == optdict_MINSIZE)
+        return &small_full;
+    mp->ma_smalltags[n] = tag;
+    return &mp->ma_smalltable[n];
+}
+
+/* Install a new table lookup function, underneath the lookup cache if it's
+ * on.
+ */
+    static void
+set_lookup(OptDict *mp,
+           OptDictEntry *(*lookup)(OptDict *mp, void *key, long hash))
+{
+    if (mp->ma_ncache > 0)
+        mp->ma_uncachedlookup = lookup;
+    else
+        mp->ma_lookup = lookup;
+}
+
+/*
+   Lookup cache.  The simplest incarnation of "Caching Lookups" in
+   dictnotes.txt: remember the entries most recently found, and check them
+   before probing the table.  That pays off when a key is looked up several
+   times in a row -- a __contains__ followed by a get, set or del, or the
+   get-then-set of counting -- and especially when its probe chain is long.
+
+   ma_cache holds ma_ncache entry pointers, replaced round-robin.  A cached
+   entry is only trusted if it's still active and its key is equal to the one
+   we're looking for, so an entry whose key was deleted or replaced can never
+   produce a wrong answer; even so, deletions drop the entry from the cache and
+   dictresize() empties it, since resizing frees the table the pointers point
+   into.
+   */
+    static OptDictEntry *
+lookdict_cached(OptDict *mp, void *key, register long hash)
+{
+    register size_t i;
+    register OptDictEntry *ep;
+
+    for (i = 0; i < mp->ma_ncache; i++) {
+        ep = mp->ma_cache[i];
+        if (ep != NULL && ep->me_hash == hash && ACTIVE_ENTRY(ep)
+                && (ep->me_key == key || mp->eqfunc(ep->me_key, key, mp->ma_keysize))) {
+            mp->ma_cachehits++;
+            return ep;
+        }
+    }
+    mp->ma_cachemisses++;
+    ep = mp->ma_uncachedlookup(mp, key, hash);
+    if (ep != NULL && ACTIVE_ENTRY(ep)) {
+        mp->ma_cache[mp->ma_cachenext] = ep;
+        if (++mp->ma_cachenext == mp->ma_ncache)
+            mp->ma_cachenext = 0;
+    }
+    return ep;
+}
+
+    static void
+clear_cache(OptDict *mp)
+{
+    size_t i;
+
+    for (i = 0; i < mp->ma_ncache; i++)
+        mp->ma_cache[i] = NULL;
+    mp->ma_cachenext = 0;
+}
+
+    static void
+uncache_entry(OptDict *mp, OptDictEntry *ep)
+{
+    size_t i;
+
+    for (i = 0; i < mp->ma_ncache; i++)
+        if (mp->ma_cache[i] == ep)
+            mp->ma_cache[i] = NULL;
+}
+
+/* Turn the lookup cache on with nways entries (at most optdict_CACHESIZE),
+ * or off if nways is 0.  Resets the hit and miss counts.
+ */
+    int
+OptDict_EnableCache(OptDict *mp, size_t nways)
+{
+    if (nways > optdict_CACHESIZE)
+        return -1;
+    if (mp->ma_ncache == 0 && nways > 0) {
+        mp->ma_uncachedlookup = mp->ma_lookup;
+        mp->ma_lookup = lookdict_cached;
+    }
+    else if (mp->ma_ncache > 0 && nways == 0) {
+        mp->ma_lookup = mp->ma_uncachedlookup;
+    }
+    mp->ma_ncache = nways;
+    clear_cache(mp);
+    mp->ma_cachehits = mp->ma_cachemisses = 0;
+    return 0;
+}
+
+    void
+OptDict_CacheStats(OptDict *mp, size_t *hits, size_t *misses)
+{
+    *hits = mp->ma_cachehits;
+    *misses = mp->ma_cachemisses;
+}
+
+/*
+   Negative-lookup filter.  When most lookups miss, each miss walks its
+   probe chain to an unused slot, over cold memory.  OptDict_EnableFilter()
+   keeps a blocked Bloom filter of the keys' hash codes, and the lookups that
+   can fail -- OptDict_GetItem(), OptDict_GetMany() and OptDict_Pop() --
+   check it before the table: a key with any of its bits clear is certainly
+   absent, at the cost of one cache line.  A key sets one bit in each of the
+   8 words of one BLOOM_BLOCK-byte block, chosen from its hash code
+   (remixed first, as int_hash() is the identity) and 8 odd multipliers, as
+   in Parquet's split block Bloom filter.
+
+   The filter is built with room for BLOOM_BITS_PER_KEY bits for each of
+   twice the keys there are, which keeps false positives well under 1% until
+   it fills up.  A Bloom filter can't forget a key, so deleted keys stay in;
+   once as many keys have gone in as it was built for, it's rebuilt from the
+   table, which both grows it and clears out the deleted keys.
+   OptDict_Freeze() rebuilds it for exactly the keys there are, since no
+   more can come.  A filter that can't be rebuilt for lack of memory stays
+   as it was: it still passes every key in the dict, just less selectively.
+   */
+
+#define BLOOM_BLOCK 64
+#define BLOOM_BITS_PER_KEY 16
+#define BLOOM_MIX(hash)                                                   \
+    ((uint64_t)(unsigned long)(hash) * 0x9e3779b97f4a7c15ULL)
+
+static const uint32_t bloom_salt[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+    static void
+bloom_add(OptDict *mp, long hash)
+{
+    uint64_t x = BLOOM_MIX(hash);
+    uint64_t *block = mp->ma_filter
+                      + (size_t)(x >> 32 & mp->ma_filtermask) * 8;
+    uint32_t h = (uint32_t)x;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        block[i] |= (uint64_t)1 << ((h * bloom_salt[i]) >> 26);
+}
+
+/* Whether a key with this hash code may be in the dict. */
+    static int
+bloom_check(OptDict *mp, long hash)
+{
+    uint64_t x = BLOOM_MIX(hash);
+    const uint64_t *block = mp->ma_filter
+                            + (size_t)(x >> 32 & mp->ma_filtermask) * 8;
+    uint32_t h = (uint32_t)x;
+    uint64_t missing = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        missing |= ~block[i] & ((uint64_t)1 << ((h * bloom_salt[i]) >> 26));
+    return missing == 0;
+}
+
+/* Whether the filter rules out key (hash) without a lookup. */
+#define BLOOM_MISS(mp, hash)                                              \
+    ((mp)->ma_filter != NULL && !bloom_check((mp), (hash)))
+
+/* Replace the filter with one with room for nkeys keys, holding the keys
+ * there are now.  Returns 0 or ERR_NO_MEM, leaving the old one in place.
+ */
+    static int
+bloom_build(OptDict *mp, size_t nkeys)
+{
+    size_t nblocks = 1, i;
+    void *mem;
+    OptDictEntry *ep;
+
+    while (nblocks * BLOOM_BLOCK * 8 < nkeys * BLOOM_BITS_PER_KEY)
+        nblocks <<= 1;
+    /* One block more, to align the filter to a cache line. */
+    mem = dict_calloc(mp, nblocks + 1, BLOOM_BLOCK);
+    if (mem == NULL)
+        return ERR_NO_MEM;
+    bloom_free(mp);
+    mp->ma_filtermem = mem;
+    mp->ma_filter = (uint64_t *)(((uintptr_t)mem + BLOOM_BLOCK - 1)
+                                 & ~(uintptr_t)(BLOOM_BLOCK - 1));
+    mp->ma_filtermask = nblocks - 1;
+    mp->ma_filtercap = nblocks * BLOOM_BLOCK * 8 / BLOOM_BITS_PER_KEY;
+    for (i = 0, ep = mp->ma_table; i <= mp->ma_mask; i++, ep++)
+        if (ACTIVE_ENTRY(ep))
+            bloom_add(mp, ep->me_hash);
+    if (mp->ma_oldtable != NULL)
+        for (i = 0, ep = mp->ma_oldtable; i <= mp->ma_oldmask; i++, ep++)
+            if (ACTIVE_ENTRY(ep))
+                bloom_add(mp, ep->me_hash);
+    mp->ma_filterkeys = mp->ma_used;
+    return 0;
+}
+
+    static void
+bloom_free(OptDict *mp)
+{
+    if (mp->ma_filtermem != NULL)
+        dict_free(mp, mp->ma_filtermem,
+                  (mp->ma_filtermask + 2) * BLOOM_BLOCK);
+    mp->ma_filter = NULL;
+    mp->ma_filtermem = NULL;
+    mp->ma_filtermask = mp->ma_filterkeys = mp->ma_filtercap = 0;
+}
+
+/* Add a new key's hash code, rebuilding the filter once it's full. */
+    static void
+bloom_insert(OptDict *mp, long hash)
+{
+    bloom_add(mp, hash);
+    if (++mp->ma_filterkeys > mp->ma_filtercap)
+        bloom_build(mp, 2 * mp->ma_used);
+}
+
+/* Turn the lookup filter on or off.  Returns 0, or ERR_NO_MEM (and leaves
+ * it off) if it can't be built.
+ */
+    int
+OptDict_EnableFilter(OptDict *mp, int enable)
+{
+    if (!enable) {
+        bloom_free(mp);
+        return 0;
+    }
+    if (mp->ma_filter != NULL)
+        return 0;
+    return bloom_build(mp, 2 * mp->ma_used);
+}
+
+/* Give np, a copy of mp, a filter of its own. */
+    static int
+copy_bloom(OptDict *np, OptDict *mp)
+{
+    size_t size = (mp->ma_filtermask + 1) * BLOOM_BLOCK;
+
+    np->ma_filter = NULL;
+    np->ma_filtermem = NULL;
+    if (mp->ma_filter == NULL)
+        return 0;
+    np->ma_filtermem = dict_alloc(np, size + BLOOM_BLOCK);
+    if (np->ma_filtermem == NULL)
+        return ERR_NO_MEM;
+    np->ma_filter = (uint64_t *)(((uintptr_t)np->ma_filtermem
+                                  + BLOOM_BLOCK - 1)
+                                 & ~(uintptr_t)(BLOOM_BLOCK - 1));
+    memcpy(np->ma_filter, mp->ma_filter, size);
+    return 0;
+}
+
+/* #ifdef SHOW_TRACK_COUNT */
+/* #define INCREASE_TRACK_COUNT \ */
+    /* (count_tracked++, count_untracked--); */
+/* #define DECREASE_TRACK_COUNT \ */
+    /* (count_tracked--, count_untracked++); */
+/* #else */
+/* #define INCREASE_TRACK_COUNT */
+/* #define DECREASE_TRACK_COUNT */
+/* #endif */
+
+/* #define MAINTAIN_TRACKING(mp, key, value) \ */
+    /* do { \ */
+        /* if (!_PyObject_GC_IS_TRACKED(mp)) { \ */
+            /* if (_PyObject_GC_MAY_BE_TRACKED(key) || \ */
+                    /* _PyObject_GC_MAY_BE_TRACKED(value)) { \ */
+                /* _PyObject_GC_TRACK(mp); \ */
+                /* INCREASE_TRACK_COUNT \ */
+            /* } \ */
+        /* } \ */
+    /* } while(0) */
+
+    /* void */
+/* _PyDict_MaybeUntrack(PyObject *op) */
+/* { */
+    /* OptDict *mp; */
+    /* PyObject *value; */
+    /* Py_ssize_t mask, i; */
+    /* PyDictEntry *ep; */
+
+    /* if (!PyDict_CheckExact(op) || !_PyObject_GC_IS_TRACKED(op)) */
+        /* return; */
+
+    /* mp = (OptDict *) op; */
+    /* ep = mp->ma_table; */
+    /* mask = mp->ma_mask; */
+    /* for (i = 0; i <= mask; i++) { */
+        /* if ((value = ep[i].me_value) == NULL) */
+            /* continue; */
+        /* if (_PyObject_GC_MAY_BE_TRACKED(value) || */
+                /* _PyObject_GC_MAY_BE_TRACKED(ep[i].me_key)) */
+            /* return; */
+    /* } */
+    /* DECREASE_TRACK_COUNT */
+        /* _PyObject_GC_UNTRACK(op); */
+/* } */
+
+
+/*
+   Internal routine to insert a new item into the table.
+   Used by the public insert routines.  A new key is copied into the dict's
+   key storage; the value (ma_valsize bytes at value) is copied to where the
+   dict keeps values (see VALUE_OF()).
+   Returns -1 if an error occurred, or 0 on success.
+   */
+    static int
+insertdict(register OptDict *mp, void *key, long hash, void *value)
+{
+    register OptDictEntry *ep;
+
+    assert(mp->ma_lookup != NULL);
+    if (UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+    ep = mp->ma_lookup(mp, key, hash);
+    if (ep == NULL) {
+        return -1;
+    }
+    if (!ACTIVE_ENTRY(ep) && mp->ma_frozen)
+        return ERR_FROZEN;
+    if (ep == &small_full) {
+        if (dictresize(mp, 4 * (mp->ma_used + 1)) != 0)
+            return ERR_NO_MEM;
+        ep = mp->ma_lookup(mp, key, hash);
+        if (ep == NULL)
+            return -1;
+    }
+
+    if (ACTIVE_ENTRY(ep)) {
+        memcpy(VALUE_OF(mp, ep), value, mp->ma_valsize);
+    }
+    else {
+        if (fill_entry(mp, ep, key, hash, value) != 0)
+            return ERR_NO_MEM;
+        if (mp->ma_oldtable != NULL)
+            migrate(mp, mp->ma_resizestep);
+    }
+    return 0;
+}
+
+/* Internal routine used by dictresize() to insert an item which is known to be
+ * absent from the dict.  This routine also assumes that the dict contains no
+ * deleted entries.  Besides the performance benefit, using insertdict() in
+ * dictresize() is dangerous (SF bug #1456209).  `key` must already be in the
+ * dict's key storage; it is not copied again.
+ */
+    static void
+insertdict_clean(register OptDict *mp, void *key, long hash,
+        OptDictValue value)
+{
+    register size_t i;
+    register size_t perturb;
     register size_t mask = (size_t)mp->ma_mask;
     OptDictEntry *ep0 = mp->ma_table;
     register OptDictEntry *ep;
 
-    /* MAINTAIN_TRACKING(mp, key, value); */
-    i = hash & mask;
-    ep = &ep0[i];
-    for (perturb = hash; ep->me_key != NULL; perturb >>= PERTURB_SHIFT) {
-        i = (i << 2) + i + perturb + 1;
-        ep = &ep0[i & mask];
+    /* MAINTAIN_TRACKING(mp, key, value); */
+    i = hash & mask;
+    ep = &ep0[i];
+    for (perturb = hash; ep->me_key != NULL; perturb >>= PERTURB_SHIFT) {
+        i = (i << 2) + i + perturb + 1;
+        ep = &ep0[i & mask];
+    }
+    mp->ma_fill++;
+    ep->me_key = key;
+    ep->me_hash = hash;
+    ep->me_value = value;
+    mark_entry(mp, ep, 1);
+    mp->ma_used++;
+}
+
+/*
+   Table memory.  Tables are zero-filled, and most of the cost of a big one
+   is the TLB misses of probing it, one per lookup once it's much bigger than
+   the TLB reach of 4 KB pages.  OptDict_SetTableAlloc() lets tables of at
+   least TABLE_MAP_THRESHOLD bytes come from fresh anonymous mappings
+   instead of calloc() (the kernel zero-fills pages as they're first
+   touched, so there's no memset), backed by huge pages -- reserved ones
+   with MAP_HUGETLB, falling back to transparent ones via madvise() -- and
+   placed on NUMA nodes with mbind() before any page is touched.  Mappings
+   are rounded up to a whole number of huge pages.  The NUMA and huge page
+   options are best effort: if the kernel says no, the table is still
+   allocated, just on ordinary pages or wherever first touch puts it.
+   */
+
+#define TABLE_MAP_THRESHOLD ((size_t)1 << 21)
+#define TABLE_MAP_LENGTH(nbytes) \
+    (((nbytes) + TABLE_MAP_THRESHOLD - 1) & ~(TABLE_MAP_THRESHOLD - 1))
+
+#ifdef HAVE_MBIND
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+#define NUMA_MAXNODE 1024
+#endif
+
+/* Allocate nslots zeroed entries; *mapped tells table_free() how. */
+    static OptDictEntry *
+table_alloc(OptDict *mp, size_t nslots, int *mapped)
+{
+    *mapped = 0;
+#ifdef HAVE_MMAP
+    if (mp->ma_tableflags != 0
+            && nslots <= (size_t)-1 / sizeof(OptDictEntry)
+            && nslots * sizeof(OptDictEntry) >= TABLE_MAP_THRESHOLD) {
+        size_t length = TABLE_MAP_LENGTH(nslots * sizeof(OptDictEntry));
+        void *p = MAP_FAILED;
+        int flags = mp->ma_tableflags;
+
+#ifdef MAP_HUGETLB
+        if (flags & OPTDICT_TABLE_HUGETLB)
+            p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+            p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                return NULL;
+#ifdef MADV_HUGEPAGE
+            if (flags & (OPTDICT_TABLE_THP | OPTDICT_TABLE_HUGETLB))
+                madvise(p, length, MADV_HUGEPAGE);
+#endif
+        }
+#ifdef HAVE_MBIND
+        if (flags & (OPTDICT_TABLE_INTERLEAVE | OPTDICT_TABLE_BIND)) {
+            unsigned long nodemask[NUMA_MAXNODE / (8 * sizeof(long))];
+            int mode;
+
+            if (flags & OPTDICT_TABLE_BIND) {
+                memset(nodemask, 0, sizeof(nodemask));
+                nodemask[mp->ma_numanode / (8 * sizeof(long))] =
+                    1UL << (mp->ma_numanode % (8 * sizeof(long)));
+                mode = MPOL_BIND;
+            }
+            else {
+                /* All nodes; the kernel ignores those we can't use. */
+                memset(nodemask, 0xff, sizeof(nodemask));
+                mode = MPOL_INTERLEAVE;
+            }
+            syscall(SYS_mbind, p, length, mode, nodemask,
+                    (unsigned long)NUMA_MAXNODE, 0U);
+        }
+#endif
+        *mapped = 1;
+        return p;
+    }
+#endif
+    return dict_calloc(mp, nslots, sizeof(OptDictEntry));
+}
+
+    static void
+table_free(OptDict *mp, OptDictEntry *table, size_t nslots, int mapped)
+{
+#ifdef HAVE_MMAP
+    if (mapped) {
+        munmap(table, TABLE_MAP_LENGTH(nslots * sizeof(OptDictEntry)));
+        return;
+    }
+#endif
+    dict_free(mp, table, nslots * sizeof(OptDictEntry));
+}
+
+/* Choose how tables allocated from now on get their memory: flags is 0 for
+ * plain calloc(), or OPTDICT_TABLE_MMAP, optionally with any of the other
+ * OPTDICT_TABLE_* options, which imply it.  node is the NUMA node for
+ * OPTDICT_TABLE_BIND.  Returns -1 if an option isn't available here.
+ */
+    int
+OptDict_SetTableAlloc(OptDict *mp, int flags, int node)
+{
+    if (flags & ~(OPTDICT_TABLE_MMAP | OPTDICT_TABLE_HUGETLB
+                  | OPTDICT_TABLE_THP | OPTDICT_TABLE_INTERLEAVE
+                  | OPTDICT_TABLE_BIND))
+        return -1;
+#ifndef HAVE_MMAP
+    if (flags != 0)
+        return -1;
+#endif
+#ifdef HAVE_MBIND
+    if ((flags & OPTDICT_TABLE_BIND)
+            && (node < 0 || node >= NUMA_MAXNODE
+                || (flags & OPTDICT_TABLE_INTERLEAVE)))
+        return -1;
+#else
+    if (flags & (OPTDICT_TABLE_INTERLEAVE | OPTDICT_TABLE_BIND))
+        return -1;
+#endif
+    mp->ma_tableflags = flags;
+    mp->ma_numanode = node;
+    return 0;
+}
+
+/* Restructure the table by allocating a new table and reinserting all items
+ * again.  When entries have been deleted, the new table may actually be
+ * smaller than the old one.  
+ */
+    static int
+dictresize(OptDict *mp, size_t minused)
+{
+    size_t newsize, oldsize;
+    OptDictEntry *oldtable, *newtable, *ep;
+    size_t i;
+    int is_oldtable_malloced, oldmapped, newmapped = 0;
+    OptDictEntry small_copy[optdict_MINSIZE];
+    uint64_t *occupied;
+
+    assert(minused >= 0);
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+    if (UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+
+    /* Find the smallest table size > minused. */
+    for (newsize = optdict_MINSIZE;
+            newsize <= minused && newsize > 0;
+            newsize <<= 1)
+        ;
+    if (newsize <= 0) {
+        return ERR_NO_MEM;
+    }
+
+    /* Get space for a new table. */
+    oldtable = mp->ma_table;
+    oldsize = mp->ma_mask + 1;
+    oldmapped = mp->ma_tablemapped;
+    assert(oldtable != NULL);
+    is_oldtable_malloced = oldtable != mp->ma_smalltable;
+
+    if (newsize == optdict_MINSIZE) {
+        /* A large table is shrinking, or we can't get any smaller. */
+        newtable = mp->ma_smalltable;
+        if (newtable == oldtable) {
+            if (mp->ma_fill == mp->ma_used) {
+                /* No dummies, so no point doing anything. */
+                return 0;
+            }
+            /* We're not going to resize it, but rebuild the table anyway to
+             * purge old dummy entries.  
+             * Subtle:  This is *necessary* if fill==size, as lookdict needs at
+             * least one virgin slot to terminate failing searches.  If fill <
+             * size, it's merely desirable, as dummies slow searches.
+             */
+            assert(mp->ma_fill > mp->ma_used);
+            memcpy(small_copy, oldtable, sizeof(small_copy));
+            oldtable = small_copy;
+        }
+        memset(newtable, 0, sizeof(OptDictEntry) * newsize);
+    }
+    else {
+        newtable = table_alloc(mp, newsize, &newmapped);
+        if (newtable == NULL) {
+            return ERR_NO_MEM;
+        }
+    }
+    occupied = dict_calloc(mp, OCCUPIED_WORDS(newsize), sizeof(uint64_t));
+    if (occupied == NULL) {
+        if (newtable != mp->ma_smalltable)
+            table_free(mp, newtable, newsize, newmapped);
+        return ERR_NO_MEM;
+    }
+
+    /* Make the dict empty, using the new table. */
+    assert(newtable != oldtable);
+    clear_cache(mp);
+    dict_free(mp, mp->ma_occupied, OCCUPIED_WORDS(oldsize) * sizeof(uint64_t));
+    mp->ma_occupied = occupied;
+    if (mp->ma_small) {
+        mp->ma_small = 0;
+        set_lookup(mp, lookdict);
+    }
+    mp->ma_table = newtable;
+    mp->ma_mask = newsize - 1;
+    mp->ma_tablemapped = newmapped;
+    mp->ma_used = 0;
+    i = mp->ma_fill;
+    mp->ma_fill = 0;
+
+    /* Copy the data over; keys stay where they are in key storage;
+       dummy entries aren't copied over, of course */
+    for (ep = oldtable; i > 0; ep++) {
+        if (ACTIVE_ENTRY(ep)) {                 /* active entry */
+            --i;
+            insertdict_clean(mp, ep->me_key, ep->me_hash,
+                    ep->me_value);
+        }
+        else if (ep->me_key != NULL) {          /* dummy entry */
+            --i;
+            assert(ep->me_key == dummy);
+        }
+        /* else key == value == NULL:  nothing to do */
+    }
+
+    if (is_oldtable_malloced)
+        table_free(mp, oldtable, oldsize, oldmapped);
+    return 0;
+}
+
+/*
+   Incremental resizing.  dictresize() rehashes the whole table at once, so
+   the insert that triggers it takes time proportional to the size of the
+   dict; with a resize step set (OptDict_SetResizeStep()), growing a table
+   instead allocates the new one and leaves the entries in the old one,
+   ma_oldtable, and every insertion of a new key afterwards moves the
+   entries of the next ma_resizestep old slots across.  Meanwhile
+   lookdict_migrating() looks in the new table and then in the old one, and
+   new keys always go into the new table.  Moved entries leave dummies
+   behind, so the probe chains through the old table stay intact.
+
+   The new table is at least twice as big as the old one, and the old one
+   was two-thirds full, so with a step of 2 or more the old table is empty
+   before the new one needs to grow.  If it isn't, the migration is finished
+   on the spot before the next resize starts; so is it before anything that
+   works on the whole table (dictresize(), hence freezing and compacting).
+
+   Lookups don't migrate anything, so that a pointer to a value stays valid
+   until the next insertion or deletion, as usual.
+   */
+    static OptDictEntry *
+lookdict_migrating(OptDict *mp, void *key, register long hash)
+{
+    register OptDictEntry *ep, *oldep;
+
+    ep = lookdict_in(mp, mp->ma_table, mp->ma_mask, key, hash);
+    if (ACTIVE_ENTRY(ep))
+        return ep;
+    oldep = lookdict_in(mp, mp->ma_oldtable, mp->ma_oldmask, key, hash);
+    if (ACTIVE_ENTRY(oldep))
+        return oldep;
+    return ep;
+}
+
+/* Move the active entries of the next n old slots (all of them if n is 0)
+ * to the new table, and end the migration if that was the last of them.
+ */
+    static void
+migrate(OptDict *mp, size_t n)
+{
+    register OptDictEntry *ep;
+    size_t end, oldsize = mp->ma_oldmask + 1;
+
+    assert(mp->ma_oldtable != NULL);
+    end = n == 0 || n > oldsize - mp->ma_migrated ? oldsize
+                                                  : mp->ma_migrated + n;
+    for (ep = &mp->ma_oldtable[mp->ma_migrated]; mp->ma_migrated < end;
+            mp->ma_migrated++, ep++) {
+        if (ACTIVE_ENTRY(ep)) {
+            insertdict_clean(mp, ep->me_key, ep->me_hash, ep->me_value);
+            mp->ma_used--;      /* it was already counted */
+            ep->me_key = dummy;
+        }
+    }
+    if (mp->ma_migrated < oldsize)
+        return;
+    clear_cache(mp);
+    if (mp->ma_oldtable != mp->ma_smalltable)
+        table_free(mp, mp->ma_oldtable, oldsize, mp->ma_oldtablemapped);
+    mp->ma_oldtable = NULL;
+    set_lookup(mp, lookdict);
+}
+
+/* Grow the table to hold minused entries: with dictresize(), or by starting
+ * an incremental resize if that's on and the table isn't tiny.
+ */
+    static int
+growtable(OptDict *mp, size_t minused)
+{
+    size_t newsize;
+    OptDictEntry *newtable;
+    uint64_t *occupied;
+    int mapped;
+
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+    if (mp->ma_resizestep == 0 || mp->ma_small)
+        return dictresize(mp, minused);
+    if (UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+    for (newsize = optdict_MINSIZE;
+            newsize <= minused && newsize > 0;
+            newsize <<= 1)
+        ;
+    if (newsize <= optdict_MINSIZE)
+        return dictresize(mp, minused);
+    newtable = table_alloc(mp, newsize, &mapped);
+    if (newtable == NULL)
+        return ERR_NO_MEM;
+    occupied = dict_calloc(mp, OCCUPIED_WORDS(newsize), sizeof(uint64_t));
+    if (occupied == NULL) {
+        table_free(mp, newtable, newsize, mapped);
+        return ERR_NO_MEM;
+    }
+    dict_free(mp, mp->ma_occupied,
+              OCCUPIED_WORDS(mp->ma_mask + 1) * sizeof(uint64_t));
+    mp->ma_occupied = occupied;
+    mp->ma_oldtable = mp->ma_table;
+    mp->ma_oldmask = mp->ma_mask;
+    mp->ma_oldtablemapped = mp->ma_tablemapped;
+    mp->ma_migrated = 0;
+    mp->ma_table = newtable;
+    mp->ma_mask = newsize - 1;
+    mp->ma_tablemapped = mapped;
+    mp->ma_fill = 0;
+    set_lookup(mp, lookdict_migrating);
+    return 0;
+}
+
+/* Make resizes incremental, moving step entries per insertion, or all at
+ * once if step is 0 (the default).  Turning it off finishes a resize in
+ * progress.
+ */
+    void
+OptDict_SetResizeStep(OptDict *mp, size_t step)
+{
+    mp->ma_resizestep = step;
+    if (step == 0 && mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+}
+
+/* Finish an incremental resize, if one is in progress. */
+    void
+OptDict_FinishResize(OptDict *mp)
+{
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+}
+
+/* Grow the table, if need be, so that n more keys can be added without a
+   resize.  Like CPython's _PyDict_NewPresized(), this is for a caller that
+   knows roughly how many keys are coming: underestimates are okay because
+   the dictionary will resize as necessary, and overestimates just mean the
+   dictionary will be more sparse than usual.  A resize in progress is
+   finished.  Returns 0, ERR_FROZEN, or ERR_NO_MEM.
+   */
+    int
+OptDict_Reserve(OptDict *mp, size_t n)
+{
+    if (mp->ma_frozen)
+        return ERR_FROZEN;
+    if (n == 0 || !(mp->ma_small ? mp->ma_used + n > optdict_MINSIZE
+                                 : (mp->ma_fill + n)*3 >= (mp->ma_mask+1)*2
+                                   || mp->ma_oldtable != NULL))
+        return 0;
+    if (n > ((size_t)-1 / 3 - mp->ma_used) / 2)
+        return ERR_NO_MEM;
+    return dictresize(mp, (mp->ma_used + n) * 3 / 2) != 0 ? ERR_NO_MEM : 0;
+}
+
+/* Return a pointer to key's value in the table, or NULL if key isn't in the
+ * dict.  As with OptDict_SetDefault(), the pointer stays valid until the
+ * next insertion or deletion.
+ */
+    void *
+OptDict_GetItem(OptDict *mp, void *key, long hash)
+{
+    OptDictEntry *ep;
+
+    if (hash == -1 || BLOOM_MISS(mp, hash))
+        return NULL;
+    ep = (mp->ma_lookup)(mp, key, hash);
+    if (ep == NULL || !ACTIVE_ENTRY(ep))
+        return NULL;
+    return VALUE_OF(mp, ep);
+}
+
+/* CAUTION: OptDict_SetItem() must guarantee that it won't resize the
+ * dictionary if it's merely replacing the value for an existing key.  This
+ * means that it's safe to loop over a dictionary with OptDict_Next() and
+ * occasionally replace a value -- but you can't insert new keys or remove
+ * them.
+ */
+    int
+OptDict_SetItem(register OptDict *mp, void *key, register long hash, void *value)
+{
+    register size_t n_used;
+    int err;
+
+    assert(key);
+    assert(value);
+    if (hash == -1)
+        return -1;
+    /* at least one empty slot, unless it is a small or perfect table */
+    assert(mp->ma_small || mp->ma_pilots != NULL || mp->ma_fill <= mp->ma_mask);
+    n_used = mp->ma_used;
+    if ((err = insertdict(mp, key, hash, value)) != 0)
+        return err;
+    /* If we added a key, we can safely resize.  Otherwise just return!
+     * If fill >= 2/3 size, adjust size.  Normally, this doubles or
+     * quaduples the size, but it's also possible for the dict to shrink
+     * (if ma_fill is much larger than ma_used, meaning a lot of dict
+     * keys have been deleted).
+     *
+     * Quadrupling the size improves average dictionary sparseness
+     * (reducing collisions) at the cost of some memory and iteration
+     * speed (which loops over every possible entry).  It also halves
+     * the number of expensive resize operations in a growing dictionary.
+     *
+     * Very large dictionaries (over 50K items) use doubling instead.
+     * This may help applications with severe memory constraints.
+     */
+    if (mp->ma_small
+            || !(mp->ma_used > n_used && mp->ma_fill*3 >= (mp->ma_mask+1)*2))
+        return 0;
+    return growtable(mp, (mp->ma_used > 50000 ? 2 : 4) * mp->ma_used);
+}
+
+/* Find key's value, adding key with a copy of *defaultvalue first if it's
+ * missing, and return a pointer to the value in the table.  The pointer can
+ * be used to read or update the value in place, and stays valid until the
+ * next insertion or deletion.  If inserted isn't NULL, *inserted is set to 1
+ * if key was added and to 0 if it was already there.  Returns NULL if out of
+ * memory, or if key is missing and the dict is frozen.
+ *
+ * This is the one-lookup form of the get-then-set patterns in dictnotes.txt
+ * (counting, setdefault(k, []).append(v)).  Unlike OptDict_SetItem() it
+ * resizes *before* adding a key, so that the returned entry is the one in
+ * the final table; that costs a second lookup only on the insertions that
+ * grow the table.
+ */
+    void *
+OptDict_SetDefault(register OptDict *mp, void *key, register long hash,
+                   void *defaultvalue, int *inserted)
+{
+    register OptDictEntry *ep;
+
+    assert(key);
+    assert(defaultvalue);
+    if (hash == -1)
+        return NULL;
+    if (UNSHARE(mp) != 0)
+        return NULL;
+    ep = mp->ma_lookup(mp, key, hash);
+    if (ep == NULL)
+        return NULL;
+    if (ACTIVE_ENTRY(ep)) {
+        if (inserted != NULL)
+            *inserted = 0;
+        return VALUE_OF(mp, ep);
     }
-    assert(ep->me_value == NULL);
-    mp->ma_fill++;
-    ep->me_key = key;
-    ep->me_hash = hash;
-    ep->me_value = value;
-    mp->ma_used++;
+    if (mp->ma_frozen)
+        return NULL;
+    /* Only filling a virgin slot can push ma_fill over the limit; reusing
+     * a dummy can't.  A small table grows only when it's full. */
+    if (ep == &small_full || (!mp->ma_small && ep->me_key == NULL
+                              && (mp->ma_fill+1)*3 >= (mp->ma_mask+1)*2)) {
+        if (growtable(mp, (mp->ma_used > 50000 ? 2 : 4) * (mp->ma_used+1)))
+            return NULL;
+        ep = mp->ma_lookup(mp, key, hash);
+        if (ep == NULL)
+            return NULL;
+        assert(!ACTIVE_ENTRY(ep));
+    }
+    if (fill_entry(mp, ep, key, hash, defaultvalue) != 0)
+        return NULL;
+    /* This only writes to unused slots of the new table, so ep stays put. */
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, mp->ma_resizestep);
+    if (inserted != NULL)
+        *inserted = 1;
+    return VALUE_OF(mp, ep);
 }
 
-/* Restructure the table by allocating a new table and reinserting all items
- * again.  When entries have been deleted, the new table may actually be
- * smaller than the old one.  
+/* In-place updates of numeric values.  Each is a single OptDict_SetDefault()
+ * lookup: the counting idiom
+ *
+ *     d[e] = d.get(e, 0) + 1
+ *
+ * becomes OptDict_Increment(d, &e, hash, 1).  A missing key is added with
+ * value 0 (Increment, AddDouble) or with x itself (Min*, Max*).  All return
+ * 0 on success, ERR_NO_MEM, ERR_FROZEN if the key would have to be added
+ * to a frozen dict, or ERR_VALUE_TYPE if the dict doesn't have the default
+ * value type.
+ */
+    int
+OptDict_Increment(OptDict *mp, void *key, long hash, long delta)
+{
+    OptDictValue zero, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    zero.v_long = 0;
+    vp = OptDict_SetDefault(mp, key, hash, &zero, NULL);
+    if (vp == NULL)
+        return SETDEFAULT_ERROR(mp);
+    vp->v_long += delta;
+    return 0;
+}
+
+    int
+OptDict_AddDouble(OptDict *mp, void *key, long hash, double delta)
+{
+    OptDictValue zero, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    zero.v_double = 0.0;
+    vp = OptDict_SetDefault(mp, key, hash, &zero, NULL);
+    if (vp == NULL)
+        return SETDEFAULT_ERROR(mp);
+    vp->v_double += delta;
+    return 0;
+}
+
+    int
+OptDict_MinLong(OptDict *mp, void *key, long hash, long x)
+{
+    OptDictValue init, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    init.v_long = x;
+    vp = OptDict_SetDefault(mp, key, hash, &init, NULL);
+    if (vp == NULL)
+        return SETDEFAULT_ERROR(mp);
+    if (x < vp->v_long)
+        vp->v_long = x;
+    return 0;
+}
+
+    int
+OptDict_MaxLong(OptDict *mp, void *key, long hash, long x)
+{
+    OptDictValue init, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    init.v_long = x;
+    vp = OptDict_SetDefault(mp, key, hash, &init, NULL);
+    if (vp == NULL)
+        return SETDEFAULT_ERROR(mp);
+    if (x > vp->v_long)
+        vp->v_long = x;
+    return 0;
+}
+
+    int
+OptDict_MinDouble(OptDict *mp, void *key, long hash, double x)
+{
+    OptDictValue init, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    init.v_double = x;
+    vp = OptDict_SetDefault(mp, key, hash, &init, NULL);
+    if (vp == NULL)
+        return SETDEFAULT_ERROR(mp);
+    if (x < vp->v_double)
+        vp->v_double = x;
+    return 0;
+}
+
+    int
+OptDict_MaxDouble(OptDict *mp, void *key, long hash, double x)
+{
+    OptDictValue init, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    init.v_double = x;
+    vp = OptDict_SetDefault(mp, key, hash, &init, NULL);
+    if (vp == NULL)
+        return SETDEFAULT_ERROR(mp);
+    if (x > vp->v_double)
+        vp->v_double = x;
+    return 0;
+}
+
+/* Count occurrences: for each of the n keys packed at `keys` (of the dict's
+ * key type), add 1 to its (long) value.  Hashing is done here, a chunk of
+ * keys at a time with OptDict_HashArray(), so a whole array is counted with
+ * one call and no per-key type checks.
+ */
+    int
+OptDict_CountArray(OptDict *mp, void *keys, size_t n)
+{
+    register char *key = keys;
+    register size_t i;
+    size_t m;
+    long hashes[HASH_CHUNK];
+    OptDictValue zero, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    zero.v_long = 0;
+    for (; n > 0; n -= m) {
+        m = n < HASH_CHUNK ? n : HASH_CHUNK;
+        OptDict_HashArray(mp, key, m, hashes);
+        for (i = 0; i < m; i++, key += mp->ma_keysize) {
+            vp = OptDict_SetDefault(mp, key, hashes[i], &zero, NULL);
+            if (vp == NULL)
+                return SETDEFAULT_ERROR(mp);
+            vp->v_long++;
+        }
+    }
+    return 0;
+}
+
+/* Prefetch slot i of table, and the bit of the occupancy bitmap that goes
+ * with it. */
+    static void
+prefetch_slot(OptDict *mp, OptDictEntry *table, size_t i)
+{
+    PREFETCH(&table[i]);
+    if (mp->ma_occupied != NULL)
+        PREFETCH(&mp->ma_occupied[i / 64]);
+}
+
+/* Insert n keys (packed at keys, of the dict's key type) with their values
+ * (packed at values, ma_valsize bytes apiece), as n calls of
+ * OptDict_SetItem() would.  The table is grown once, up front, to have room
+ * for n more keys, so it never resizes midway (if many of the keys are
+ * already present that leaves it bigger than it needs to be).  Keys are
+ * hashed a chunk at a time with OptDict_HashArray(), and while each is
+ * inserted the home slot of the key ma_prefetch places ahead is prefetched:
+ * in a table much bigger than the cache, the misses of several inserts
+ * overlap instead of each waiting its turn.  Returns 0, or the first
+ * error, with the keys before it inserted.
+ */
+    int
+OptDict_SetMany(OptDict *mp, const void *keys, const void *values, size_t n)
+{
+    const char *key = keys, *value = values;
+    long hashes[HASH_CHUNK];
+    size_t i, m, mask, dist = mp->ma_prefetch;
+    OptDictEntry *table;
+    int err;
+
+    if (n == 0)
+        return 0;
+    if (!mp->ma_frozen && OptDict_Reserve(mp, n) != 0)
+        return ERR_NO_MEM;
+    for (; n > 0; n -= m) {
+        m = n < HASH_CHUNK ? n : HASH_CHUNK;
+        OptDict_HashArray(mp, key, m, hashes);
+        table = mp->ma_table;
+        mask = mp->ma_mask;
+        for (i = 0; i < m && i < dist; i++)
+            prefetch_slot(mp, table, hashes[i] & mask);
+        for (i = 0; i < m; i++) {
+            if (i + dist < m)
+                prefetch_slot(mp, table, hashes[i + dist] & mask);
+            if ((err = insertdict(mp, (void *)key, hashes[i], (void *)value)) != 0)
+                return err;
+            key += mp->ma_keysize;
+            value += mp->ma_valsize;
+        }
+    }
+    return 0;
+}
+
+/* Set how many keys ahead OptDict_SetMany() prefetches; 0 turns it off. */
+    void
+OptDict_SetPrefetch(OptDict *mp, size_t distance)
+{
+    mp->ma_prefetch = distance;
+}
+
+/* Number the distinct keys among the n keys packed at keys (of the dict's
+ * key type), which must have OptDictValue values: store in groups[i] the
+ * v_long value of keys[i], first adding it with the value ma_used if it's
+ * missing.  Starting from an empty dict, the keys are numbered 0, 1, 2, ...
+ * in order of first appearance, and OptDict_Size() is how many there are.
+ * Probes are prefetched ma_prefetch keys ahead, as in OptDict_SetMany().
+ * Returns 0, ERR_VALUE_TYPE, ERR_FROZEN or ERR_NO_MEM.
+ */
+    int
+OptDict_Factorize(OptDict *mp, const void *keys, size_t n, long *groups)
+{
+    const char *key = keys;
+    long hashes[HASH_CHUNK];
+    size_t i, m, dist = mp->ma_prefetch;
+    OptDictValue next, *vp;
+
+    if (mp->ma_valtype != NULL)
+        return ERR_VALUE_TYPE;
+    for (; n > 0; n -= m, groups += m) {
+        m = n < HASH_CHUNK ? n : HASH_CHUNK;
+        OptDict_HashArray(mp, key, m, hashes);
+        for (i = 0; i < m && i < dist; i++)
+            prefetch_slot(mp, mp->ma_table, hashes[i] & mp->ma_mask);
+        for (i = 0; i < m; i++, key += mp->ma_keysize) {
+            if (i + dist < m)
+                prefetch_slot(mp, mp->ma_table, hashes[i + dist] & mp->ma_mask);
+            next.v_long = (long)mp->ma_used;
+            vp = OptDict_SetDefault(mp, (void *)key, hashes[i], &next, NULL);
+            if (vp == NULL)
+                return SETDEFAULT_ERROR(mp);
+            groups[i] = vp->v_long;
+        }
+    }
+    return 0;
+}
+
+/* Look up n keys packed at keys (of the dict's key type), storing a pointer
+ * to each one's value, as OptDict_GetItem() would return, or NULL, in
+ * values.  Probes are prefetched as in OptDict_SetMany().
+ */
+    void
+OptDict_GetMany(OptDict *mp, const void *keys, size_t n, void **values)
+{
+    const char *key = keys;
+    long hashes[HASH_CHUNK];
+    size_t i, m, dist = mp->ma_prefetch;
+    OptDictEntry *ep;
+
+    for (; n > 0; n -= m, values += m) {
+        m = n < HASH_CHUNK ? n : HASH_CHUNK;
+        OptDict_HashArray(mp, key, m, hashes);
+        for (i = 0; i < m && i < dist; i++)
+            prefetch_slot(mp, mp->ma_table, hashes[i] & mp->ma_mask);
+        for (i = 0; i < m; i++, key += mp->ma_keysize) {
+            if (i + dist < m)
+                prefetch_slot(mp, mp->ma_table, hashes[i + dist] & mp->ma_mask);
+            ep = hashes[i] == -1 || BLOOM_MISS(mp, hashes[i]) ? NULL
+                 : (mp->ma_lookup)(mp, (void *)key, hashes[i]);
+            values[i] = ep == NULL || !ACTIVE_ENTRY(ep) ? NULL
+                        : VALUE_OF(mp, ep);
+        }
+    }
+}
+
+/* Remove key from the dict, first copying its value to *oldvalue if oldvalue
+ * isn't NULL.  Returns 0, ERR_NO_KEY if key isn't present, or ERR_FROZEN.  The entry
+ * becomes a dummy and the key's storage is recycled; as in CPython, deleting
+ * never resizes the table.
+ */
+    int
+OptDict_Pop(OptDict *mp, void *key, long hash, void *oldvalue)
+{
+    register OptDictEntry *ep;
+
+    assert(key);
+    if (mp->ma_frozen)
+        return ERR_FROZEN;
+    if (hash == -1 || BLOOM_MISS(mp, hash))
+        return ERR_NO_KEY;
+    if (UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+    ep = (mp->ma_lookup)(mp, key, hash);
+    if (ep == NULL)
+        return -1;
+    if (!ACTIVE_ENTRY(ep))
+        return ERR_NO_KEY;
+    if (oldvalue != NULL)
+        memcpy(oldvalue, VALUE_OF(mp, ep), mp->ma_valsize);
+    uncache_entry(mp, ep);
+    if (mp->ma_vallayout == VALUES_SEPARATE)
+        store_free(&mp->ma_values, ep->me_value.v_ptr);
+    /* A key in shared storage may still be a copy's. */
+    if (mp->ma_shared == NULL)
+        store_free(&mp->ma_keys, ep->me_key);
+    if (mp->ma_small) {
+        /* Keep the small table dense: move the last entry into the hole. */
+        OptDictEntry *last = &mp->ma_smalltable[mp->ma_used - 1];
+        if (ep != last) {
+            uncache_entry(mp, last);
+            *ep = *last;
+            mp->ma_smalltags[ep - mp->ma_smalltable] =
+                mp->ma_smalltags[mp->ma_used - 1];
+        }
+        memset(last, 0, sizeof(OptDictEntry));
+        mp->ma_used--;
+        mp->ma_fill--;
+        return 0;
+    }
+    ep->me_key = dummy;
+    memset(&ep->me_value, 0, sizeof(OptDictValue));
+    mark_entry(mp, ep, 0);
+    mp->ma_used--;
+    /* Not while a resize is moving keys over: ma_fill only counts the new
+     * table's, and compacting would undo the resize in one long pause.
+     */
+    if (mp->ma_mask + 1 > optdict_MINSIZE && mp->ma_oldtable == NULL
+            && ((mp->ma_maxdummies > 0.0 && mp->ma_fill - mp->ma_used
+                     > mp->ma_maxdummies * (mp->ma_mask + 1))
+                || mp->ma_used < mp->ma_minfill * (mp->ma_mask + 1)))
+        OptDict_Compact(mp);    /* failing to shrink is harmless */
+    return 0;
+}
+
+    int
+OptDict_DelItem(OptDict *mp, void *key, long hash)
+{
+    return OptDict_Pop(mp, key, hash, NULL);
+}
+
+/*
+   Compaction.  Deleting a key leaves a dummy behind, and the table is only
+   rebuilt when an insertion happens to fill it up -- it never shrinks on
+   deletion (see "Tune-ups" in dictnotes.txt).  A table with a lot of
+   deletions, like a sliding window, ends up as big as it ever was and full of
+   dummies that lengthen every failing search.  OptDict_Compact() rebuilds the
+   table at a size suited to what's left, with no dummies, and repacks the
+   keys (and values kept apart) into fresh storage so that the blocks holding
+   deleted ones can be freed as well.  OptDict_SetShrinkPolicy() makes deletions do it by
+   themselves.
+   */
+
+/* Move every item of st (the keys, or separately stored values) to new
+ * storage sized for ma_used items and free the old blocks.  The item of
+ * active entry ep is the pointer at byte `field` of ep.  If memory runs out
+ * halfway, the old blocks are kept, along with the items that haven't moved,
+ * and ERR_NO_MEM is returned.
  */
     static int
-dictresize(OptDict *mp, size_t minused)
+repack_store(OptDict *mp, OptDictStore *st, size_t field)
 {
-    size_t newsize;
-    OptDictEntry *oldtable, *newtable, *ep;
+    OptDictKeyBlock *oldblocks = st->st_blocks, *kb;
+    OptDictEntry *ep;
+    void **itemp, *newitem;
     size_t i;
-    int is_oldtable_malloced;
-    OptDictEntry small_copy[optdict_MINSIZE];
 
-    assert(minused >= 0);
+    store_init(st, st->st_size);
+    for (i = 0, ep = mp->ma_table; i <= mp->ma_mask; i++, ep++) {
+        if (!ACTIVE_ENTRY(ep))
+            continue;
+        itemp = (void **)((char *)ep + field);
+        newitem = store_alloc(mp, st);
+        if (newitem == NULL) {
+            /* Keep the old blocks, at the end of the chain. */
+            for (kb = st->st_blocks; kb != NULL && kb->kb_next != NULL;
+                    kb = kb->kb_next)
+                ;
+            if (kb == NULL)
+                st->st_blocks = oldblocks;
+            else
+                kb->kb_next = oldblocks;
+            return ERR_NO_MEM;
+        }
+        memcpy(newitem, *itemp, st->st_size);
+        *itemp = newitem;
+    }
+    store_free_blocks(mp, oldblocks, st->st_slot);
+    return 0;
+}
 
-    /* Find the smallest table size > minused. */
-    for (newsize = optdict_MINSIZE;
-            newsize <= minused && newsize > 0;
-            newsize <<= 1)
-        ;
-    if (newsize <= 0) {
+/* Rebuild the table at twice the number of keys (rounded up to a power of 2)
+ * with no dummies, and repack the keys.  Does nothing to a small or frozen
+ * dict, which never has dummies.  Once every key is in the dict's own
+ * storage, it stops sharing any with copies.
+ */
+    int
+OptDict_Compact(OptDict *mp)
+{
+    if (mp->ma_small || mp->ma_frozen)
+        return 0;
+    if (dictresize(mp, 2 * mp->ma_used) != 0)
         return ERR_NO_MEM;
+    if (repack_store(mp, &mp->ma_keys, offsetof(OptDictEntry, me_key)) == 0) {
+        release_shared(mp, mp->ma_shared);
+        mp->ma_shared = NULL;
     }
+    if (mp->ma_vallayout == VALUES_SEPARATE)
+        repack_store(mp, &mp->ma_values,
+                     offsetof(OptDictEntry, me_value.v_ptr));
+    return 0;
+}
 
-    /* Get space for a new table. */
-    oldtable = mp->ma_table;
-    assert(oldtable != NULL);
-    is_oldtable_malloced = oldtable != mp->ma_smalltable;
+/* Make deletions compact the dict (see OptDict_Compact()) when more than
+ * maxdummies of the table's slots are dummies, or fewer than minfill of them
+ * are in use; 0 turns either test off (the default).  Compacting leaves the
+ * table between a quarter and a half full, so minfill must be below 0.25 or
+ * the next deletion could compact again.  Returns -1 for values out of range.
+ */
+    int
+OptDict_SetShrinkPolicy(OptDict *mp, double maxdummies, double minfill)
+{
+    if (!(maxdummies >= 0.0 && maxdummies < 1.0)
+            || !(minfill >= 0.0 && minfill < 0.25))
+        return -1;
+    mp->ma_maxdummies = maxdummies;
+    mp->ma_minfill = minfill;
+    return 0;
+}
 
-    if (newsize == optdict_MINSIZE) {
-        /* A large table is shrinking, or we can't get any smaller. */
-        newtable = mp->ma_smalltable;
-        if (newtable == oldtable) {
-            if (mp->ma_fill == mp->ma_used) {
-                /* No dummies, so no point doing anything. */
-                return 0;
+/*
+   Read-only dictionaries (see "Readonly Dictionaries" in dictnotes.txt).
+   Freezing a dict fixes its set of keys: OptDict_SetItem() can still replace
+   the value of a key that's present, but adding or deleting keys fails with
+   ERR_FROZEN.  Freezing rebuilds the table to purge dummy entries, and from
+   then on lookups go through lookdict_frozen(), which doesn't have to test
+   for them.  A small table is left as it is; it never has dummies.
+   */
+    static OptDictEntry *
+lookdict_frozen(OptDict *mp, void *key, register long hash)
+{
+    register size_t i;
+    register size_t perturb;
+    register size_t mask = (size_t)mp->ma_mask;
+    OptDictEntry *ep0 = mp->ma_table;
+    register OptDictEntry *ep;
+
+    i = hash & mask;
+    ep = &ep0[i];
+    for (perturb = hash; ep->me_key != NULL; perturb >>= PERTURB_SHIFT) {
+        if (ep->me_key == key
+                || (ep->me_hash == hash && mp->eqfunc(ep->me_key, key, mp->ma_keysize))) {
+            if (mp->ma_counts != NULL
+                    && ++mp->ma_sampletick >= mp->ma_sampleperiod) {
+                mp->ma_sampletick = 0;
+                mp->ma_counts[ep - ep0]++;
             }
-            /* We're not going to resize it, but rebuild the table anyway to
-             * purge old dummy entries.  
-             * Subtle:  This is *necessary* if fill==size, as lookdict needs at
-             * least one virgin slot to terminate failing searches.  If fill <
-             * size, it's merely desirable, as dummies slow searches.
-             */
-            assert(mp->ma_fill > mp->ma_used);
-            memcpy(small_copy, oldtable, sizeof(small_copy));
-            oldtable = small_copy;
+            return ep;
         }
+        i = (i << 2) + i + perturb + 1;
+        ep = &ep0[i & mask];
     }
-    else {
-        newtable = malloc(newsize * sizeof(OptDictEntry));
-        if (newtable == NULL) {
+    return ep;
+}
+
+    int
+OptDict_Freeze(OptDict *mp)
+{
+    if (mp->ma_frozen)
+        return 0;
+    if (!mp->ma_small) {
+        /* Rebuild at the same size; this is a no-op without dummies. */
+        if (dictresize(mp, mp->ma_mask) != 0)
             return ERR_NO_MEM;
-        }
+        set_lookup(mp, lookdict_frozen);
     }
+    /* Fit the filter to the final keys; the old one will do if not. */
+    if (mp->ma_filter != NULL)
+        bloom_build(mp, mp->ma_used);
+    mp->ma_frozen = 1;
+    return 0;
+}
 
-    /* Make the dict empty, using the new table. */
-    assert(newtable != oldtable);
-    mp->ma_table = newtable;
-    mp->ma_mask = newsize - 1;
-    memset(newtable, 0, sizeof(OptDictEntry) * newsize);
-    mp->ma_used = 0;
-    i = mp->ma_fill;
-    mp->ma_fill = 0;
+/* Start counting successful lookups in a frozen dict, one of every `period`
+ * of them, into ma_counts (one counter per table slot), for a later
+ * OptDict_Optimize(mp, NULL).  A period of 0 stops counting and discards the
+ * counts.
+ */
+    int
+OptDict_SampleAccesses(OptDict *mp, size_t period)
+{
+    if (!mp->ma_frozen)
+        return -1;
+    dict_free(mp, mp->ma_counts, (mp->ma_mask + 1) * sizeof(size_t));
+    mp->ma_counts = NULL;
+    if (period == 0 || mp->ma_small)
+        return 0;
+    mp->ma_counts = dict_calloc(mp, mp->ma_mask + 1, sizeof(size_t));
+    if (mp->ma_counts == NULL)
+        return ERR_NO_MEM;
+    mp->ma_sampleperiod = period;
+    mp->ma_sampletick = 0;
+    return 0;
+}
+
+typedef struct {
+    OptDictEntry entry;
+    size_t count;
+    size_t slot;
+} optimize_item;
+
+    static int
+optimize_cmp(const void *a, const void *b)
+{
+    const optimize_item *x = a, *y = b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+/* Self-organize a frozen dict for a skewed access pattern: rebuild the table
+ * (at the same size) inserting keys in descending order of access count, so
+ * that the most popular keys sit in their home slots and the collisions are
+ * absorbed by the rarely used ones.  access_counts[i] is the number of
+ * accesses to the key now in table slot i; if access_counts is NULL, the
+ * counts gathered by OptDict_SampleAccesses() are used, and then reset.
+ * Returns -1 if the dict isn't frozen (OptDict_Freeze() moves the keys, so
+ * count them after it), or if there are no counts.
+ */
+    int
+OptDict_Optimize(OptDict *mp, const size_t *access_counts)
+{
+    optimize_item *items;
+    OptDictEntry *ep;
+    size_t i, n, size;
 
-    /* Copy the data over; this is refcount-neutral for active entries;
-       dummy entries aren't copied over, of course */
-    for (ep = oldtable; i > 0; ep++) {
-        if (ep->me_value != NULL) {             /* active entry */
-            --i;
-            insertdict_clean(mp, ep->me_key, ep->me_hash,
-                    ep->me_value);
-        }
-        else if (ep->me_key != NULL) {          /* dummy entry */
-            --i;
-            assert(ep->me_key == dummy);
+    if (!mp->ma_frozen || (access_counts == NULL && mp->ma_counts == NULL))
+        return -1;
+    if (access_counts == NULL)
+        access_counts = mp->ma_counts;
+    /* A linear search doesn't care where keys are, and a perfect hash
+       already finds every key on the first probe. */
+    if (mp->ma_small || mp->ma_pilots != NULL || mp->ma_used == 0)
+        return 0;
+    if (UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+    size = mp->ma_mask + 1;
+    items = dict_alloc(mp, mp->ma_used * sizeof(optimize_item));
+    if (items == NULL)
+        return ERR_NO_MEM;
+    for (i = n = 0; i < size; i++) {
+        ep = &mp->ma_table[i];
+        if (ep->me_key != NULL) {
+            items[n].entry = *ep;
+            items[n].count = access_counts[i];
+            items[n].slot = i;
+            n++;
         }
-        /* else key == value == NULL:  nothing to do */
     }
-
-    if (is_oldtable_malloced)
-        free(oldtable);
+    assert(n == mp->ma_used);
+    qsort(items, n, sizeof(optimize_item), optimize_cmp);
+
+    clear_cache(mp);
+    memset(mp->ma_table, 0, size * sizeof(OptDictEntry));
+    memset(mp->ma_occupied, 0, OCCUPIED_WORDS(size) * sizeof(uint64_t));
+    mp->ma_used = mp->ma_fill = 0;
+    for (i = 0; i < n; i++)
+        insertdict_clean(mp, items[i].entry.me_key, items[i].entry.me_hash,
+                         items[i].entry.me_value);
+    dict_free(mp, items, n * sizeof(optimize_item));
+    if (mp->ma_counts != NULL)
+        memset(mp->ma_counts, 0, size * sizeof(size_t));
     return 0;
 }
 
-/* Create a new dictionary pre-sized to hold an estimated number of elements.
-   Underestimates are okay because the dictionary will resize as necessary.
-   Overestimates just mean the dictionary will be more sparse than usual.
+/* The number of table slots examined to find key (or to decide it's missing)
+ * -- a diagnostic for tuning.  Only the new table is examined while a resize
+ * is in progress.
+ */
+    size_t
+OptDict_Probes(OptDict *mp, void *key, long hash)
+{
+    register size_t i, perturb, probes;
+    register size_t mask = (size_t)mp->ma_mask;
+    OptDictEntry *ep0 = mp->ma_table;
+    register OptDictEntry *ep;
+
+    if (mp->ma_small || mp->ma_pilots != NULL)
+        return 1;
+    i = hash & mask;
+    ep = &ep0[i];
+    for (perturb = hash, probes = 1; ep->me_key != NULL;
+            perturb >>= PERTURB_SHIFT, probes++) {
+        if (ep->me_key == key
+                || (ep->me_hash == hash && ep->me_key != dummy
+                    && mp->eqfunc(ep->me_key, key, mp->ma_keysize)))
+            break;
+        i = (i << 2) + i + perturb + 1;
+        ep = &ep0[i & mask];
+    }
+    return probes;
+}
+
+/*
+   Perfect hashing.  For a key set that never changes, dictnotes.txt suggests
+   "jostling" the keys until collisions are minimized; we can go all the way
+   and remove them.  OptDict_CompilePerfect() builds a minimal perfect hash
+   function in the style of CHD and PTHash:
+
+   Each key's bytes are hashed (with a seed) to 64 bits, h.  The top 32 bits
+   of h pick one of ma_nbuckets buckets, about PERFECT_LAMBDA keys each.
+   Bucket b has a "pilot" number, ma_pilots[b], and a key in it lives in slot
+
+       REDUCE(mix64(h ^ PILOT_MIX(ma_pilots[b])), n)
+
+   of an n-entry table.  Buckets are placed largest first: for each, pilots
+   0, 1, 2, ... are tried until all of its keys land in distinct free slots.
+   The first buckets are placed easily while the table is empty, and by the
+   time it's nearly full only singletons are left, which need just one free
+   slot each.  If a seed doesn't work out (it essentially never happens) the
+   next one is tried.
+
+   The table holds exactly n entries, the load factor is 1.0 and lookups
+   take exactly one probe and at most one key comparison.  The pilots add
+   4/PERFECT_LAMBDA bytes per key.
+
+   Positions depend on the key's bytes rather than on me_hash, since distinct
+   keys can share a hash (int_hash(-1) == int_hash(-2)); that limits perfect
+   hashing to key types whose equality is equality of bytes, INT_KEY and
+   BYTES_KEY.
    */
 
-    /* PyObject * */
-/* _PyDict_NewPresized(Py_ssize_t minused) */
-/* { */
-    /* PyObject *op = PyDict_New(); */
+#define PERFECT_LAMBDA 4
+#define PERFECT_MAXSEEDS 16
+#define PILOT_MIX(p) ((uint64_t)(p) * 0x9e3779b97f4a7c15ULL)
+/* Map a 32-bit hash x to range(n) without a division. */
+#define REDUCE(x, n) ((size_t)(((uint64_t)(uint32_t)(x) * (uint64_t)(n)) >> 32))
 
-    /* if (minused>5 && op != NULL && dictresize((OptDict *)op, minused) == -1) { */
-        /* Py_DECREF(op); */
-        /* return NULL; */
-    /* } */
-    /* return op; */
-/* } */
+/* The splitmix64 finalizer. */
+    static uint64_t
+mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
 
-/* Note that, for historical reasons, PyDict_GetItem() suppresses all errors
- * that may occur (originally dicts supported only string keys, and exceptions
- * weren't possible).  So, while the original intent was that a NULL return
- * meant the key wasn't present, in reality it can mean that, or that an error
- * (suppressed) occurred while computing the key's hash, or that some error
- * (suppressed) occurred when comparing keys in the dict's internal probe
- * sequence.  A nasty example of the latter is when a Python-coded comparison
- * function hits a stack-depth error, which can cause this to return NULL
- * even if the key is present.
- */
-    /* PyObject * */
-/* PyDict_GetItem(PyObject *op, PyObject *key) */
-/* { */
-    /* long hash; */
-    /* OptDict *mp = (OptDict *)op; */
-    /* PyDictEntry *ep; */
-    /* PyThreadState *tstate; */
-    /* if (!PyDict_Check(op)) */
-        /* return NULL; */
-    /* if (!PyString_CheckExact(key) || */
-            /* (hash = ((PyStringObject *) key)->ob_shash) == -1) */
-    /* { */
-        /* hash = PyObject_Hash(key); */
-        /* if (hash == -1) { */
-            /* PyErr_Clear(); */
-            /* return NULL; */
-        /* } */
-    /* } */
+    static uint64_t
+perfect_hash(const void *key, size_t size, uint64_t seed)
+{
+    const unsigned char *p = key;
+    uint64_t h = seed, w;
 
-    /* We can arrive here with a NULL tstate during initialization: try
-       running "python -Wi" for an example related to string interning.
-       Let's just hope that no exception occurs then...  This must be
-       _PyThreadState_Current and not PyThreadState_GET() because in debug
-       mode, the latter complains if tstate is NULL. */
-    /* tstate = _PyThreadState_Current; */
-    /* if (tstate != NULL && tstate->curexc_type != NULL) { */
-        /* [> preserve the existing exception <] */
-        /* PyObject *err_type, *err_value, *err_tb; */
-        /* PyErr_Fetch(&err_type, &err_value, &err_tb); */
-        /* ep = (mp->ma_lookup)(mp, key, hash); */
-        /* [> ignore errors <] */
-        /* PyErr_Restore(err_type, err_value, err_tb); */
-        /* if (ep == NULL) */
-            /* return NULL; */
-    /* } */
-    /* else { */
-        /* ep = (mp->ma_lookup)(mp, key, hash); */
-        /* if (ep == NULL) { */
-            /* PyErr_Clear(); */
-            /* return NULL; */
-        /* } */
-    /* } */
-    /* return ep->me_value; */
-/* } */
+    for (; size >= 8; size -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        h = mix64(h ^ w);
+    }
+    if (size > 0) {
+        w = 0;
+        memcpy(&w, p, size);
+        h = mix64(h ^ w ^ ((uint64_t)size << 56));
+    }
+    return h;
+}
 
-/* CAUTION: OptDict_SetItem() must guarantee that it won't resize the
- * dictionary if it's merely replacing the value for an existing key.  This
- * means that it's safe to loop over a dictionary with OptDict_Next() and
- * occasionally replace a value -- but you can't insert new keys or remove
- * them.
- */
-    int
-OptDict_SetItem(register OptDict *mp, void *key, register long hash, void *value, void *oldvalue)
+#define PERFECT_SLOT(h, pilot, n) REDUCE(mix64((h) ^ PILOT_MIX(pilot)), n)
+
+/* Returned for a missing key: never active, and never written, since the
+   dict is frozen. */
+static OptDictEntry perfect_miss;
+
+    static OptDictEntry *
+lookdict_perfect(OptDict *mp, void *key, register long hash)
 {
-    register size_t n_used;
+    register uint64_t h = perfect_hash(key, mp->ma_keysize, mp->ma_seed);
+    register OptDictEntry *ep = &mp->ma_table[PERFECT_SLOT(h,
+            mp->ma_pilots[REDUCE(h >> 32, mp->ma_nbuckets)], mp->ma_mask + 1)];
 
-    assert(key);
-    assert(value);
-    /* get the key's hash */
-    /* if (PyString_CheckExact(key)) { */
-        /* hash = ((PyStringObject *)key)->ob_shash; */
-        /* if (hash == -1) */
-            /* hash = PyObject_Hash(key); */
-    /* } */
-    /* else { */
-    if (hash == -1)
-        return -1;
-    /* } */
-    assert(mp->ma_fill <= mp->ma_mask);  /* at least one empty slot */
-    n_used = mp->ma_used;
-    /* XXX: Finish me!!! */
-    if (insertdict(mp, key, hash, value, oldvalue) != 0)
-        return -1;
-    /* If we added a key, we can safely resize.  Otherwise just return!
-     * If fill >= 2/3 size, adjust size.  Normally, this doubles or
-     * quaduples the size, but it's also possible for the dict to shrink
-     * (if ma_fill is much larger than ma_used, meaning a lot of dict
-     * keys have been deleted).
-     *
-     * Quadrupling the size improves average dictionary sparseness
-     * (reducing collisions) at the cost of some memory and iteration
-     * speed (which loops over every possible entry).  It also halves
-     * the number of expensive resize operations in a growing dictionary.
-     *
-     * Very large dictionaries (over 50K items) use doubling instead.
-     * This may help applications with severe memory constraints.
-     */
-    if (!(mp->ma_used > n_used && mp->ma_fill*3 >= (mp->ma_mask+1)*2))
-        return 0;
-    return dictresize(mp, (mp->ma_used > 50000 ? 2 : 4) * mp->ma_used);
+    if (ep->me_hash == hash
+            && (ep->me_key == key || mp->eqfunc(ep->me_key, key, mp->ma_keysize)))
+        return ep;
+    return &perfect_miss;
 }
 
-    /* int */
-/* PyDict_DelItem(PyObject *op, PyObject *key) */
-/* { */
-    /* register OptDict *mp; */
-    /* register long hash; */
-    /* register PyDictEntry *ep; */
-    /* PyObject *old_value, *old_key; */
+/* Try to place the n keys of entries[] with the given seed, choosing
+   pilots[0 : nbuckets].  On success slots[i] is where entries[i] goes.
+   order, starts, members, taken and hs are scratch space (nbuckets,
+   nbuckets + 1, n, n and n items).
+   */
+    static int
+place_keys(OptDictEntry *entries, size_t n, size_t keysize, uint64_t seed,
+           size_t nbuckets, unsigned int *pilots, size_t *slots,
+           size_t *order, size_t *starts, size_t *members, char *taken,
+           uint64_t *hs)
+{
+    size_t i, j, k, b, size, maxsize, slot;
+    unsigned int pilot, maxpilot;
+
+    /* The last singletons find one free slot in n on average, so this many
+       failures means the seed is bad: two keys in a bucket with the same
+       hash, say. */
+    maxpilot = n < (UINT_MAX - 1024) / 64 ? 64 * (unsigned int)n + 1024
+                                          : UINT_MAX;
+
+    /* Bucket the keys: a counting sort of key indexes by bucket, into
+       members[starts[b] : starts[b+1]]. */
+    memset(starts, 0, (nbuckets + 1) * sizeof(size_t));
+    for (i = 0; i < n; i++) {
+        hs[i] = perfect_hash(entries[i].me_key, keysize, seed);
+        starts[REDUCE(hs[i] >> 32, nbuckets) + 1]++;
+    }
+    maxsize = 0;
+    for (b = 0; b < nbuckets; b++) {
+        if (starts[b + 1] > maxsize)
+            maxsize = starts[b + 1];
+        starts[b + 1] += starts[b];
+    }
+    memcpy(order, starts, nbuckets * sizeof(size_t));   /* fill pointers */
+    for (i = 0; i < n; i++)
+        members[order[REDUCE(hs[i] >> 32, nbuckets)]++] = i;
+
+    /* The nonempty buckets in decreasing order of size, into order[0 : k].
+       Bucket sizes are small, so one pass per size is cheap. */
+    k = 0;
+    for (size = maxsize; size > 0; size--)
+        for (b = 0; b < nbuckets; b++)
+            if (starts[b + 1] - starts[b] == size)
+                order[k++] = b;
+
+    memset(taken, 0, n);
+    memset(pilots, 0, nbuckets * sizeof(unsigned int));
+    for (j = 0; j < k; j++) {
+        b = order[j];
+        for (pilot = 0; ; pilot++) {
+            for (i = starts[b]; i < starts[b + 1]; i++) {
+                slot = PERFECT_SLOT(hs[members[i]], pilot, n);
+                if (taken[slot])
+                    break;
+                taken[slot] = 1;
+                slots[members[i]] = slot;
+            }
+            if (i == starts[b + 1])
+                break;
+            while (i-- > starts[b])
+                taken[slots[members[i]]] = 0;
+            if (pilot == maxpilot)
+                return -1;
+        }
+        pilots[b] = pilot;
+    }
+    return 0;
+}
 
-    /* if (!PyDict_Check(op)) { */
-        /* PyErr_BadInternalCall(); */
-        /* return -1; */
-    /* } */
-    /* assert(key); */
-    /* if (!PyString_CheckExact(key) || */
-            /* (hash = ((PyStringObject *) key)->ob_shash) == -1) { */
-        /* hash = PyObject_Hash(key); */
-        /* if (hash == -1) */
-            /* return -1; */
-    /* } */
-    /* mp = (OptDict *)op; */
-    /* ep = (mp->ma_lookup)(mp, key, hash); */
-    /* if (ep == NULL) */
-        /* return -1; */
-    /* if (ep->me_value == NULL) { */
-        /* set_key_error(key); */
-        /* return -1; */
-    /* } */
-    /* old_key = ep->me_key; */
-    /* Py_INCREF(dummy); */
-    /* ep->me_key = dummy; */
-    /* old_value = ep->me_value; */
-    /* ep->me_value = NULL; */
-    /* mp->ma_used--; */
-    /* Py_DECREF(old_value); */
-    /* Py_DECREF(old_key); */
-    /* return 0; */
-/* } */
+/* Replace the table of a dict with int or bytes keys by a perfect hash table
+ * (see above), freezing the dict first.  Afterwards values can still be
+ * changed, but not keys.  Returns 0, ERR_NO_MEM, or ERR_KEY_TYPE for float
+ * and double keys.
+ */
+    int
+OptDict_CompilePerfect(OptDict *mp)
+{
+    OptDictEntry *entries = NULL, *table = NULL;
+    unsigned int *pilots = NULL;
+    size_t *slots = NULL, *order = NULL, *starts = NULL, *members = NULL;
+    uint64_t *hs = NULL;
+    char *taken = NULL;
+    size_t i, n, nbuckets, size;
+    uint64_t seed;
+    int err = ERR_NO_MEM, mapped = 0;
+
+    if (mp->eqfunc != eqint && mp->eqfunc != eqbytes)
+        return ERR_KEY_TYPE;
+    if (mp->ma_pilots != NULL)
+        return 0;
+    if (OptDict_Freeze(mp) != 0 || UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+    n = mp->ma_used;
+    if (n > UINT32_MAX)
+        return ERR_NO_MEM;
+    nbuckets = n / PERFECT_LAMBDA + 1;
+    size = n > 0 ? n : 1;
+
+    entries = dict_alloc(mp, size * sizeof(OptDictEntry));
+    table = table_alloc(mp, size, &mapped);
+    pilots = dict_alloc(mp, nbuckets * sizeof(unsigned int));
+    slots = dict_alloc(mp, size * sizeof(size_t));
+    order = dict_alloc(mp, nbuckets * sizeof(size_t));
+    starts = dict_alloc(mp, (nbuckets + 1) * sizeof(size_t));
+    members = dict_alloc(mp, size * sizeof(size_t));
+    taken = dict_alloc(mp, size);
+    hs = dict_alloc(mp, size * sizeof(uint64_t));
+    if (entries == NULL || table == NULL || pilots == NULL || slots == NULL
+            || order == NULL || starts == NULL || members == NULL
+            || taken == NULL || hs == NULL)
+        goto done;
+
+    for (i = n = 0; i <= mp->ma_mask; i++)
+        if (ACTIVE_ENTRY(&mp->ma_table[i]))
+            entries[n++] = mp->ma_table[i];
+    assert(n == mp->ma_used);
+    for (seed = 0; seed < PERFECT_MAXSEEDS; seed++)
+        if (place_keys(entries, n, mp->ma_keysize, mix64(seed), nbuckets,
+                       pilots, slots, order, starts, members, taken,
+                       hs) == 0)
+            break;
+    if (seed == PERFECT_MAXSEEDS)
+        goto done;
+
+    /* An empty dict still gets one slot, marked unused with a hash no key
+       can have. */
+    table[0].me_key = NULL;
+    table[0].me_hash = -1;
+    for (i = 0; i < n; i++)
+        table[slots[i]] = entries[i];
+
+    /* Sampled access counts were per slot of the old table. */
+    dict_free(mp, mp->ma_counts, (mp->ma_mask + 1) * sizeof(size_t));
+    mp->ma_counts = NULL;
+    dict_free(mp, mp->ma_occupied,
+              OCCUPIED_WORDS(mp->ma_mask + 1) * sizeof(uint64_t));
+    mp->ma_occupied = NULL;
+    clear_cache(mp);
+    if (mp->ma_table != mp->ma_smalltable)
+        table_free(mp, mp->ma_table, mp->ma_mask + 1, mp->ma_tablemapped);
+    mp->ma_table = table;
+    mp->ma_tablemapped = mapped;
+    table = NULL;
+    mp->ma_mask = size - 1;
+    mp->ma_fill = n;
+    mp->ma_small = 0;
+    mp->ma_pilots = pilots;
+    pilots = NULL;
+    mp->ma_nbuckets = nbuckets;
+    mp->ma_seed = mix64(seed);
+    set_lookup(mp, lookdict_perfect);
+    err = 0;
+
+done:
+    dict_free(mp, entries, size * sizeof(OptDictEntry));
+    if (table != NULL)
+        table_free(mp, table, size, mapped);
+    dict_free(mp, pilots, nbuckets * sizeof(unsigned int));
+    dict_free(mp, slots, size * sizeof(size_t));
+    dict_free(mp, order, nbuckets * sizeof(size_t));
+    dict_free(mp, starts, (nbuckets + 1) * sizeof(size_t));
+    dict_free(mp, members, size * sizeof(size_t));
+    dict_free(mp, taken, size);
+    dict_free(mp, hs, size * sizeof(uint64_t));
+    return err;
+}
 
     /* void */
 /* PyDict_Clear(PyObject *op) */
@@ -774,78 +3172,569 @@ OptDict_SetItem(register OptDict *mp, void *key, register long hash, void *value
 /* #endif */
     /* } */
 
-    /* if (table_is_malloced) */
-        /* PyMem_DEL(table); */
-/* } */
+    /* if (table_is_malloced) */
+        /* PyMem_DEL(table); */
+/* } */
+
+#if defined(__GNUC__)
+#define LOWEST_BIT_INDEX64(x) ((size_t)__builtin_ctzll(x))
+#else
+    static size_t
+LOWEST_BIT_INDEX64(uint64_t x)
+{
+    size_t i = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        i++;
+    }
+    return i;
+}
+#endif
+
+/* The index of the first active slot of ma_table at or after i, or
+ * ma_mask + 1 if there's none. */
+    static size_t
+next_active(OptDict *mp, size_t i)
+{
+    size_t nslots = mp->ma_mask + 1, w;
+    uint64_t bits;
+
+    if (mp->ma_occupied == NULL) {
+        while (i < nslots && !ACTIVE_ENTRY(&mp->ma_table[i]))
+            i++;
+        return i < nslots ? i : nslots;
+    }
+    if (i >= nslots)
+        return nslots;
+    w = i / 64;
+    bits = mp->ma_occupied[w] & (~(uint64_t)0 << (i % 64));
+    while (bits == 0) {
+        if (++w == OCCUPIED_WORDS(nslots))
+            return nslots;
+        bits = mp->ma_occupied[w];
+    }
+    return w * 64 + LOWEST_BIT_INDEX64(bits);
+}
+
+/*
+ * Iterate over a dict.  Use like so:
+ *
+ *     size_t i;
+ *     void *key, *value;
+ *     i = 0;   # important!  i should not otherwise be changed by you
+ *     while (OptDict_Next(yourdict, &i, &key, &value)) {
+ *              key points to the dict's copy of the key, value as
+ *              OptDict_GetItem() would.
+ *     }
+ *
+ * Either of pkey and pvalue may be NULL.  Empty and deleted slots are
+ * skipped 64 at a time with the occupancy bitmap, so a sparse table costs
+ * little more than a full one of the same size.  A resize in progress is
+ * finished first.
+ *
+ * CAUTION:  In general, it isn't safe to use OptDict_Next in a loop that
+ * mutates the dict.  One exception:  it is safe if the loop merely changes
+ * the values associated with the keys (but doesn't insert new keys or
+ * delete keys), via OptDict_SetItem() or the value pointers.
+ */
+    int
+OptDict_Next(OptDict *mp, size_t *ppos, void **pkey, void **pvalue)
+{
+    register size_t i;
+    register OptDictEntry *ep;
+
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+    i = next_active(mp, *ppos);
+    if (i > mp->ma_mask) {
+        *ppos = i;
+        return 0;
+    }
+    *ppos = i + 1;
+    ep = &mp->ma_table[i];
+    if (pkey)
+        *pkey = ep->me_key;
+    if (pvalue)
+        *pvalue = VALUE_OF(mp, ep);
+    return 1;
+}
+
+/* Block iteration: copy the keys and values of up to max more entries into
+ * keys and values, packed like OptDict_Keys() and OptDict_Values(), carrying
+ * on from *ppos as OptDict_Next() does.  Either of keys and values may be
+ * NULL.  Returns the number of entries copied, 0 once they're all done.
+ */
+    size_t
+OptDict_NextBlock(OptDict *mp, size_t *ppos, void *keys, void *values,
+                  size_t max)
+{
+    char *k = keys, *v = values;
+    size_t i, n;
+    OptDictEntry *ep;
+
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+    for (i = *ppos, n = 0; n < max; i++, n++) {
+        i = next_active(mp, i);
+        if (i > mp->ma_mask)
+            break;
+        ep = &mp->ma_table[i];
+        if (k != NULL) {
+            memcpy(k, ep->me_key, mp->ma_keysize);
+            k += mp->ma_keysize;
+        }
+        if (v != NULL) {
+            memcpy(v, VALUE_OF(mp, ep), mp->ma_valsize);
+            v += mp->ma_valsize;
+        }
+    }
+    *ppos = i;
+    return n;
+}
+
+/* Parallel scans.
+ *
+ * ma_table is cut into contiguous slot ranges, one per thread, each a whole
+ * number of occupancy bitmap words so that no two threads share a word.  The
+ * scans only read the dict, and the caller mustn't change it until they
+ * return; the callbacks run concurrently and may only share what's safe to
+ * share.  Results are combined in range order, so for a given number of
+ * threads they don't depend on scheduling.
+ */
+
+/* Fewest slots worth handing a thread of their own. */
+#define PARALLEL_MINSLOTS 4096
+
+/* Divide ma_table into nparts slot ranges and store their nparts + 1 bounds
+ * in bounds: range i is [bounds[i], bounds[i+1]), to be walked with
+ * OptDict_NextInRange().  Ranges may be empty.  This finishes a resize in
+ * progress, so it must be called before the ranges are handed out, not by
+ * each thread.  Returns nparts.
+ */
+    size_t
+OptDict_Partition(OptDict *mp, size_t nparts, size_t *bounds)
+{
+    size_t nslots, chunk, i;
+
+    assert(nparts > 0);
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+    nslots = mp->ma_mask + 1;
+    chunk = (nslots + nparts - 1) / nparts;
+    chunk = (chunk + 63) & ~(size_t)63;
+    for (i = 0; i <= nparts; i++)
+        bounds[i] = i * chunk < nslots ? i * chunk : nslots;
+    return nparts;
+}
+
+/* Like OptDict_Next(), but stops at slot end (a bound from
+ * OptDict_Partition()).  It never modifies the dict, so any number of
+ * threads may walk their own ranges at once.
+ */
+    int
+OptDict_NextInRange(OptDict *mp, size_t *ppos, size_t end, void **pkey,
+                    void **pvalue)
+{
+    register size_t i;
+    register OptDictEntry *ep;
+
+    assert(mp->ma_oldtable == NULL);
+    i = next_active(mp, *ppos);
+    if (i >= end) {
+        *ppos = end;
+        return 0;
+    }
+    *ppos = i + 1;
+    ep = &mp->ma_table[i];
+    if (pkey)
+        *pkey = ep->me_key;
+    if (pvalue)
+        *pvalue = VALUE_OF(mp, ep);
+    return 1;
+}
+
+/* One thread's share of a parallel scan. */
+typedef struct _scanpart ScanPart;
+struct _scanpart {
+    OptDict *sp_dict;
+    size_t sp_start, sp_end;
+    void (*sp_run)(ScanPart *sp);
+    OptDictVisitFunc sp_func;
+    void *sp_arg;
+    int sp_status;
+    /* Reductions */
+    enum reduce_op sp_op;
+    size_t sp_count;
+    long sp_long;
+    double sp_double;
+    /* OptDict_ParallelFilter(): shared by the parts, nonzero for the slots
+     * of the entries kept */
+    unsigned char *sp_keep;
+};
+
+/* How many threads a parallel scan of mp asked to use nthreads (0 meaning
+ * one per online CPU) will run on: fewer for small tables, and one where
+ * there are no threads.
+ */
+    size_t
+OptDict_ScanThreads(OptDict *mp, size_t nthreads)
+{
+    size_t most = (mp->ma_mask + 1) / PARALLEL_MINSLOTS;
+
+#ifdef HAVE_PTHREADS
+    if (nthreads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+#else
+        nthreads = 1;
+#endif
+    }
+#else
+    nthreads = 1;
+#endif
+    if (nthreads > most)
+        nthreads = most;
+    return nthreads > 0 ? nthreads : 1;
+}
+
+/* Allocate and partition n parts, or return NULL.  Like everything the
+ * calling thread allocates for a scan, they come from mp's allocator; the
+ * threads themselves allocate nothing.
+ */
+    static ScanPart *
+new_scan(OptDict *mp, size_t n, void (*run)(ScanPart *))
+{
+    ScanPart *parts = dict_calloc(mp, n, sizeof(ScanPart));
+    size_t *bounds = dict_alloc(mp, (n + 1) * sizeof(size_t));
+    size_t i;
+
+    if (parts == NULL || bounds == NULL) {
+        dict_free(mp, parts, n * sizeof(ScanPart));
+        dict_free(mp, bounds, (n + 1) * sizeof(size_t));
+        return NULL;
+    }
+    OptDict_Partition(mp, n, bounds);
+    for (i = 0; i < n; i++) {
+        parts[i].sp_dict = mp;
+        parts[i].sp_start = bounds[i];
+        parts[i].sp_end = bounds[i + 1];
+        parts[i].sp_run = run;
+    }
+    dict_free(mp, bounds, (n + 1) * sizeof(size_t));
+    return parts;
+}
+
+    static void
+free_scan(ScanPart *parts, size_t n)
+{
+    dict_free(parts[0].sp_dict, parts, n * sizeof(ScanPart));
+}
+
+#ifdef HAVE_PTHREADS
+    static void *
+scan_thread(void *arg)
+{
+    ScanPart *sp = arg;
+
+    sp->sp_run(sp);
+    return NULL;
+}
+#endif
+
+/* Run the n parts, all but the first on threads of their own.  A part
+ * whose thread can't be started is run by the calling thread instead. */
+    static void
+run_scan(ScanPart *parts, size_t n)
+{
+    size_t i;
+#ifdef HAVE_PTHREADS
+    OptDict *mp = parts[0].sp_dict;
+    pthread_t *threads = n > 1 ? dict_alloc(mp, (n - 1) * sizeof(pthread_t))
+                               : NULL;
+    unsigned char *started = n > 1 ? dict_calloc(mp, n - 1, 1) : NULL;
+
+    if (threads == NULL || started == NULL) {
+        dict_free(mp, threads, (n - 1) * sizeof(pthread_t));
+        dict_free(mp, started, n - 1);
+        threads = NULL;
+        started = NULL;
+    }
+    for (i = 1; i < n && threads != NULL; i++)
+        started[i - 1] = pthread_create(&threads[i - 1], NULL, scan_thread,
+                                        &parts[i]) == 0;
+    parts[0].sp_run(&parts[0]);
+    for (i = 1; i < n; i++) {
+        if (threads != NULL && started[i - 1])
+            pthread_join(threads[i - 1], NULL);
+        else
+            parts[i].sp_run(&parts[i]);
+    }
+    dict_free(mp, threads, (n - 1) * sizeof(pthread_t));
+    dict_free(mp, started, n - 1);
+#else
+    for (i = 0; i < n; i++)
+        parts[i].sp_run(&parts[i]);
+#endif
+}
+
+    static void
+foreach_part(ScanPart *sp)
+{
+    size_t pos = sp->sp_start;
+    void *key, *value;
+
+    while (OptDict_NextInRange(sp->sp_dict, &pos, sp->sp_end, &key, &value))
+        if ((sp->sp_status = sp->sp_func(key, value, sp->sp_arg)) != 0)
+            return;
+}
+
+/* Call func(key, value, arg) for every item of mp, on nthreads threads
+ * (0 for one per online CPU; small dicts get fewer).  Thread i is passed
+ * arg = (char *)args + i*argsize, so with argsize 0 they all share args, and
+ * otherwise args must have room for OptDict_ScanThreads(mp, nthreads) of
+ * them.  If func returns nonzero its thread stops
+ * early, and the value is returned (that of the lowest-numbered thread, if
+ * several stopped).  Returns 0 when every call returned 0, or ERR_NO_MEM.
+ */
+    int
+OptDict_ParallelForEach(OptDict *mp, size_t nthreads, OptDictVisitFunc func,
+                        void *args, size_t argsize)
+{
+    size_t n = OptDict_ScanThreads(mp, nthreads), i;
+    ScanPart *parts;
+    int status = 0;
+
+    /* func may update the values in place. */
+    if (UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+    parts = new_scan(mp, n, foreach_part);
+    if (parts == NULL)
+        return ERR_NO_MEM;
+    for (i = 0; i < n; i++) {
+        parts[i].sp_func = func;
+        parts[i].sp_arg = (char *)args + i * argsize;
+    }
+    run_scan(parts, n);
+    for (i = 0; i < n && status == 0; i++)
+        status = parts[i].sp_status;
+    free_scan(parts, n);
+    return status;
+}
+
+    static void
+reduce_long_part(ScanPart *sp)
+{
+    size_t pos = sp->sp_start;
+    void *value;
+    long x, acc = 0;
+
+    while (OptDict_NextInRange(sp->sp_dict, &pos, sp->sp_end, NULL, &value)) {
+        x = *(long *)value;
+        if (sp->sp_count++ == 0 && sp->sp_op != REDUCE_SUM)
+            acc = x;
+        else if (sp->sp_op == REDUCE_SUM)
+            acc = (long)((unsigned long)acc + (unsigned long)x);
+        else if (sp->sp_op == REDUCE_MIN ? x < acc : x > acc)
+            acc = x;
+    }
+    sp->sp_long = acc;
+}
 
-/*
- * Iterate over a dict.  Use like so:
- *
- *     Py_ssize_t i;
- *     PyObject *key, *value;
- *     i = 0;   # important!  i should not otherwise be changed by you
- *     while (PyDict_Next(yourdict, &i, &key, &value)) {
- *              Refer to borrowed references in key and value.
- *     }
- *
- * CAUTION:  In general, it isn't safe to use PyDict_Next in a loop that
- * mutates the dict.  One exception:  it is safe if the loop merely changes
- * the values associated with the keys (but doesn't insert new keys or
- * delete keys), via PyDict_SetItem().
+    static void
+reduce_double_part(ScanPart *sp)
+{
+    size_t pos = sp->sp_start;
+    void *value;
+    double x, acc = 0.0;
+
+    while (OptDict_NextInRange(sp->sp_dict, &pos, sp->sp_end, NULL, &value)) {
+        x = *(double *)value;
+        if (sp->sp_count++ == 0 && sp->sp_op != REDUCE_SUM)
+            acc = x;
+        else if (sp->sp_op == REDUCE_SUM)
+            acc += x;
+        else if (sp->sp_op == REDUCE_MIN ? x < acc : x > acc)
+            acc = x;
+    }
+    sp->sp_double = acc;
+}
+
+/* Reduce the values of mp, as longs (v_long, or an OptDict_Int64 value type
+ * where long is 64 bits) or doubles (v_double, or OptDict_Float64), on
+ * nthreads threads as for OptDict_ParallelForEach().  Sums of longs wrap
+ * around.  Returns 0 and stores the result, ERR_NO_KEY for the min or max of
+ * an empty dict, ERR_VALUE_TYPE if the values aren't of the type asked for
+ * or op isn't a reduce_op, or ERR_NO_MEM.
  */
-    /* int */
-/* PyDict_Next(PyObject *op, Py_ssize_t *ppos, PyObject **pkey, PyObject **pvalue) */
-/* { */
-    /* register Py_ssize_t i; */
-    /* register Py_ssize_t mask; */
-    /* register PyDictEntry *ep; */
+    static int
+reduce(OptDict *mp, enum reduce_op op, size_t nthreads, int isdouble,
+       void *result)
+{
+    size_t n, i, count = 0;
+    ScanPart *parts;
+    long l = 0;
+    double d = 0.0;
+
+    if (op != REDUCE_SUM && op != REDUCE_MIN && op != REDUCE_MAX)
+        return ERR_VALUE_TYPE;
+    if (isdouble ? mp->ma_valtype != NULL && mp->ma_valtype != &OptDict_Float64
+            : mp->ma_valtype != NULL && (mp->ma_valtype != &OptDict_Int64
+                                         || sizeof(long) != sizeof(int64_t)))
+        return ERR_VALUE_TYPE;
+    if (mp->ma_used == 0 && op != REDUCE_SUM)
+        return ERR_NO_KEY;
+    n = OptDict_ScanThreads(mp, nthreads);
+    parts = new_scan(mp, n, isdouble ? reduce_double_part : reduce_long_part);
+    if (parts == NULL)
+        return ERR_NO_MEM;
+    for (i = 0; i < n; i++)
+        parts[i].sp_op = op;
+    run_scan(parts, n);
+    for (i = 0; i < n; i++) {
+        if (parts[i].sp_count == 0)
+            continue;
+        if (isdouble) {
+            if (count == 0 || op == REDUCE_SUM)
+                d = count == 0 ? parts[i].sp_double : d + parts[i].sp_double;
+            else if (op == REDUCE_MIN ? parts[i].sp_double < d
+                                      : parts[i].sp_double > d)
+                d = parts[i].sp_double;
+        }
+        else {
+            if (count == 0)
+                l = parts[i].sp_long;
+            else if (op == REDUCE_SUM)
+                l = (long)((unsigned long)l + (unsigned long)parts[i].sp_long);
+            else if (op == REDUCE_MIN ? parts[i].sp_long < l
+                                      : parts[i].sp_long > l)
+                l = parts[i].sp_long;
+        }
+        count += parts[i].sp_count;
+    }
+    free_scan(parts, n);
+    if (isdouble)
+        *(double *)result = d;
+    else
+        *(long *)result = l;
+    return 0;
+}
 
-    /* if (!PyDict_Check(op)) */
-        /* return 0; */
-    /* i = *ppos; */
-    /* if (i < 0) */
-        /* return 0; */
-    /* ep = ((OptDict *)op)->ma_table; */
-    /* mask = ((OptDict *)op)->ma_mask; */
-    /* while (i <= mask && ep[i].me_value == NULL) */
-        /* i++; */
-    /* *ppos = i+1; */
-    /* if (i > mask) */
-        /* return 0; */
-    /* if (pkey) */
-        /* *pkey = ep[i].me_key; */
-    /* if (pvalue) */
-        /* *pvalue = ep[i].me_value; */
-    /* return 1; */
-/* } */
+    int
+OptDict_ReduceLong(OptDict *mp, enum reduce_op op, size_t nthreads,
+                   long *result)
+{
+    return reduce(mp, op, nthreads, 0, result);
+}
 
-/* [> Internal version of PyDict_Next that returns a hash value in addition to the key and value.<] */
-    /* int */
-/* _PyDict_Next(PyObject *op, Py_ssize_t *ppos, PyObject **pkey, PyObject **pvalue, long *phash) */
-/* { */
-    /* register Py_ssize_t i; */
-    /* register Py_ssize_t mask; */
-    /* register PyDictEntry *ep; */
+    int
+OptDict_ReduceDouble(OptDict *mp, enum reduce_op op, size_t nthreads,
+                     double *result)
+{
+    return reduce(mp, op, nthreads, 1, result);
+}
 
-    /* if (!PyDict_Check(op)) */
-        /* return 0; */
-    /* i = *ppos; */
-    /* if (i < 0) */
-        /* return 0; */
-    /* ep = ((OptDict *)op)->ma_table; */
-    /* mask = ((OptDict *)op)->ma_mask; */
-    /* while (i <= mask && ep[i].me_value == NULL) */
-        /* i++; */
-    /* *ppos = i+1; */
-    /* if (i > mask) */
-        /* return 0; */
-    /* *phash = (long)(ep[i].me_hash); */
-    /* if (pkey) */
-        /* *pkey = ep[i].me_key; */
-    /* if (pvalue) */
-        /* *pvalue = ep[i].me_value; */
-    /* return 1; */
-/* } */
+    static void
+count_part(ScanPart *sp)
+{
+    size_t pos = sp->sp_start;
+    void *key, *value;
+
+    while (OptDict_NextInRange(sp->sp_dict, &pos, sp->sp_end, &key, &value))
+        if (sp->sp_func(key, value, sp->sp_arg))
+            sp->sp_count++;
+}
+
+/* The number of items of mp for which pred(key, value, arg) is nonzero,
+ * counted on nthreads threads (see OptDict_ParallelForEach()); all threads
+ * share arg.  Returns (size_t)-1 if out of memory.
+ */
+    size_t
+OptDict_ParallelCount(OptDict *mp, size_t nthreads, OptDictVisitFunc pred,
+                      void *arg)
+{
+    size_t n = OptDict_ScanThreads(mp, nthreads), i, count = 0;
+    ScanPart *parts = new_scan(mp, n, count_part);
+
+    if (parts == NULL)
+        return (size_t)-1;
+    for (i = 0; i < n; i++) {
+        parts[i].sp_func = pred;
+        parts[i].sp_arg = arg;
+    }
+    run_scan(parts, n);
+    for (i = 0; i < n; i++)
+        count += parts[i].sp_count;
+    free_scan(parts, n);
+    return count;
+}
+
+    static void
+filter_part(ScanPart *sp)
+{
+    OptDict *mp = sp->sp_dict;
+    size_t pos = sp->sp_start;
+    void *key, *value;
+
+    while (OptDict_NextInRange(mp, &pos, sp->sp_end, &key, &value)) {
+        if (!sp->sp_func(key, value, sp->sp_arg))
+            continue;
+        /* OptDict_NextInRange() left pos just past the entry */
+        sp->sp_keep[pos - 1] = 1;
+        sp->sp_count++;
+    }
+}
+
+/* A new dict of the items of mp for which pred(key, value, arg) is nonzero,
+ * with mp's key and value types and allocator.  The predicate runs on
+ * nthreads threads (see OptDict_ParallelForEach()), which share arg; the
+ * items it keeps are then inserted by the calling thread, into a table
+ * sized for them up front.  Returns NULL if out of memory.
+ */
+    OptDict *
+OptDict_ParallelFilter(OptDict *mp, size_t nthreads, OptDictVisitFunc pred,
+                       void *arg)
+{
+    size_t n = OptDict_ScanThreads(mp, nthreads), i, count = 0;
+    size_t nslots = mp->ma_mask + 1;
+    ScanPart *parts = new_scan(mp, n, filter_part);
+    unsigned char *keep = dict_calloc(mp, nslots, 1);
+    OptDict *np = NULL;
+    OptDictEntry *ep;
+
+    if (parts == NULL || keep == NULL)
+        goto done;
+    for (i = 0; i < n; i++) {
+        parts[i].sp_func = pred;
+        parts[i].sp_arg = arg;
+        parts[i].sp_keep = keep;
+    }
+    run_scan(parts, n);
+    for (i = 0; i < n; i++)
+        count += parts[i].sp_count;
+    np = OptDict_NewEx(mp->ma_keytype, mp->ma_keysize, &mp->ma_allocator);
+    if (np == NULL)
+        goto done;
+    if ((mp->ma_valtype != NULL
+            && OptDict_SetValueType(np, mp->ma_valtype, mp->ma_vallayout) != 0)
+            || (count > optdict_MINSIZE
+                && dictresize(np, count * 3 / 2) != 0))
+        goto fail;
+    for (i = 0, ep = mp->ma_table; i < nslots; i++, ep++) {
+        if (keep[i] && OptDict_SetItem(np, ep->me_key, ep->me_hash,
+                                       VALUE_OF(mp, ep)) != 0)
+            goto fail;
+    }
+    goto done;
+fail:
+    OptDict_Dealloc(np);
+    np = NULL;
+done:
+    dict_free(mp, keep, nslots);
+    if (parts != NULL)
+        free_scan(parts, n);
+    return np;
+}
 
 /* [> Methods <] */
 
@@ -1398,42 +4287,271 @@ OptDict_SetItem(register OptDict *mp, void *key, register long hash, void *value
     /* return PyDict_Merge(a, b, 1); */
 /* } */
 
-    /* int */
-/* PyDict_Merge(PyObject *a, PyObject *b, int override) */
-/* { */
-    /* register OptDict *mp, *other; */
-    /* register Py_ssize_t i; */
-    /* PyDictEntry *entry; */
+/* Combining values, for OptDict_Merge(): *dst = f(*dst, *src). */
+typedef void (*combinefunc)(void *dst, const void *src);
+
+/* Sums are done in utype, so that integers wrap around instead of
+ * overflowing. */
+#define COMBINERS(name, type, utype)                                        \
+    static void                                                             \
+    sum_##name(void *dst, const void *src)                                  \
+    {                                                                       \
+        *(type *)dst = (type)((utype)*(type *)dst + (utype)*(const type *)src); \
+    }                                                                       \
+    static void                                                             \
+    min_##name(void *dst, const void *src)                                  \
+    {                                                                       \
+        if (*(const type *)src < *(type *)dst)                              \
+            *(type *)dst = *(const type *)src;                              \
+    }                                                                       \
+    static void                                                             \
+    max_##name(void *dst, const void *src)                                  \
+    {                                                                       \
+        if (*(const type *)src > *(type *)dst)                              \
+            *(type *)dst = *(const type *)src;                              \
+    }
 
-    /* We accept for the argument either a concrete dictionary object,
-     * or an abstract "mapping" object.  For the former, we can do
-     * things quite efficiently.  For the latter, we only require that
-     * PyMapping_Keys() and PyObject_GetItem() be supported.
-     */
-    /* if (a == NULL || !PyDict_Check(a) || b == NULL) { */
-        /* PyErr_BadInternalCall(); */
-        /* return -1; */
-    /* } */
-    /* mp = (OptDict*)a; */
-    /* if (PyDict_Check(b)) { */
-        /* other = (OptDict*)b; */
-        /* if (other == mp || other->ma_used == 0) */
-            /* [> a.update(a) or a.update({}); nothing to do <] */
-            /* return 0; */
-        /* if (mp->ma_used == 0) */
-            /* Since the target dict is empty, PyDict_GetItem()
-             * always returns NULL.  Setting override to 1
-             * skips the unnecessary test.
-             */
-            /* override = 1; */
-        /* Do one big resize at the start, rather than
-         * incrementally resizing as we insert new items.  Expect
-         * that there will be no (or few) overlapping keys.
-         */
-        /* if ((mp->ma_fill + other->ma_used)*3 >= (mp->ma_mask+1)*2) { */
-            /* if (dictresize(mp, (mp->ma_used + other->ma_used)*2) != 0) */
-                /* return -1; */
-        /* } */
+COMBINERS(int8, int8_t, uint8_t)
+COMBINERS(uint8, uint8_t, uint8_t)
+COMBINERS(int16, int16_t, uint16_t)
+COMBINERS(uint16, uint16_t, uint16_t)
+COMBINERS(int32, int32_t, uint32_t)
+COMBINERS(uint32, uint32_t, uint32_t)
+COMBINERS(int64, int64_t, uint64_t)
+COMBINERS(uint64, uint64_t, uint64_t)
+COMBINERS(long, long, unsigned long)
+COMBINERS(float, float, float)
+COMBINERS(double, double, double)
+
+    static void
+sum_complex64(void *dst, const void *src)
+{
+    sum_float(&((complex64 *)dst)->re, &((const complex64 *)src)->re);
+    sum_float(&((complex64 *)dst)->im, &((const complex64 *)src)->im);
+}
+
+    static void
+sum_complex128(void *dst, const void *src)
+{
+    sum_double(&((complex128 *)dst)->re, &((const complex128 *)src)->re);
+    sum_double(&((complex128 *)dst)->im, &((const complex128 *)src)->im);
+}
+
+/* Value type format -> how to sum, min and max it.  Complex numbers have no
+ * order. */
+static const struct {
+    const char *format;
+    combinefunc sum, min, max;
+} combiners[] = {
+    {"b", sum_int8, min_int8, max_int8},
+    {"B", sum_uint8, min_uint8, max_uint8},
+    {"h", sum_int16, min_int16, max_int16},
+    {"H", sum_uint16, min_uint16, max_uint16},
+    {"i", sum_int32, min_int32, max_int32},
+    {"I", sum_uint32, min_uint32, max_uint32},
+    {"q", sum_int64, min_int64, max_int64},
+    {"Q", sum_uint64, min_uint64, max_uint64},
+    {"f", sum_float, min_float, max_float},
+    {"d", sum_double, min_double, max_double},
+    {"Zf", sum_complex64, NULL, NULL},
+    {"Zd", sum_complex128, NULL, NULL},
+};
+
+/* How policy combines values of type vt (NULL for OptDictValue), or NULL if
+ * it doesn't apply to them. */
+    static combinefunc
+find_combiner(const OptDictValueType *vt, enum merge_policy policy)
+{
+    size_t i;
+
+    if (vt == NULL) {
+        switch (policy) {
+            case MERGE_SUM: return sum_long;
+            case MERGE_MIN: return min_long;
+            case MERGE_MAX: return max_long;
+            case MERGE_SUM_DOUBLE: return sum_double;
+            case MERGE_MIN_DOUBLE: return min_double;
+            case MERGE_MAX_DOUBLE: return max_double;
+            default: return NULL;
+        }
+    }
+    if (vt->vt_format == NULL)
+        return NULL;
+    for (i = 0; i < sizeof(combiners) / sizeof(combiners[0]); i++) {
+        if (strcmp(vt->vt_format, combiners[i].format) != 0)
+            continue;
+        switch (policy) {
+            case MERGE_SUM: return combiners[i].sum;
+            case MERGE_MIN: return combiners[i].min;
+            case MERGE_MAX: return combiners[i].max;
+            default: return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Whether a and b have keys of the same type, hashed the same way. */
+    static int
+same_key_type(OptDict *a, OptDict *b)
+{
+    return a->eqfunc == b->eqfunc && a->hashfunc == b->hashfunc
+        && a->ma_keysize == b->ma_keysize;
+}
+
+/* Whether a and b have values of the same type.  Value types without a
+ * format (raw bytes) match by size. */
+    static int
+same_value_type(OptDict *a, OptDict *b)
+{
+    const OptDictValueType *va = a->ma_valtype, *vb = b->ma_valtype;
+
+    if (va == NULL || vb == NULL)
+        return va == vb;
+    if (va->vt_size != vb->vt_size)
+        return 0;
+    if (va->vt_format == NULL || vb->vt_format == NULL)
+        return va->vt_format == vb->vt_format;
+    return strcmp(va->vt_format, vb->vt_format) == 0;
+}
+
+/* Store pointers to up to HASH_CHUNK active entries of mp, from slot *ppos
+ * on, in eps, and return how many.  mp mustn't be resizing. */
+    static size_t
+next_entries(OptDict *mp, size_t *ppos, OptDictEntry **eps)
+{
+    size_t i = *ppos, n = 0;
+
+    assert(mp->ma_oldtable == NULL);
+    while (n < HASH_CHUNK && (i = next_active(mp, i)) <= mp->ma_mask)
+        eps[n++] = &mp->ma_table[i++];
+    *ppos = i;
+    return n;
+}
+
+/* Merge the items of other into mp, which must have the same key and value
+ * types.  Keys missing from mp are added with other's value; for keys in
+ * both, policy says what mp's value becomes:
+ *
+ *     MERGE_OVERWRITE   other's value
+ *     MERGE_KEEP        mp's value, unchanged
+ *     MERGE_SUM         the sum of the two
+ *     MERGE_MIN         the smaller
+ *     MERGE_MAX         the larger
+ *
+ * SUM, MIN and MAX work on numeric value types (complex ones can only be
+ * summed), and take OptDictValue values to be v_long; MERGE_SUM_DOUBLE,
+ * MERGE_MIN_DOUBLE and MERGE_MAX_DOUBLE are their v_double versions.  Sums
+ * of integers wrap around.
+ *
+ * mp is grown once up front, for the case of few shared keys, and its
+ * slots are prefetched ahead of the probes as in OptDict_SetMany().
+ * Returns 0, ERR_KEY_TYPE or ERR_VALUE_TYPE if the dicts don't match (or
+ * policy doesn't apply to the values), ERR_FROZEN, or ERR_NO_MEM, in which
+ * case some of other's items may have been merged.
+ */
+    int
+OptDict_Merge(OptDict *mp, OptDict *other, enum merge_policy policy)
+{
+    OptDictEntry *eps[HASH_CHUNK];
+    combinefunc combine = NULL;
+    size_t pos = 0, n, i, dist = mp->ma_prefetch, used = other->ma_used;
+    void *value;
+    int inserted;
+
+    if (!same_key_type(mp, other))
+        return ERR_KEY_TYPE;
+    if (!same_value_type(mp, other))
+        return ERR_VALUE_TYPE;
+    if (policy != MERGE_OVERWRITE && policy != MERGE_KEEP
+            && (combine = find_combiner(mp->ma_valtype, policy)) == NULL)
+        return ERR_VALUE_TYPE;
+    if (mp->ma_frozen)
+        return ERR_FROZEN;
+    if (used == 0)
+        return 0;
+    if (other->ma_oldtable != NULL)
+        migrate(other, 0);
+    if (UNSHARE(mp) != 0)
+        return ERR_NO_MEM;
+    /* Merging a dict into itself adds no keys, so it mustn't resize the
+     * table being walked. */
+    if (mp != other && OptDict_Reserve(mp, used) != 0)
+        return ERR_NO_MEM;
+    while ((n = next_entries(other, &pos, eps)) > 0) {
+        for (i = 0; i < n && i < dist; i++)
+            prefetch_slot(mp, mp->ma_table, eps[i]->me_hash & mp->ma_mask);
+        for (i = 0; i < n; i++) {
+            if (i + dist < n)
+                prefetch_slot(mp, mp->ma_table,
+                              eps[i + dist]->me_hash & mp->ma_mask);
+            value = OptDict_SetDefault(mp, eps[i]->me_key, eps[i]->me_hash,
+                                       VALUE_OF(other, eps[i]), &inserted);
+            if (value == NULL)
+                return ERR_NO_MEM;
+            if (inserted || policy == MERGE_KEEP)
+                continue;
+            if (combine != NULL)
+                combine(value, VALUE_OF(other, eps[i]));
+            else if (value != VALUE_OF(other, eps[i]))
+                memcpy(value, VALUE_OF(other, eps[i]), mp->ma_valsize);
+        }
+    }
+    return 0;
+}
+
+/* Match up the keys of a and b, which must be of the same type (their
+ * values needn't be).  For each key in both, store the key, its value in a
+ * and its value in b, packed, at keys, avalues and bvalues; any of these
+ * may be NULL, and each needs room for min(size of a, size of b) items.
+ * The smaller dict is walked and the larger probed, prefetching ahead, so
+ * the matches come in the smaller dict's order.  Returns the number of
+ * matches, or (size_t)-1 if the key types differ.
+ */
+    size_t
+OptDict_Join(OptDict *a, OptDict *b, void *keys, void *avalues,
+             void *bvalues)
+{
+    OptDictEntry *eps[HASH_CHUNK], *ep;
+    OptDict *small = a->ma_used <= b->ma_used ? a : b;
+    OptDict *big = small == a ? b : a;
+    char *k = keys, *av = avalues, *bv = bvalues;
+    size_t pos = 0, n, i, count = 0, dist = big->ma_prefetch;
+
+    if (!same_key_type(a, b))
+        return (size_t)-1;
+    if (small->ma_used == 0)
+        return 0;
+    if (small->ma_oldtable != NULL)
+        migrate(small, 0);
+    if (big->ma_oldtable != NULL)
+        migrate(big, 0);
+    while ((n = next_entries(small, &pos, eps)) > 0) {
+        for (i = 0; i < n && i < dist; i++)
+            prefetch_slot(big, big->ma_table, eps[i]->me_hash & big->ma_mask);
+        for (i = 0; i < n; i++) {
+            if (i + dist < n)
+                prefetch_slot(big, big->ma_table,
+                              eps[i + dist]->me_hash & big->ma_mask);
+            ep = (big->ma_lookup)(big, eps[i]->me_key, eps[i]->me_hash);
+            if (ep == NULL || !ACTIVE_ENTRY(ep))
+                continue;
+            if (k != NULL) {
+                memcpy(k, ep->me_key, big->ma_keysize);
+                k += big->ma_keysize;
+            }
+            if (av != NULL) {
+                memcpy(av, VALUE_OF(a, small == a ? eps[i] : ep), a->ma_valsize);
+                av += a->ma_valsize;
+            }
+            if (bv != NULL) {
+                memcpy(bv, VALUE_OF(b, small == b ? eps[i] : ep), b->ma_valsize);
+                bv += b->ma_valsize;
+            }
+            count++;
+        }
+    }
+    return count;
+}
         /* for (i = 0; i <= other->ma_mask; i++) { */
             /* entry = &other->ma_table[i]; */
             /* if (entry->me_value != NULL && */
@@ -1501,53 +4619,356 @@ OptDict_SetItem(register OptDict *mp, void *key, register long hash, void *value
     /* return PyDict_Copy((PyObject*)mp); */
 /* } */
 
-    /* PyObject * */
-/* PyDict_Copy(PyObject *o) */
-/* { */
-    /* PyObject *copy; */
+/*
+   Copy-on-write.  PyDict_Copy() merges the dict into a new one, which takes
+   time in proportion to its size; a program that keeps a big dict of
+   defaults and copies it to change a few items pays that every time.
+   OptDict_Copy() of a dict whose values are in the entries takes O(1)
+   time instead: the copy starts out with the very same table, and the
+   first write to either dict (through UNSHARE()) gives the writer a table
+   of its own while the other goes on with the original.  The shared table,
+   with its bitmap and pilots, and the key blocks belong to an OptDictShared
+   that is freed along with the last dict referring to it.
+
+   Keys never move once stored, so the dicts keep sharing the key blocks
+   after they've parted tables.  Each stores new keys in blocks of its own,
+   and while a dict shares keys (ma_shared isn't NULL) those it deletes
+   aren't recycled, as another dict may still have them; OptDict_Compact()
+   moves all its keys to its own blocks and ends the sharing.
+
+   Unsharing copies the table with memcpy(), except that on Linux a table
+   of at least TABLE_MAP_THRESHOLD bytes is moved to a memfd when it's first
+   shared, and unsharing maps that file again with MAP_PRIVATE.  The mapping
+   is made at once, and the kernel copies a page of it the first time the
+   dict writes there: a copy of a big dict that changes a few values pays
+   for a few pages.
+
+   ma_smalltable lives inside the OptDict, and the other value layouts keep
+   values in key storage, where they are updated in place; dicts like that
+   are copied outright.  Either way the copy is like the original in every
+   respect -- value type, frozen or perfect table, lookup cache (emptied),
+   resize step and so on -- except that it has no sampled access counts.
+   The value pointers OptDict_GetItem() and OptDict_Next() return may only
+   be read while a dict shares its table; OptDict_SetDefault() unshares it
+   before returning one.
+   */
+struct _optdict_shared {
+    size_t sh_refcnt;
+    /* Key blocks of sh_keyslot-byte slots.  Keys from before an earlier
+       copy are in sh_parent's. */
+    OptDictKeyBlock *sh_keys;
+    size_t sh_keyslot;
+    OptDictShared *sh_parent;
+    /* The table, of sh_nslots entries, allocated as sh_mapped says, and its
+       ma_occupied and ma_pilots.  sh_fd is the memfd holding the table, or
+       -1. */
+    OptDictEntry *sh_table;
+    size_t sh_nslots;
+    int sh_mapped;
+    int sh_fd;
+    uint64_t *sh_occupied;
+    unsigned int *sh_pilots;
+    size_t sh_nbuckets;
+};
+
+/* Copies may be used, and freed, on different threads. */
+#if defined(__GNUC__)
+#define SHARED_INCREF(sh) __atomic_add_fetch(&(sh)->sh_refcnt, 1, __ATOMIC_RELAXED)
+#define SHARED_DECREF(sh) __atomic_sub_fetch(&(sh)->sh_refcnt, 1, __ATOMIC_ACQ_REL)
+#define SHARED_REFCNT(sh) __atomic_load_n(&(sh)->sh_refcnt, __ATOMIC_ACQUIRE)
+#else
+#define SHARED_INCREF(sh) (++(sh)->sh_refcnt)
+#define SHARED_DECREF(sh) (--(sh)->sh_refcnt)
+#define SHARED_REFCNT(sh) ((sh)->sh_refcnt)
+#endif
 
-    /* if (o == NULL || !PyDict_Check(o)) { */
-        /* PyErr_BadInternalCall(); */
-        /* return NULL; */
-    /* } */
-    /* copy = PyDict_New(); */
-    /* if (copy == NULL) */
-        /* return NULL; */
-    /* if (PyDict_Merge(copy, o, 1) == 0) */
-        /* return copy; */
-    /* Py_DECREF(copy); */
-    /* return NULL; */
-/* } */
+/* Drop a reference to sh, freeing it (and then its parent, and so on) if
+ * it was the last.  mp is any of the dicts that shared it, for its
+ * allocator.
+ */
+    static void
+release_shared(OptDict *mp, OptDictShared *sh)
+{
+    OptDictShared *parent;
+
+    while (sh != NULL && SHARED_DECREF(sh) == 0) {
+        parent = sh->sh_parent;
+        store_free_blocks(mp, sh->sh_keys, sh->sh_keyslot);
+        table_free(mp, sh->sh_table, sh->sh_nslots, sh->sh_mapped);
+        dict_free(mp, sh->sh_occupied,
+                  OCCUPIED_WORDS(sh->sh_nslots) * sizeof(uint64_t));
+        dict_free(mp, sh->sh_pilots, sh->sh_nbuckets * sizeof(unsigned int));
+#ifdef HAVE_MEMFD
+        if (sh->sh_fd >= 0)
+            close(sh->sh_fd);
+#endif
+        dict_free(mp, sh, sizeof(OptDictShared));
+        sh = parent;
+    }
+}
 
-    /* Py_ssize_t */
-/* PyDict_Size(PyObject *mp) */
-/* { */
-    /* if (mp == NULL || !PyDict_Check(mp)) { */
-        /* PyErr_BadInternalCall(); */
-        /* return -1; */
-    /* } */
-    /* return ((OptDict *)mp)->ma_used; */
-/* } */
+#ifdef HAVE_MEMFD
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
 
-    /* PyObject * */
-/* PyDict_Keys(PyObject *mp) */
-/* { */
-    /* if (mp == NULL || !PyDict_Check(mp)) { */
-        /* PyErr_BadInternalCall(); */
-        /* return NULL; */
-    /* } */
-    /* return dict_keys((OptDict *)mp); */
-/* } */
+/* Move a big shared table to a memfd, mapped shared, so that unsharing it
+ * can map the file privately.  Failing just leaves the table where it is.
+ */
+    static void
+table_to_memfd(OptDict *mp, OptDictShared *sh)
+{
+    size_t nbytes = sh->sh_nslots * sizeof(OptDictEntry);
+    size_t length = TABLE_MAP_LENGTH(nbytes);
+    void *p;
+    int fd;
+
+    if (nbytes < TABLE_MAP_THRESHOLD)
+        return;
+    fd = (int)syscall(SYS_memfd_create, "optdict", MFD_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (ftruncate(fd, (off_t)length) != 0
+            || (p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    memcpy(p, sh->sh_table, nbytes);
+    table_free(mp, sh->sh_table, sh->sh_nslots, sh->sh_mapped);
+    clear_cache(mp);
+    sh->sh_table = mp->ma_table = p;
+    sh->sh_mapped = mp->ma_tablemapped = 1;
+    sh->sh_fd = fd;
+}
+#endif
 
-    /* PyObject * */
-/* PyDict_Values(PyObject *mp) */
-/* { */
-    /* if (mp == NULL || !PyDict_Check(mp)) { */
-        /* PyErr_BadInternalCall(); */
-        /* return NULL; */
-    /* } */
-    /* return dict_values((OptDict *)mp); */
-/* } */
+/* Hand mp's table and key blocks over to a new OptDictShared, for a copy to
+ * share.  mp goes on using them, and stores new keys in fresh blocks.
+ */
+    static int
+share_table(OptDict *mp)
+{
+    OptDictShared *sh = dict_alloc(mp, sizeof(OptDictShared));
+
+    if (sh == NULL)
+        return ERR_NO_MEM;
+    sh->sh_refcnt = 1;
+    sh->sh_keys = mp->ma_keys.st_blocks;
+    sh->sh_keyslot = mp->ma_keys.st_slot;
+    sh->sh_parent = mp->ma_shared;
+    sh->sh_table = mp->ma_table;
+    sh->sh_nslots = mp->ma_mask + 1;
+    sh->sh_mapped = mp->ma_tablemapped;
+    sh->sh_fd = -1;
+    sh->sh_occupied = mp->ma_occupied;
+    sh->sh_pilots = mp->ma_pilots;
+    sh->sh_nbuckets = mp->ma_nbuckets;
+#ifdef HAVE_MEMFD
+    table_to_memfd(mp, sh);
+#endif
+    store_init(&mp->ma_keys, mp->ma_keys.st_size);
+    mp->ma_shared = sh;
+    mp->ma_tableshared = 1;
+    return 0;
+}
+
+/* Give mp a private copy of the table it shares, or if no other dict shares
+ * it any more, take the table and key blocks back.  Returns 0, or ERR_NO_MEM
+ * and leaves mp sharing.
+ */
+    static int
+unshare_table(OptDict *mp)
+{
+    OptDictShared *sh = mp->ma_shared;
+    size_t nslots = mp->ma_mask + 1;
+    OptDictEntry *table;
+    OptDictKeyBlock **kbp;
+    uint64_t *occupied = NULL;
+    unsigned int *pilots = NULL;
+    int mapped = 0;
+
+    assert(mp->ma_tableshared && mp->ma_table == sh->sh_table);
+    if (SHARED_REFCNT(sh) == 1) {
+        for (kbp = &mp->ma_keys.st_blocks; *kbp != NULL; kbp = &(*kbp)->kb_next)
+            ;
+        *kbp = sh->sh_keys;
+        mp->ma_tablemapped = sh->sh_mapped;
+        mp->ma_shared = sh->sh_parent;
+        mp->ma_tableshared = 0;
+#ifdef HAVE_MEMFD
+        if (sh->sh_fd >= 0)
+            close(sh->sh_fd);
+#endif
+        dict_free(mp, sh, sizeof(OptDictShared));
+        return 0;
+    }
+#ifdef HAVE_MEMFD
+    if (sh->sh_fd >= 0) {
+        table = mmap(NULL, TABLE_MAP_LENGTH(nslots * sizeof(OptDictEntry)),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE, sh->sh_fd, 0);
+        if (table == MAP_FAILED)
+            return ERR_NO_MEM;
+        mapped = 1;
+    }
+    else
+#endif
+    {
+        table = table_alloc(mp, nslots, &mapped);
+        if (table == NULL)
+            return ERR_NO_MEM;
+        memcpy(table, mp->ma_table, nslots * sizeof(OptDictEntry));
+    }
+    if (mp->ma_occupied != NULL) {
+        occupied = dict_alloc(mp, OCCUPIED_WORDS(nslots) * sizeof(uint64_t));
+        if (occupied == NULL)
+            goto fail;
+        memcpy(occupied, mp->ma_occupied,
+               OCCUPIED_WORDS(nslots) * sizeof(uint64_t));
+    }
+    if (mp->ma_pilots != NULL) {
+        pilots = dict_alloc(mp, mp->ma_nbuckets * sizeof(unsigned int));
+        if (pilots == NULL)
+            goto fail;
+        memcpy(pilots, mp->ma_pilots, mp->ma_nbuckets * sizeof(unsigned int));
+    }
+    clear_cache(mp);
+    mp->ma_table = table;
+    mp->ma_tablemapped = mapped;
+    mp->ma_occupied = occupied;
+    mp->ma_pilots = pilots;
+    mp->ma_tableshared = 0;
+    return 0;
+fail:
+    table_free(mp, table, nslots, mapped);
+    dict_free(mp, occupied, OCCUPIED_WORDS(nslots) * sizeof(uint64_t));
+    return ERR_NO_MEM;
+}
+
+/* Return a copy of mp, or NULL if out of memory: in O(1) time if mp's
+ * values are in its entries and its table isn't ma_smalltable.  A resize in
+ * progress is finished first.
+ */
+    OptDict *
+OptDict_Copy(OptDict *mp)
+{
+    OptDict *np;
+    size_t nslots;
+
+    if (mp->ma_oldtable != NULL)
+        migrate(mp, 0);
+    nslots = mp->ma_mask + 1;
+    if (!mp->ma_tableshared && mp->ma_table != mp->ma_smalltable
+            && mp->ma_vallayout == VALUES_IN_ENTRIES && share_table(mp) != 0)
+        return NULL;
+    np = dict_alloc(mp, sizeof(OptDict));
+    if (np == NULL)
+        return NULL;
+    memcpy(np, mp, sizeof(OptDict));
+    np->ma_counts = NULL;
+    np->ma_cachehits = np->ma_cachemisses = 0;
+    np->ma_filter = NULL;
+    np->ma_filtermem = NULL;
+    clear_cache(np);
+    store_init(&np->ma_keys, mp->ma_keys.st_size);
+    store_init(&np->ma_values, mp->ma_values.st_size);
+    if (mp->ma_tableshared) {
+        SHARED_INCREF(mp->ma_shared);
+        if (copy_bloom(np, mp) != 0)
+            goto fail;
+        return np;
+    }
+
+    /* Copy the table and every key (and value kept apart) outright. */
+    np->ma_shared = NULL;
+    np->ma_occupied = NULL;
+    np->ma_pilots = NULL;
+    if (mp->ma_table == mp->ma_smalltable)
+        np->ma_table = np->ma_smalltable;
+    else {
+        np->ma_table = table_alloc(np, nslots, &np->ma_tablemapped);
+        if (np->ma_table == NULL)
+            goto fail;
+        memcpy(np->ma_table, mp->ma_table, nslots * sizeof(OptDictEntry));
+    }
+    if (mp->ma_occupied != NULL) {
+        np->ma_occupied = dict_alloc(np, OCCUPIED_WORDS(nslots)
+                                         * sizeof(uint64_t));
+        if (np->ma_occupied == NULL)
+            goto fail;
+        memcpy(np->ma_occupied, mp->ma_occupied,
+               OCCUPIED_WORDS(nslots) * sizeof(uint64_t));
+    }
+    if (mp->ma_pilots != NULL) {
+        np->ma_pilots = dict_alloc(np, mp->ma_nbuckets * sizeof(unsigned int));
+        if (np->ma_pilots == NULL)
+            goto fail;
+        memcpy(np->ma_pilots, mp->ma_pilots,
+               mp->ma_nbuckets * sizeof(unsigned int));
+    }
+    if (repack_store(np, &np->ma_keys, offsetof(OptDictEntry, me_key)) != 0
+            || (np->ma_vallayout == VALUES_SEPARATE
+                && repack_store(np, &np->ma_values,
+                                offsetof(OptDictEntry, me_value.v_ptr)) != 0)
+            || copy_bloom(np, mp) != 0)
+        goto fail;
+    return np;
+fail:
+    OptDict_Dealloc(np);
+    return NULL;
+}
+
+    size_t
+OptDict_Size(OptDict *mp)
+{
+    return mp->ma_used;
+}
+
+/* Copy the key (value) of ep into out and return where the next one goes. */
+    static char *
+gather_entry(OptDict *mp, OptDictEntry *ep, char *out, int values)
+{
+    if (values) {
+        memcpy(out, VALUE_OF(mp, ep), mp->ma_valsize);
+        return out + mp->ma_valsize;
+    }
+    memcpy(out, ep->me_key, mp->ma_keysize);
+    return out + mp->ma_keysize;
+}
+
+    static size_t
+gather(OptDict *mp, char *out, int values)
+{
+    char *end = out;
+    size_t i;
+
+    for (i = next_active(mp, 0); i <= mp->ma_mask; i = next_active(mp, i + 1))
+        end = gather_entry(mp, &mp->ma_table[i], end, values);
+    if (mp->ma_oldtable != NULL)
+        for (i = 0; i <= mp->ma_oldmask; i++)
+            if (ACTIVE_ENTRY(&mp->ma_oldtable[i]))
+                end = gather_entry(mp, &mp->ma_oldtable[i], end, values);
+    assert((size_t)(end - out) == mp->ma_used * (values ? mp->ma_valsize
+                                                        : mp->ma_keysize));
+    return mp->ma_used;
+}
+
+/* Copy every key into out, packed (ma_keysize bytes apiece); out must have
+ * room for OptDict_Size(mp) keys.  OptDict_Values() does the same for the
+ * values (ma_valsize bytes apiece), in the same order as long as the dict
+ * isn't changed in between.  Both return the number copied.
+ */
+    size_t
+OptDict_Keys(OptDict *mp, void *out)
+{
+    return gather(mp, out, 0);
+}
+
+    size_t
+OptDict_Values(OptDict *mp, void *out)
+{
+    return gather(mp, out, 1);
+}
 
     /* PyObject * */
 /* PyDict_Items(PyObject *mp) */
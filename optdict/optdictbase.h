@@ -4,17 +4,155 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 #define optdict_MINSIZE 8
+#define optdict_CACHESIZE 4
 #define ERR_NO_MEM -1
+#define ERR_FROZEN -2
+#define ERR_NO_KEY -3
+#define ERR_KEY_TYPE -4
+#define ERR_VALUE_TYPE -5
+#define ERR_NOT_SORTED -6
+
+/* Table allocation options, for OptDict_SetTableAlloc(). */
+#define OPTDICT_TABLE_MMAP 1        /* big tables get fresh mappings */
+#define OPTDICT_TABLE_HUGETLB 2     /* ... of reserved huge pages if possible */
+#define OPTDICT_TABLE_THP 4         /* ... or of transparent huge pages */
+#define OPTDICT_TABLE_INTERLEAVE 8  /* ... interleaved over the NUMA nodes */
+#define OPTDICT_TABLE_BIND 16       /* ... or on one NUMA node */
+
+/* By default values are stored in the entry itself, not pointed to.  A
+ * dict's values are all the same width, at most sizeof(OptDictValue); use
+ * whichever member matches what the dict holds.  OptDict_SetValueType()
+ * gives a dict values of another type, possibly stored elsewhere.
+ */
+typedef union {
+    void *v_ptr;
+    long v_long;
+    double v_double;
+} OptDictValue;
 
 typedef struct {
     /* Cached hash code of me_key.  Note that hash codes are C longs.
      */
     long me_hash;
+    /* me_key points to the dict's own copy of the key (see ma_keys
+     * below), to dummy for a deleted entry, or is NULL for an unused one.
+     */
     void *me_key;
-    void *me_value;
+    OptDictValue me_value;
 } OptDictEntry;
 
+/* Keys are copied into blocks owned by the dict, so the caller's key storage
+ * can be reused as soon as OptDict_SetItem() returns and entries can point at
+ * keys that never move, even when the table is resized.
+ */
+typedef struct _optdict_keyblock OptDictKeyBlock;
+struct _optdict_keyblock {
+    OptDictKeyBlock *kb_next;
+    size_t kb_nslots;
+    /* kb_nslots key slots follow */
+};
+
+/* A store of fixed-size items in such blocks: the keys, and the values if
+ * they're kept apart from the table (VALUES_SEPARATE).  st_slot is the item
+ * size st_size rounded up so that a free slot can hold the link of the
+ * st_free list.  New items go into a recycled slot from st_free if there is
+ * one, else are carved from the st_left slots starting at st_next in the
+ * newest block.
+ */
+typedef struct {
+    size_t st_size;
+    size_t st_slot;
+    OptDictKeyBlock *st_blocks;
+    char *st_next;
+    size_t st_left;
+    void *st_free;
+} OptDictStore;
+
+/* The type of a dict's values, for OptDict_SetValueType(): vt_size bytes
+ * aligned to vt_align, which must be a power of 2 no bigger than that of a
+ * double or a pointer.  vt_format is the buffer-protocol format of one value,
+ * or NULL for an opaque struct.
+ */
+typedef struct {
+    size_t vt_size;
+    size_t vt_align;
+    const char *vt_format;
+} OptDictValueType;
+
+extern const OptDictValueType OptDict_Int8, OptDict_UInt8;
+extern const OptDictValueType OptDict_Int16, OptDict_UInt16;
+extern const OptDictValueType OptDict_Int32, OptDict_UInt32;
+extern const OptDictValueType OptDict_Int64, OptDict_UInt64;
+extern const OptDictValueType OptDict_Float32, OptDict_Float64;
+extern const OptDictValueType OptDict_Complex64, OptDict_Complex128;
+
+enum key_t {
+    INT_KEY,
+    FLOAT_KEY,
+    DOUBLE_KEY,
+    BYTES_KEY
+};
+
+/* Where the values are kept.  VALUES_IN_ENTRIES, the default, stores them in
+ * the entries' me_value, so they're at most sizeof(OptDictValue) bytes.
+ * VALUES_WITH_KEYS puts each right after its key in the key storage (array
+ * of structs: one cache line holds both), and VALUES_SEPARATE in a store of
+ * their own, me_value.v_ptr pointing at the value (struct of arrays: values
+ * are packed with nothing between them).
+ */
+enum value_layout {
+    VALUES_IN_ENTRIES,
+    VALUES_WITH_KEYS,
+    VALUES_SEPARATE
+};
+
+/* Reductions over a dict's values, for OptDict_ReduceLong() and
+ * OptDict_ReduceDouble(). */
+enum reduce_op {
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX
+};
+
+/* What OptDict_Merge() does with a key in both dicts. */
+enum merge_policy {
+    MERGE_OVERWRITE,
+    MERGE_KEEP,
+    MERGE_SUM,
+    MERGE_MIN,
+    MERGE_MAX,
+    MERGE_SUM_DOUBLE,
+    MERGE_MIN_DOUBLE,
+    MERGE_MAX_DOUBLE
+};
+
+/* Called with each key and value by OptDict_ParallelForEach() and the other
+ * parallel scans; arg is the caller's, or its thread's share of it. */
+typedef int (*OptDictVisitFunc)(void *key, void *value, void *arg);
+
+/* Where a dict gets its memory (see OptDict_NewEx()).  Each function is
+ * passed ctx.  free and realloc are given the size the block was allocated
+ * with.
+ */
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *p, size_t oldsize, size_t newsize);
+    void (*free)(void *ctx, void *p, size_t size);
+    void *ctx;
+} OptDictAllocator;
+
+/* Per-thread free lists of small blocks, for short-lived dicts. */
+extern const OptDictAllocator OptDict_Pool;
+void OptDict_PoolClear(void);
+
+/* What a dict and its copies share until they write to it (see
+ * OptDict_Copy()); private to optdictbase.c.
+ */
+typedef struct _optdict_shared OptDictShared;
+
 /*
 To ensure the lookup algorithm terminates, there must be at least one Unused
 slot (NULL key) in the table.
@@ -42,17 +180,131 @@ struct _optdict{
      */
     OptDictEntry *ma_table;
     OptDictEntry *(*ma_lookup)(OptDict *mp, void *key, long hash);
-    int (*eqfunc)(void *, void *);
+    /* Both are passed ma_keysize. */
+    int (*eqfunc)(void *, void *, size_t);
+    long (*hashfunc)(void *, size_t);
+    OptDictAllocator ma_allocator;
+
+    /* Key storage; see OptDictStore.  ma_keys.st_size is ma_keysize, or
+     * ma_valoffset + ma_valsize for VALUES_WITH_KEYS.
+     */
+    enum key_t ma_keytype;
+    size_t ma_keysize;
+    OptDictStore ma_keys;
+
+    /* Values (OptDict_SetValueType()): ma_valsize bytes of type ma_valtype
+     * (NULL for the OptDictValue default), laid out as ma_vallayout says.
+     * Use VALUE_OF() to find an active entry's value.
+     */
+    size_t ma_valsize;
+    const OptDictValueType *ma_valtype;
+    enum value_layout ma_vallayout;
+    size_t ma_valoffset;
+    OptDictStore ma_values;
+
+    /* Lookup cache (see OptDict_EnableCache()).  While it's on, ma_lookup is
+     * lookdict_cached() and ma_uncachedlookup is the lookup it wraps.
+     */
+    size_t ma_ncache;
+    size_t ma_cachenext;
+    OptDictEntry *ma_cache[optdict_CACHESIZE];
+    OptDictEntry *(*ma_uncachedlookup)(OptDict *mp, void *key, long hash);
+    size_t ma_cachehits;
+    size_t ma_cachemisses;
+
+    /* Filter in front of lookups (see OptDict_EnableFilter()), or NULL:
+     * ma_filtermask + 1 blocks of a cache line each, aligned within
+     * ma_filtermem.  ma_filterkeys keys have gone in since it was built,
+     * for room for ma_filtercap.
+     */
+    uint64_t *ma_filter;
+    void *ma_filtermem;
+    size_t ma_filtermask;
+    size_t ma_filterkeys;
+    size_t ma_filtercap;
+
+    /* Set by OptDict_Freeze().  While ma_counts isn't NULL, one of every
+     * ma_sampleperiod successful lookups adds 1 to ma_counts[slot].
+     */
+    int ma_frozen;
+    size_t *ma_counts;
+    size_t ma_sampleperiod;
+    size_t ma_sampletick;
+
+    /* Set by OptDict_CompilePerfect(): the perfect hash's per-bucket pilots
+     * and seed.  ma_table then has exactly ma_used entries (and ma_mask is
+     * one less, though not a mask).
+     */
+    unsigned int *ma_pilots;
+    size_t ma_nbuckets;
+    uint64_t ma_seed;
+
+    /* Incremental resizing (see OptDict_SetResizeStep()).  While a resize
+     * is in progress, ma_oldtable is the previous table, of ma_oldmask + 1
+     * slots, whose entries below slot ma_migrated have been moved to
+     * ma_table.  ma_used counts the active entries of both tables, ma_fill
+     * only those of ma_table.
+     */
+    size_t ma_resizestep;
+    OptDictEntry *ma_oldtable;
+    size_t ma_oldmask;
+    size_t ma_migrated;
+
+    /* How tables are allocated (OptDict_SetTableAlloc()), and whether
+     * ma_table and ma_oldtable are mappings rather than from calloc().
+     */
+    int ma_tableflags;
+    int ma_numanode;
+    int ma_tablemapped;
+    int ma_oldtablemapped;
+
+    /* Shrink policy (OptDict_SetShrinkPolicy()), as fractions of the table
+     * size; 0 if off.
+     */
+    double ma_maxdummies;
+    double ma_minfill;
+
+    /* Prefetch distance of OptDict_SetMany(). */
+    size_t ma_prefetch;
+
+    /* One bit per slot of ma_table, set if the slot is active, or NULL for
+     * a small or perfect table.  See OptDict_Next().
+     */
+    uint64_t *ma_occupied;
+
+    /* Copy-on-write (OptDict_Copy()).  While ma_shared isn't NULL some of
+     * the dict's keys are in blocks it shares with copies, and while
+     * ma_tableshared is set so are ma_table, ma_occupied and ma_pilots.
+     */
+    OptDictShared *ma_shared;
+    int ma_tableshared;
+
+    /* While ma_small is set, the table is ma_smalltable packed densely in
+     * insertion order, and ma_smalltags[i] holds the low 32 bits of
+     * ma_smalltable[i].me_hash, for lookdict_small().  The first resize
+     * clears it for good.
+     */
+    int ma_small;
+    int ma_smalltags[optdict_MINSIZE];
     OptDictEntry ma_smalltable[optdict_MINSIZE];
 };
 
-enum key_t {
-    INT_KEY,
-    FLOAT_KEY,
-    DOUBLE_KEY
-};
+/* Address of the value of active entry ep. */
+#define VALUE_OF(mp, ep)                                                  \
+    ((mp)->ma_vallayout == VALUES_IN_ENTRIES ? (void *)&(ep)->me_value   \
+     : (mp)->ma_vallayout == VALUES_WITH_KEYS                             \
+         ? (void *)((char *)(ep)->me_key + (mp)->ma_valoffset)            \
+         : (ep)->me_value.v_ptr)
 
 long int_hash(int);
+long float_hash(float);
+long double_hash(double);
+long bytes_hash(const void *, size_t);
+void int_hash_array(const int *keys, size_t n, long *hashes);
+void float_hash_array(const float *keys, size_t n, long *hashes);
+void double_hash_array(const double *keys, size_t n, long *hashes);
+void bytes_hash_array(const void *keys, size_t keysize, size_t n,
+                      long *hashes);
 
 /* [> PyAPI_DATA(PyTypeObject) PyDict_Type; <] */
 /* [> PyAPI_DATA(PyTypeObject) PyDictIterKey_Type; <] */
@@ -73,36 +325,84 @@ long int_hash(int);
     /* [> (PyDictKeys_Check(op) || PyDictItems_Check(op)) <] */
 
 OptDict *OptDict_New(enum key_t);
-/* PyObject *OptDict_GetItem(OptDictObject *mp, void *key); */
-/* int OptDict_SetItem(OptDictObject *mp, void *key, void *item); */
-/* int OptDict_DelItem(OptDictObject *mp, void *key); */
+OptDict *OptDict_NewBytes(size_t keysize);
+OptDict *OptDict_NewEx(enum key_t, size_t keysize,
+                       const OptDictAllocator *allocator);
+void OptDict_Dealloc(OptDict *mp);
+void *OptDict_GetItem(OptDict *mp, void *key, long hash);
+int OptDict_SetItem(OptDict *mp, void *key, long hash, void *value);
+void *OptDict_SetDefault(OptDict *mp, void *key, long hash, void *defaultvalue,
+                         int *inserted);
+int OptDict_Increment(OptDict *mp, void *key, long hash, long delta);
+int OptDict_AddDouble(OptDict *mp, void *key, long hash, double delta);
+int OptDict_MinLong(OptDict *mp, void *key, long hash, long x);
+int OptDict_MaxLong(OptDict *mp, void *key, long hash, long x);
+int OptDict_MinDouble(OptDict *mp, void *key, long hash, double x);
+int OptDict_MaxDouble(OptDict *mp, void *key, long hash, double x);
+int OptDict_CountArray(OptDict *mp, void *keys, size_t n);
+void OptDict_HashArray(OptDict *mp, const void *keys, size_t n, long *hashes);
+int OptDict_SetMany(OptDict *mp, const void *keys, const void *values,
+                    size_t n);
+void OptDict_SetPrefetch(OptDict *mp, size_t distance);
+int OptDict_Reserve(OptDict *mp, size_t n);
+int OptDict_Factorize(OptDict *mp, const void *keys, size_t n, long *groups);
+void OptDict_GetMany(OptDict *mp, const void *keys, size_t n, void **values);
+int OptDict_DelItem(OptDict *mp, void *key, long hash);
+int OptDict_Pop(OptDict *mp, void *key, long hash, void *oldvalue);
 /* void OptDict_Clear(OptDictObject *mp); */
-/* size_t OptDict_Size(OptDictObject *mp); */
+size_t OptDict_Size(OptDict *mp);
+int OptDict_EnableCache(OptDict *mp, size_t nways);
+void OptDict_CacheStats(OptDict *mp, size_t *hits, size_t *misses);
+int OptDict_EnableFilter(OptDict *mp, int enable);
+int OptDict_Freeze(OptDict *mp);
+int OptDict_SampleAccesses(OptDict *mp, size_t period);
+int OptDict_Optimize(OptDict *mp, const size_t *access_counts);
+size_t OptDict_Probes(OptDict *mp, void *key, long hash);
+int OptDict_CompilePerfect(OptDict *mp);
+void OptDict_SetResizeStep(OptDict *mp, size_t step);
+void OptDict_FinishResize(OptDict *mp);
+int OptDict_SetTableAlloc(OptDict *mp, int flags, int node);
+int OptDict_Compact(OptDict *mp);
+int OptDict_SetShrinkPolicy(OptDict *mp, double maxdummies, double minfill);
+int OptDict_SetValueType(OptDict *mp, const OptDictValueType *vt,
+                         enum value_layout layout);
 /* int OptDict_Contains(OptDictObject *mp, void *key); */
 /* int _OptDict_Contains(OptDictObject *mp, void *key, long hash); */
-/* OptDictObject * _PyDict_NewPresized(Py_ssize_t minused); */
-
-/* [> PyAPI_FUNC(int) PyDict_Next( <] */
-    /* [> PyObject *mp, Py_ssize_t *pos, PyObject **key, PyObject **value); <] */
-/* [> PyAPI_FUNC(int) _PyDict_Next( <] */
-    /* [> PyObject *mp, Py_ssize_t *pos, PyObject **key, PyObject **value, long *hash); <] */
-/* [> PyAPI_FUNC(PyObject *) PyDict_Keys(PyObject *mp); <] */
-/* [> PyAPI_FUNC(PyObject *) PyDict_Values(PyObject *mp); <] */
+
+int OptDict_Next(OptDict *mp, size_t *ppos, void **pkey, void **pvalue);
+size_t OptDict_NextBlock(OptDict *mp, size_t *ppos, void *keys, void *values,
+                         size_t max);
+size_t OptDict_Keys(OptDict *mp, void *out);
+size_t OptDict_Values(OptDict *mp, void *out);
+size_t OptDict_Partition(OptDict *mp, size_t nparts, size_t *bounds);
+int OptDict_NextInRange(OptDict *mp, size_t *ppos, size_t end, void **pkey,
+                        void **pvalue);
+size_t OptDict_ScanThreads(OptDict *mp, size_t nthreads);
+int OptDict_ParallelForEach(OptDict *mp, size_t nthreads, OptDictVisitFunc func,
+                            void *args, size_t argsize);
+int OptDict_ReduceLong(OptDict *mp, enum reduce_op op, size_t nthreads,
+                       long *result);
+int OptDict_ReduceDouble(OptDict *mp, enum reduce_op op, size_t nthreads,
+                         double *result);
+size_t OptDict_ParallelCount(OptDict *mp, size_t nthreads,
+                             OptDictVisitFunc pred, void *arg);
+OptDict *OptDict_ParallelFilter(OptDict *mp, size_t nthreads,
+                                OptDictVisitFunc pred, void *arg);
 /* [> PyAPI_FUNC(PyObject *) PyDict_Items(PyObject *mp); <] */
 /* [> PyAPI_FUNC(PyObject *) PyDict_Copy(PyObject *mp); <] */
+OptDict *OptDict_Copy(OptDict *mp);
 /* [> PyAPI_FUNC(void) _PyDict_MaybeUntrack(PyObject *mp); <] */
 
 /* [> PyDict_Update(mp, other) is equivalent to PyDict_Merge(mp, other, 1). <] */
 /* [> PyAPI_FUNC(int) PyDict_Update(PyObject *mp, PyObject *other); <] */
 
-/* PyDict_Merge updates/merges from a mapping object (an object that
-   supports PyMapping_Keys() and PyObject_GetItem()).  If override is true,
-   the last occurrence of a key wins, else the first.  The Python
-   dict.update(other) is equivalent to PyDict_Merge(dict, other, 1).
+/* OptDict_Merge() merges the items of one dict into another of the same
+   key and value types; policy says which value a key in both ends up
+   with.  OptDict_Join() pairs up the values of the keys two dicts share.
 */
-/* [> PyAPI_FUNC(int) PyDict_Merge(PyObject *mp, <] */
-                                   /* [> PyObject *other, <] */
-                                   /* [> int override); <] */
+int OptDict_Merge(OptDict *mp, OptDict *other, enum merge_policy policy);
+size_t OptDict_Join(OptDict *a, OptDict *b, void *keys, void *avalues,
+                    void *bvalues);
 
 /* PyDict_MergeFromSeq2 updates/merges from an iterable object producing
    iterable objects of length 2.  If override is true, the last occurrence
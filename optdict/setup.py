@@ -4,5 +4,8 @@ from Cython.Distutils import build_ext
 
 setup(
     cmdclass = {'build_ext': build_ext},
-    ext_modules = [Extension("optdict", ["optdict.pyx", "optdictbase.c"])]
+    ext_modules = [Extension("optdict", ["optdict.pyx", "optdictbase.c",
+                                        "typedlistbase.c", "multidictbase.c",
+                                        "hamtbase.c", "sorteddictbase.c"],
+                             libraries = ["m", "pthread"])]
 )
@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "sorteddictbase.h"
+
+/*
+   Nodes.  A node holds sn_n keys in order, then, for a leaf, their values,
+   or, for an inner node, sn_n + 1 children: child i holds the keys from
+   key i-1 (inclusive) up to key i.  The keys of an inner node are the least
+   keys of its children's subtrees when they were split off (deletions may
+   since have left them below every key there, which does no harm).  Nodes
+   have room for one key and child more than sd_cap, so an insertion always
+   goes in first, and a node over sd_cap then splits in two.  Whether a node
+   is a leaf is known from its depth.
+   */
+
+struct _sorted_node {
+    size_t sn_n;
+    OptSortedNode *sn_next;     /* leaves: the next leaf in key order */
+};
+
+#define NODE_ALIGN (sizeof(double) > sizeof(void *) ? sizeof(double)     \
+                                                    : sizeof(void *))
+#define ROUND_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+#define NODE_HEADER ROUND_UP(sizeof(OptSortedNode), NODE_ALIGN)
+
+#define KEYS(node) ((char *)(node) + NODE_HEADER)
+#define KEY(sd, node, i) (KEYS(node) + (i) * (sd)->sd_keysize)
+#define VALUE(sd, node, i)                                                \
+    (KEYS(node) + (sd)->sd_keybytes + (i) * (sd)->sd_valsize)
+#define CHILDREN(sd, node) ((OptSortedNode **)(KEYS(node) + (sd)->sd_keybytes))
+
+    static int
+cmpint(const void *a, const void *b, size_t size)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+    static int
+cmpfloat(const void *a, const void *b, size_t size)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+    static int
+cmpdouble(const void *a, const void *b, size_t size)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+    static int
+cmpbytes(const void *a, const void *b, size_t size)
+{
+    return memcmp(a, b, size);
+}
+
+    static OptSortedNode *
+node_new(OptSortedDict *sd, int leaf)
+{
+    OptSortedNode *node = malloc(NODE_HEADER + sd->sd_keybytes
+                                 + (leaf ? (sd->sd_cap + 1) * sd->sd_valsize
+                                         : (sd->sd_cap + 2)
+                                           * sizeof(OptSortedNode *)));
+
+    if (node == NULL)
+        return NULL;
+    node->sn_n = 0;
+    node->sn_next = NULL;
+    return node;
+}
+
+/* Free node and, unless it's a leaf (depth 0), its subtree. */
+    static void
+node_free(OptSortedDict *sd, OptSortedNode *node, size_t depth)
+{
+    size_t i;
+
+    if (depth > 0)
+        for (i = 0; i <= node->sn_n; i++)
+            node_free(sd, CHILDREN(sd, node)[i], depth - 1);
+    free(node);
+}
+
+/* The index of the first of node's keys >= key (> key if `upper`).  The
+ * numeric key types compare inline rather than through sd_cmpfunc, in a
+ * binary search whose steps compile to conditional moves rather than
+ * branches the CPU would mispredict half the time.
+ */
+#define SEARCH_NUMERIC(type)                                              \
+    do {                                                                  \
+        const type *keys = (const type *)KEYS(node), *base = keys;        \
+        type x = *(const type *)key;                                      \
+        size_t n = node->sn_n, half;                                      \
+        if (n == 0)                                                       \
+            return 0;                                                     \
+        while (n > 1) {                                                   \
+            half = n / 2;                                                 \
+            base = (upper ? base[half - 1] <= x : base[half - 1] < x)     \
+                   ? base + half : base;                                  \
+            n -= half;                                                    \
+        }                                                                 \
+        return (size_t)(base - keys)                                      \
+               + (upper ? *base <= x : *base < x);                        \
+    } while (0)
+
+    static size_t
+search(OptSortedDict *sd, OptSortedNode *node, const void *key, int upper)
+{
+    size_t lo = 0, hi = node->sn_n, mid;
+    int c;
+
+    switch (sd->sd_keytype) {
+        case INT_KEY:
+            SEARCH_NUMERIC(int);
+        case FLOAT_KEY:
+            SEARCH_NUMERIC(float);
+        case DOUBLE_KEY:
+            SEARCH_NUMERIC(double);
+        default:
+            break;
+    }
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        c = sd->sd_cmpfunc(KEY(sd, node, mid), key, sd->sd_keysize);
+        if (c < 0 || (upper && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* The leaf where key is or would go. */
+    static OptSortedNode *
+find_leaf(OptSortedDict *sd, const void *key)
+{
+    OptSortedNode *node = sd->sd_root;
+    size_t depth;
+
+    for (depth = sd->sd_depth; depth > 0; depth--)
+        node = CHILDREN(sd, node)[search(sd, node, key, 1)];
+    return node;
+}
+
+/* keysize is the width of BYTES_KEY keys, and is ignored for the other key
+ * types.  vt is the type of the values, or NULL for OptDictValues.
+ */
+    OptSortedDict *
+OptSortedDict_New(enum key_t key_type, size_t keysize,
+                  const OptDictValueType *vt)
+{
+    OptSortedDict *sd;
+
+    if (key_type == BYTES_KEY && keysize == 0)
+        return NULL;
+    sd = malloc(sizeof(OptSortedDict));
+    if (sd == NULL)
+        return NULL;
+    sd->sd_keytype = key_type;
+    switch(key_type) {
+        case INT_KEY:
+            sd->sd_cmpfunc = cmpint;
+            sd->sd_keysize = sizeof(int);
+            break;
+        case FLOAT_KEY:
+            sd->sd_cmpfunc = cmpfloat;
+            sd->sd_keysize = sizeof(float);
+            break;
+        case DOUBLE_KEY:
+            sd->sd_cmpfunc = cmpdouble;
+            sd->sd_keysize = sizeof(double);
+            break;
+        case BYTES_KEY:
+            sd->sd_cmpfunc = cmpbytes;
+            sd->sd_keysize = keysize;
+            break;
+        default:
+            free(sd);
+            return NULL;
+    }
+    sd->sd_valtype = vt;
+    sd->sd_valsize = vt != NULL ? vt->vt_size : sizeof(OptDictValue);
+    sd->sd_cap = OPTSORTED_NODEBYTES / sd->sd_keysize;
+    if (sd->sd_cap < 4)
+        sd->sd_cap = 4;
+    sd->sd_keybytes = ROUND_UP((sd->sd_cap + 1) * sd->sd_keysize, NODE_ALIGN);
+    sd->sd_size = 0;
+    sd->sd_depth = 0;
+    sd->sd_sep = malloc(sd->sd_keysize);
+    sd->sd_root = node_new(sd, 1);
+    if (sd->sd_sep == NULL || sd->sd_root == NULL) {
+        free(sd->sd_sep);
+        free(sd->sd_root);
+        free(sd);
+        return NULL;
+    }
+    return sd;
+}
+
+    void
+OptSortedDict_Dealloc(OptSortedDict *sd)
+{
+    if (sd == NULL)
+        return;
+    node_free(sd, sd->sd_root, sd->sd_depth);
+    free(sd->sd_sep);
+    free(sd);
+}
+
+/* Return a pointer to key's value, or NULL if key isn't present. */
+    void *
+OptSortedDict_GetItem(OptSortedDict *sd, const void *key)
+{
+    OptSortedNode *leaf = find_leaf(sd, key);
+    size_t i = search(sd, leaf, key, 0);
+
+    if (i < leaf->sn_n
+        && sd->sd_cmpfunc(KEY(sd, leaf, i), key, sd->sd_keysize) == 0)
+        return VALUE(sd, leaf, i);
+    return NULL;
+}
+
+/* Insert key and value into the subtree at node, depth levels above the
+ * leaves, or replace key's value.  If node splits, set *right to its new
+ * right half and *sep to the least key there (good until the next split).
+ * Returns 0, or ERR_NO_MEM with the tree unchanged: every node a split
+ * needs is allocated before anything moves.
+ */
+    static int
+node_insert(OptSortedDict *sd, OptSortedNode *node, size_t depth,
+            const void *key, const void *value, OptSortedNode **right,
+            const void **sep)
+{
+    size_t ks = sd->sd_keysize, vs = sd->sd_valsize;
+    size_t i, n = node->sn_n, mid;
+    OptSortedNode *child_right = NULL, *r = NULL;
+    const void *child_sep;
+    int err;
+
+    *right = NULL;
+    if (depth == 0) {
+        i = search(sd, node, key, 0);
+        if (i < n && sd->sd_cmpfunc(KEY(sd, node, i), key, ks) == 0) {
+            memcpy(VALUE(sd, node, i), value, vs);
+            return 0;
+        }
+        if (n == sd->sd_cap) {
+            r = node_new(sd, 1);
+            if (r == NULL)
+                return ERR_NO_MEM;
+        }
+        memmove(KEY(sd, node, i + 1), KEY(sd, node, i), (n - i) * ks);
+        memmove(VALUE(sd, node, i + 1), VALUE(sd, node, i), (n - i) * vs);
+        memcpy(KEY(sd, node, i), key, ks);
+        memcpy(VALUE(sd, node, i), value, vs);
+        node->sn_n = ++n;
+        sd->sd_size++;
+        if (n <= sd->sd_cap)
+            return 0;
+        mid = n / 2;
+        memcpy(KEYS(r), KEY(sd, node, mid), (n - mid) * ks);
+        memcpy(VALUE(sd, r, 0), VALUE(sd, node, mid), (n - mid) * vs);
+        r->sn_n = n - mid;
+        node->sn_n = mid;
+        r->sn_next = node->sn_next;
+        node->sn_next = r;
+        *right = r;
+        *sep = KEYS(r);
+        return 0;
+    }
+
+    i = search(sd, node, key, 1);
+    /* Allocate ahead, so that a failure leaves no half-done split. */
+    if (n == sd->sd_cap) {
+        r = node_new(sd, 0);
+        if (r == NULL)
+            return ERR_NO_MEM;
+    }
+    err = node_insert(sd, CHILDREN(sd, node)[i], depth - 1, key, value,
+                      &child_right, &child_sep);
+    if (err != 0 || child_right == NULL) {
+        free(r);
+        return err;
+    }
+    memmove(KEY(sd, node, i + 1), KEY(sd, node, i), (n - i) * ks);
+    memcpy(KEY(sd, node, i), child_sep, ks);
+    memmove(CHILDREN(sd, node) + i + 2, CHILDREN(sd, node) + i + 1,
+            (n - i) * sizeof(OptSortedNode *));
+    CHILDREN(sd, node)[i + 1] = child_right;
+    node->sn_n = ++n;
+    if (n <= sd->sd_cap)
+        return 0;
+    /* Key mid moves up; the keys and children after it move right. */
+    mid = n / 2;
+    memcpy(sd->sd_sep, KEY(sd, node, mid), ks);
+    memcpy(KEYS(r), KEY(sd, node, mid + 1), (n - mid - 1) * ks);
+    memcpy(CHILDREN(sd, r), CHILDREN(sd, node) + mid + 1,
+           (n - mid) * sizeof(OptSortedNode *));
+    r->sn_n = n - mid - 1;
+    node->sn_n = mid;
+    *right = r;
+    *sep = sd->sd_sep;
+    return 0;
+}
+
+/* Set key's value to a copy of *value.  Returns 0 or ERR_NO_MEM. */
+    int
+OptSortedDict_SetItem(OptSortedDict *sd, const void *key, const void *value)
+{
+    OptSortedNode *right, *root = NULL;
+    const void *sep;
+    int err;
+
+    /* Make the new root first too, in case the old one splits. */
+    if (sd->sd_root->sn_n == sd->sd_cap) {
+        root = node_new(sd, 0);
+        if (root == NULL)
+            return ERR_NO_MEM;
+    }
+    err = node_insert(sd, sd->sd_root, sd->sd_depth, key, value, &right,
+                      &sep);
+    if (err != 0 || right == NULL) {
+        free(root);
+        return err;
+    }
+    memcpy(KEYS(root), sep, sd->sd_keysize);
+    CHILDREN(sd, root)[0] = sd->sd_root;
+    CHILDREN(sd, root)[1] = right;
+    root->sn_n = 1;
+    sd->sd_root = root;
+    sd->sd_depth++;
+    return 0;
+}
+
+/* Remove key.  Returns 0 or ERR_NO_KEY. */
+    int
+OptSortedDict_DelItem(OptSortedDict *sd, const void *key)
+{
+    OptSortedNode *leaf = find_leaf(sd, key);
+    size_t i = search(sd, leaf, key, 0);
+    size_t n = leaf->sn_n;
+
+    if (i == n || sd->sd_cmpfunc(KEY(sd, leaf, i), key, sd->sd_keysize) != 0)
+        return ERR_NO_KEY;
+    memmove(KEY(sd, leaf, i), KEY(sd, leaf, i + 1),
+            (n - i - 1) * sd->sd_keysize);
+    memmove(VALUE(sd, leaf, i), VALUE(sd, leaf, i + 1),
+            (n - i - 1) * sd->sd_valsize);
+    leaf->sn_n = n - 1;
+    sd->sd_size--;
+    return 0;
+}
+
+    size_t
+OptSortedDict_Size(OptSortedDict *sd)
+{
+    return sd->sd_size;
+}
+
+/* Replace the map's contents with n keys, strictly increasing, and their
+ * values, both packed.  The tree is built bottom up with every node as
+ * full as it can be while keeping the tree balanced.  Returns 0,
+ * ERR_NOT_SORTED (leaving the map unchanged) if the keys are out of order
+ * or repeated, or ERR_NO_MEM (leaving it empty).
+ */
+    int
+OptSortedDict_FromSorted(OptSortedDict *sd, const void *keys,
+                         const void *values, size_t n)
+{
+    size_t ks = sd->sd_keysize, vs = sd->sd_valsize;
+    size_t i, j, k, m, nparents, per, extra, done;
+    const char *kp = keys, *vp = values;
+    OptSortedNode **level, *node;
+    const char **mins;
+
+    for (i = 1; i < n; i++)
+        if (sd->sd_cmpfunc(kp + (i - 1) * ks, kp + i * ks, ks) >= 0)
+            return ERR_NOT_SORTED;
+    node_free(sd, sd->sd_root, sd->sd_depth);
+    sd->sd_root = NULL;
+    sd->sd_size = 0;
+    sd->sd_depth = 0;
+
+    /* m nodes of the level being built, with the least key under each. */
+    m = n == 0 ? 1 : (n + sd->sd_cap - 1) / sd->sd_cap;
+    level = malloc(m * sizeof(OptSortedNode *));
+    mins = malloc(m * sizeof(char *));
+    if (level == NULL || mins == NULL) {
+        m = 0;
+        goto nomem;
+    }
+    per = n / m;
+    extra = n % m;
+    for (i = 0, done = 0; i < m; i++) {
+        k = per + (i < extra);
+        node = level[i] = node_new(sd, 1);
+        if (node == NULL) {
+            m = i;
+            goto nomem;
+        }
+        if (k > 0) {
+            memcpy(KEYS(node), kp + done * ks, k * ks);
+            memcpy(VALUE(sd, node, 0), vp + done * vs, k * vs);
+        }
+        node->sn_n = k;
+        mins[i] = KEYS(node);
+        if (i > 0)
+            level[i - 1]->sn_next = node;
+        done += k;
+    }
+    sd->sd_size = n;
+
+    while (m > 1) {
+        /* Group the m nodes under nparents parents of up to sd_cap + 1
+         * children each, writing the parents over the front of level.
+         */
+        nparents = (m + sd->sd_cap) / (sd->sd_cap + 1);
+        per = m / nparents;
+        extra = m % nparents;
+        for (i = 0, done = 0; i < nparents; i++) {
+            k = per + (i < extra);
+            node = node_new(sd, 0);
+            if (node == NULL) {
+                /* Free the parents so far and the children left. */
+                for (j = 0; j < i; j++)
+                    node_free(sd, level[j], sd->sd_depth + 1);
+                for (j = done; j < m; j++)
+                    node_free(sd, level[j], sd->sd_depth);
+                m = 0;
+                goto nomem;
+            }
+            for (j = 0; j < k; j++) {
+                CHILDREN(sd, node)[j] = level[done + j];
+                if (j > 0)
+                    memcpy(KEY(sd, node, j - 1), mins[done + j], ks);
+            }
+            node->sn_n = k - 1;
+            mins[i] = mins[done];
+            level[i] = node;
+            done += k;
+        }
+        m = nparents;
+        sd->sd_depth++;
+    }
+    sd->sd_root = level[0];
+    free(level);
+    free(mins);
+    return 0;
+
+nomem:
+    for (i = 0; i < m; i++)
+        node_free(sd, level[i], sd->sd_depth);
+    free(level);
+    free(mins);
+    sd->sd_size = 0;
+    sd->sd_depth = 0;
+    sd->sd_root = node_new(sd, 1);
+    return ERR_NO_MEM;
+}
+
+/* Start iterating, in key order, over the keys from lo (inclusive) up to
+ * hi (exclusive); either may be NULL for no bound.  hi must stay put
+ * until the iteration's over:
+ *
+ *     OptSortedIter it;
+ *     OptSortedDict_Range(sd, &it, &lo, &hi);
+ *     while (OptSortedDict_Next(sd, &it, &key, &value)) {
+ *         ...
+ *     }
+ */
+    void
+OptSortedDict_Range(OptSortedDict *sd, OptSortedIter *it, const void *lo,
+                    const void *hi)
+{
+    size_t depth;
+
+    it->it_hi = hi;
+    if (lo == NULL) {
+        it->it_leaf = sd->sd_root;
+        for (depth = sd->sd_depth; depth > 0; depth--)
+            it->it_leaf = CHILDREN(sd, it->it_leaf)[0];
+        it->it_pos = 0;
+        return;
+    }
+    it->it_leaf = find_leaf(sd, lo);
+    it->it_pos = search(sd, it->it_leaf, lo, 0);
+}
+
+/* Either of pkey and pvalue may be NULL. */
+    int
+OptSortedDict_Next(OptSortedDict *sd, OptSortedIter *it, void **pkey,
+                   void **pvalue)
+{
+    char *key;
+
+    while (it->it_leaf != NULL && it->it_pos >= it->it_leaf->sn_n) {
+        it->it_leaf = it->it_leaf->sn_next;
+        it->it_pos = 0;
+    }
+    if (it->it_leaf == NULL)
+        return 0;
+    key = KEY(sd, it->it_leaf, it->it_pos);
+    if (it->it_hi != NULL
+        && sd->sd_cmpfunc(key, it->it_hi, sd->sd_keysize) >= 0) {
+        it->it_leaf = NULL;
+        return 0;
+    }
+    if (pkey)
+        *pkey = key;
+    if (pvalue)
+        *pvalue = VALUE(sd, it->it_leaf, it->it_pos);
+    it->it_pos++;
+    return 1;
+}
@@ -0,0 +1,81 @@
+#ifndef OPTSORTEDDICT_H
+#define OPTSORTEDDICT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "optdictbase.h"
+
+/*
+An OptSortedDict maps keys to values in key order: a B+ tree whose nodes
+hold up to sd_cap keys, about OPTSORTED_NODEBYTES of them, so a search
+within a node touches a few cache lines.  The leaves hold the values and
+are chained in key order, so iterating over a range of keys is a descent to
+its start and then a walk along the leaves.
+
+Keys are of one enum key_t type, ordered numerically, except that
+BYTES_KEY keys are ordered as unsigned byte strings (memcmp()).  Encode
+other fixed-width keys so that this is the order wanted -- signed integers,
+say, big-endian with the sign bit flipped.  NaN keys have no place in the
+order and mustn't be stored.  Values are of an OptDictValueType, or
+OptDictValues.
+
+Deleting a key never merges nodes (as in many databases' B-trees), so a
+map that shrinks a lot is best rebuilt with OptSortedDict_FromSorted(),
+which packs its leaves full.
+*/
+#define OPTSORTED_NODEBYTES 256
+
+typedef struct _sorted_node OptSortedNode;
+
+typedef struct _optsorteddict OptSortedDict;
+struct _optsorteddict {
+    OptSortedNode *sd_root;
+    size_t sd_size;
+    size_t sd_depth;            /* levels above the leaves */
+
+    /* Negative, zero or positive as a < b, a == b or a > b.  Both are
+     * passed sd_keysize.
+     */
+    int (*sd_cmpfunc)(const void *, const void *, size_t);
+    enum key_t sd_keytype;
+    size_t sd_keysize;
+    size_t sd_valsize;
+    const OptDictValueType *sd_valtype;
+    size_t sd_cap;
+    /* The keys of a node take sd_keybytes, room for one more than sd_cap,
+     * for the moment before a full node splits.
+     */
+    size_t sd_keybytes;
+    /* The key that moves up when an inner node splits. */
+    char *sd_sep;
+};
+
+/* The state of an OptSortedDict_Next() iteration, started by
+ * OptSortedDict_Range().  Changing the map ends its iterations.
+ */
+typedef struct {
+    OptSortedNode *it_leaf;
+    size_t it_pos;
+    const void *it_hi;
+} OptSortedIter;
+
+OptSortedDict *OptSortedDict_New(enum key_t, size_t keysize,
+                                 const OptDictValueType *vt);
+void OptSortedDict_Dealloc(OptSortedDict *sd);
+void *OptSortedDict_GetItem(OptSortedDict *sd, const void *key);
+int OptSortedDict_SetItem(OptSortedDict *sd, const void *key,
+                          const void *value);
+int OptSortedDict_DelItem(OptSortedDict *sd, const void *key);
+size_t OptSortedDict_Size(OptSortedDict *sd);
+int OptSortedDict_FromSorted(OptSortedDict *sd, const void *keys,
+                             const void *values, size_t n);
+void OptSortedDict_Range(OptSortedDict *sd, OptSortedIter *it,
+                         const void *lo, const void *hi);
+int OptSortedDict_Next(OptSortedDict *sd, OptSortedIter *it, void **pkey,
+                       void **pvalue);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !OPTSORTEDDICT_H */
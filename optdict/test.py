@@ -1,4 +1,509 @@
+import random
+import threading
+
+import numpy
 
 from build import optdict
 
+# A random workload: keys below 3000, each with a number in [0, 1).
+random.seed(1)
+ops = [(random.randrange(3000), random.random()) for i in range(20000)]
+
+# TypedList
+tl = optdict.TypedList('l', range(10))
+tl.append(-1)
+tl[0] = 100
+tl.extend(numpy.arange(3, dtype=numpy.int64))
+tl.extend(x * 2 for x in range(3))
+assert list(tl) == [100] + list(range(1, 10)) + [-1, 0, 1, 2, 0, 2, 4]
+assert tl[-1] == 4 and numpy.asarray(tl).sum() == sum(tl)
+try:
+    tl.append(0)
+    m = memoryview(tl)
+    tl.append(0)
+except BufferError:
+    m.release()
+else:
+    raise AssertionError("resized a TypedList with an exported buffer")
+tl.clear()
+assert len(tl) == 0
+tl = optdict.TypedList('d', [1., 2.])
+for i in range(5):
+    tl.extend(tl)
+assert list(tl) == [1., 2.] * 32
+
+# OptMultiDict
+mm = optdict.OptMultiDict('d')
+mref = {}
+for k, x in ops[:2000]:
+    mm.append(k % 50, x)
+    mref.setdefault(k % 50, []).append(x)
+assert 50 not in mm
+mm.freeze()
+assert len(mm) == len(mref) and all(list(mm[k]) == mref[k] for k in mref)
+try:
+    mm.append(0, 1.0)
+except TypeError:
+    pass
+else:
+    raise AssertionError("appended to a frozen OptMultiDict")
+
+# OptCounter
+c = optdict.OptCounter()
+c2 = optdict.OptCounter()
+cref = {}
+for k, x in ops:
+    c.add(k, 2)
+    cref[k] = cref.get(k, 0) + 2
+    if k % 7 == 0:
+        c2.update_max(k, k)
+c.count_array(numpy.array([k for k, x in ops[:500]], numpy.intc))
+for k, x in ops[:500]:
+    cref[k] += 1
+assert len(c) == len(cref) and all(c[k] == cref[k] for k in cref)
+fc = optdict.OptCounter('d')
+fref = {}
+for k, x in ops:
+    fc.update_min(k % 100, x)
+    fref[k % 100] = min(fref.get(k % 100, x), x)
+assert all(fc[k] == fref[k] for k in fref) and 100 not in fc
+
+# The lookup cache
+lc = optdict.OptDict()
+for i in range(100):
+    lc[i] = i
+lc.enable_cache(2)
+for i in range(1000):
+    assert lc[i // 100] == i // 100
+hits, misses = lc.cache_stats()
+assert hits + misses == 1000 and misses <= 10
+del lc[3]
+assert 3 not in lc
+lc[3] = 'x'
+assert lc[3] == 'x' and len(lc) == 100
+try:
+    lc.enable_cache(1000)
+except ValueError:
+    pass
+else:
+    raise AssertionError("enable_cache() took too many ways")
+
+# Small dicts
+sm = optdict.OptDict()
+for i in range(8):
+    sm[i * 1000] = i
+del sm[3000], sm[0]
+sm[5] = 'five'
+assert dict(sm.items()) == {1000: 1, 2000: 2, 4000: 4, 5000: 5, 6000: 6,
+                            7000: 7, 5: 'five'}
+for i in range(8, 40):
+    sm[i] = i
+assert len(sm) == 39 and all(sm[i] == i for i in range(8, 40))
+
+# Frozen dicts and access-ordered tables
+for sampled in (False, True):
+    o = optdict.OptDict()
+    for i in range(5000):
+        o[i] = str(i)
+    for i in range(0, 5000, 4):
+        del o[i]
+    if sampled:
+        o.freeze()
+        o.sample_accesses(1)
+        for i in range(1, 5000, 3):
+            if i % 4:
+                assert o[i] == str(i)
+        o.optimize()
+    else:
+        o.optimize({i: i for i in range(1, 5000, 2)})
+    assert len(o) == 3750 and dict(o.items()) == {
+        i: str(i) for i in range(5000) if i % 4}
+    try:
+        o[0] = 'x'
+    except TypeError:
+        pass
+    else:
+        raise AssertionError("added a key to a frozen OptDict")
+    o[1] = 'one'
+    assert o[1] == 'one'
+try:
+    optdict.OptDict().optimize()
+except ValueError:
+    pass
+else:
+    raise AssertionError("optimize() without counts")
+
+# Perfect hashing
+ph = optdict.OptDict()
+for i in range(0, 30000, 3):
+    ph[i] = i
+ph.compile_perfect()
+assert len(ph) == 10000 and all(ph[i] == i for i in range(0, 30000, 3))
+assert not any(i in ph for i in range(1, 30000, 3))
+bph = optdict.OptDict(keytype='S6')
+for i in range(1000):
+    bph[b'%6d' % i] = i
+bph.compile_perfect()
+assert all(bph[b'%6d' % i] == i for i in range(1000))
+assert b'%6d' % 1000 not in bph
+
+# Incremental resizing
+rs = optdict.OptDict()
+rs.set_resize_step(8)
+ref = {}
+for k, x in ops:
+    if x < 0.2 and k in ref:
+        del rs[k], ref[k]
+    else:
+        rs[k] = ref[k] = x
+    if k % 500 == 0:
+        assert len(rs) == len(ref) and all(rs[j] == ref[j] for j in ref)
+assert dict(rs.items()) == ref
+
+# Table allocation
+for flags in (optdict.TABLE_MMAP, optdict.TABLE_MMAP | optdict.TABLE_THP,
+              optdict.TABLE_HUGETLB, optdict.TABLE_INTERLEAVE,
+              optdict.TABLE_BIND):
+    ta = optdict.OptDict()
+    ta.set_table_alloc(flags, 0)
+    for i in range(200000):
+        ta[i] = i
+    for i in range(0, 200000, 2):
+        del ta[i]
+    assert len(ta) == 100000 and all(ta[i] == i for i in range(1, 200000, 2))
+
+# Pooled allocation
+for n in (0, 5, 50, 500) * 20:
+    pl = optdict.OptDict(pooled=True)
+    for i in range(n):
+        pl[i] = i
+    assert len(pl) == n and all(pl[i] == i for i in range(n))
+    del pl
+
+# Compaction and the shrink policy
+cm = optdict.OptDict()
+for i in range(10000):
+    cm[i] = i
+for i in range(9000):
+    del cm[i]
+cm.compact()
+for i in range(20000, 20100):
+    cm[i] = i
+assert dict(cm.items()) == {i: i for i in list(range(9000, 10000))
+                            + list(range(20000, 20100))}
+d = optdict.OptDict()
+d.set_resize_step(4)
+d.set_shrink_policy(0.25)
+ref = {}
+for i in range(50000):
+    d[i] = ref[i] = str(i)
+    if i % 3 == 0:
+        del d[i // 2], ref[i // 2]
+        d[i // 2] = ref[i // 2] = 'x'
+assert len(d) == len(ref) and dict(d.items()) == ref
+sp = optdict.OptDict()
+sp.set_shrink_policy(0.1, 0.2)
+for i in range(10000):
+    sp[i] = i
+for i in range(9990):
+    del sp[i]
+assert dict(sp.items()) == {i: i for i in range(9990, 10000)}
+
+# Value layouts
+for typecode, layouts, value in (('b', ('entries', 'keys', 'separate'), -5),
+                                 ('Zd', ('keys', 'separate'), 1 - 2j),
+                                 ('10s', ('keys', 'separate'), b'ten bytes!')):
+    for layout in layouts:
+        lt = optdict.OptTypedDict(typecode, layout)
+        for i in range(1000):
+            lt[i] = value
+        for i in range(0, 1000, 2):
+            del lt[i]
+        assert len(lt) == 500 and all(lt[i] == value for i in range(1, 1000, 2))
+        assert 0 not in lt
+try:
+    optdict.OptTypedDict('Zd', 'entries')
+except ValueError:
+    pass
+else:
+    raise AssertionError("put 16-byte values in the entries")
+
+# NumPy key and value types
+kt = numpy.dtype([('a', 'i4'), ('b', 'f8')])
+dd = optdict.OptDict(keytype=kt, valtype='f8', hash_fields=['a'])
+dd[(1, 2.0)] = 0.5
+dd[(1, 3.0)] = 1.5
+dd[(2, 2.0)] = 2.5
+dd[(1, 2.0)] = 3.5
+assert len(dd) == 3 and dd[(1, 2.0)] == 3.5 and (2, 3.0) not in dd
+assert sorted(dd.keys().tolist()) == [(1, 2.0), (1, 3.0), (2, 2.0)]
+assert sorted(dd.values().tolist()) == [1.5, 2.5, 3.5]
+vd = optdict.OptDict(valtype=[('x', 'i8'), ('y', 'f4')])
+for i in range(100):
+    vd[i] = (i, i / 2)
+assert vd[7] == (7, 3.5) and vd.values()['x'].sum() == sum(range(100))
+try:
+    optdict.OptDict(hash_fields=['a'])
+except TypeError:
+    pass
+else:
+    raise AssertionError("hash_fields without a structured keytype")
+
+# Hash kernels, through group_by() on keys of each size
+for dtype in (numpy.int8, numpy.int16, numpy.int32, numpy.int64, numpy.uint64):
+    hk = numpy.array([k % 100 for k, x in ops], dtype)
+    uk, counts = optdict.group_by(hk, agg='count')
+    assert uk.tolist() == list(dict.fromkeys(hk.tolist()))
+    assert counts.tolist() == [(hk == k).sum() for k in uk]
+
+# set_many()
+qd = optdict.OptTypedDict('q')
+qd.set_many(numpy.arange(3, dtype=numpy.intc), numpy.arange(10, 13))
+assert [qd[i] for i in range(3)] == [10, 11, 12]
+try:
+    qd.set_many(numpy.arange(3, dtype=numpy.intc), numpy.array([1.5, 2.5, 3.5]))
+except TypeError:
+    pass
+else:
+    raise AssertionError("set_many() took float64 values for 'q'")
+sd4 = optdict.OptTypedDict('4s')
+sd4.set_many(numpy.arange(2, dtype=numpy.intc), numpy.array([b'ab', b'cdef']))
+assert sd4[1] == b'cdef'
+cd = optdict.OptTypedDict('Zd')
+cd.set_many(numpy.arange(2, dtype=numpy.intc), numpy.array([1j, 2+1j]))
+assert cd[1] == 2+1j
+big = optdict.OptTypedDict('d')
+bk = numpy.array([k for k, x in ops], numpy.intc)
+bv = numpy.array([x for k, x in ops])
+big.set_many(bk, bv, prefetch=0)
+bref = dict(zip(bk.tolist(), bv.tolist()))
+assert len(big) == len(bref) and all(big[k] == x for k, x in bref.items())
+
+# Iteration
+it = optdict.OptDict()
+iref = {}
+for k, x in ops:
+    if x < 0.3 and k in iref:
+        del it[k], iref[k]
+    else:
+        it[k] = iref[k] = x
+assert sorted(it) == sorted(iref) and len(list(it)) == len(iref)
+assert sorted(it.items()) == sorted(iref.items())
+
+# Parallel scans
+c = optdict.OptCounter()
+cref = {}
+for k, x in ops:
+    c.add(k, int(x * 1000))
+    cref[k] = cref.get(k, 0) + int(x * 1000)
+assert c.sum(4) == sum(cref.values()) and c.max(4) == max(cref.values())
+assert c.min() == min(cref.values())
+assert c.count(1000, 5000, 4) == sum(1000 <= v < 5000 for v in cref.values())
+sel = c.select(1000, 5000, 4)
+assert len(sel) == c.count(1000, 5000) and all(
+    sel[k] == v for k, v in cref.items() if 1000 <= v < 5000)
+c.clip(2000, 4000, 4)
+assert all(c[k] == min(max(v, 2000), 4000) for k, v in cref.items())
+try:
+    optdict.OptCounter().max()
+except ValueError:
+    assert optdict.OptCounter().sum() == 0
+else:
+    raise AssertionError("max() of an empty OptCounter")
+rc = optdict.OptCounter()
+rc.count_array(numpy.arange(50000, dtype=numpy.intc))
+def add_more():
+    for i in range(50000, 250000):
+        rc.add(i)
+adder = threading.Thread(target=add_more)
+adder.start()
+while adder.is_alive():
+    assert 50000 <= rc.sum(4) <= 250000
+adder.join()
+assert rc.sum(4) == len(rc) == 250000
+
+# Merging and joining
+c = optdict.OptCounter()
+c2 = optdict.OptCounter()
+cref = {}
+for k, x in ops:
+    c.add(k, 2)
+    cref[k] = cref.get(k, 0) + 2
+    if k % 7 == 0:
+        c2.update_max(k, k)
+c.merge(c2, 'max')
+assert all(c[k] == max(cref[k], k) if k % 7 == 0 else c[k] == cref[k]
+           for k in cref)
+a = optdict.OptTypedDict('d')
+b = optdict.OptTypedDict('d', 'separate')
+aref, bref = {}, {}
+for k, x in ops[:3000]:
+    if k % 2:
+        a[k] = aref[k] = x
+    else:
+        b[k // 2] = bref[k // 2] = x
+keys, av, bv = a.join(b)
+assert sorted(keys.tolist()) == sorted(set(aref) & set(bref))
+assert all(av[i] == aref[k] and bv[i] == bref[k] for i, k in enumerate(keys))
+a.merge(b, 'sum')
+for k, x in bref.items():
+    aref[k] = aref.get(k, 0.0) + x
+assert len(a) == len(aref) and all(a[k] == aref[k] for k in aref)
+try:
+    a.merge(optdict.OptTypedDict('q'))
+except TypeError:
+    pass
+else:
+    raise AssertionError("merged 'q' values into 'd' ones")
+
+# group_by() and hash_join()
+gk = numpy.array([k % 10 for k, x in ops], numpy.int32)
+gv = numpy.array([x for k, x in ops])
+uk, sums = optdict.group_by(gk, gv, 'sum')
+assert uk.tolist() == list(dict.fromkeys(gk.tolist()))
+assert numpy.allclose(sums, [gv[gk == k].sum() for k in uk])
+uk, means = optdict.group_by(gk, gv, 'mean')
+assert numpy.allclose(means, [gv[gk == k].mean() for k in uk])
+uk, counts = optdict.group_by(gk, agg='count')
+assert counts.tolist() == [(gk == k).sum() for k in uk]
+lk = numpy.array([k for k, x in ops[:300]])
+rk = numpy.array([k for k, x in ops[300:600]])
+li, ri = optdict.hash_join(lk, rk)
+assert sorted(zip(li.tolist(), ri.tolist())) == [
+    (i, j) for i in range(len(lk)) for j in range(len(rk)) if lk[i] == rk[j]]
+li, ri = optdict.hash_join(numpy.array([3, -1, 5, 3], numpy.int64),
+                           numpy.array([5, 3, 2**63 - 1], numpy.uint64))
+assert li.tolist() == [0, 2, 3] and ri.tolist() == [1, 0, 1]
+li, ri = optdict.hash_join(numpy.array([2**64 - 1, 7], numpy.uint64),
+                           numpy.array([7, 8], numpy.int64))
+assert li.tolist() == [1] and ri.tolist() == [0]
+
+# TypedDict
+t = optdict.TypedDict(keytype=int, valtype=float)
+tref = {}
+for k, x in ops[:5000]:
+    t[k] = tref[k] = x
+assert dict(t.items()) == tref and (1.0 in t) == (1 in tref)
+assert t.pop(ops[0][0]) == tref.pop(ops[0][0]) and t.get(ops[0][0]) is None
+assert t.setdefault(-1, 3.0) == 3.0 and t[-1.0] == 3.0
+try:
+    t['1'] = 1.0
+except TypeError:
+    pass
+else:
+    raise AssertionError("TypedDict stored a str key")
+nan = float('nan')
+ft = optdict.TypedDict(keytype=float, valtype=int)
+for bad in (lambda: ft.__setitem__(nan, 1), lambda: ft.update({1.0: 1, nan: 2}),
+            lambda: ft.update((numpy.array([1.0, nan]), numpy.array([1, 2]))),
+            lambda: optdict.PersistentDict(keytype=float).assoc(nan, 1)):
+    try:
+        bad()
+    except ValueError:
+        pass
+    else:
+        raise AssertionError("took a NaN key")
+assert len(ft) == 0 and nan not in ft
+
+# TypedDict.update()
+t = optdict.TypedDict(keytype=int, valtype=float)
+tref = {}
+for k, x in ops[:5000]:
+    tref[k] = x
+t.update(tref)
+t.update(optdict.TypedDict({-1: 0.5, -2: 1.5}, keytype=int, valtype=float))
+t.update((numpy.array([-3, -4]), numpy.array([2.5, 3.5])))
+t.update([(-5, 4.5)])
+tref.update({-1: 0.5, -2: 1.5, -3: 2.5, -4: 3.5, -5: 4.5})
+assert dict(t.items()) == tref
+try:
+    t.update({3: 'x', 4: 1.0})
+except TypeError:
+    assert dict(t.items()) == tref
+else:
+    raise AssertionError("TypedDict stored a str value")
+
+# Copies
 od = optdict.OptDict()
+ref = {}
+for i, (k, x) in enumerate(ops):
+    if x < 0.3 and k in ref:
+        del od[k], ref[k]
+    else:
+        od[k] = ref[k] = x
+    if i == 10000:
+        cp = od.copy()
+        cpref = dict(ref)
+assert dict(od.items()) == ref and dict(cp.items()) == cpref
+t = optdict.TypedDict(dict(ops[:1000]), keytype=int, valtype=float)
+t2 = t.copy()
+t2[-5] = 0.5
+del t2[ops[0][0]]
+assert dict(t.items()) == dict(ops[:1000]) and -5 not in t and t2[-5] == 0.5
+
+# PersistentDict
+versions = [optdict.PersistentDict()]
+prefs = [{}]
+for k, x in ops[:2000]:
+    p, pref = versions[-1], dict(prefs[-1])
+    if x < 0.3:
+        p = p.dissoc(k)
+        pref.pop(k, None)
+    else:
+        p = p.assoc(k, x)
+        pref[k] = x
+    versions.append(p)
+    prefs.append(pref)
+for p, pref in list(zip(versions, prefs))[::97]:
+    assert len(p) == len(pref) and dict(p.items()) == pref
+    assert all(p[k] == v for k, v in pref.items()) and p.get(-1) is None
+
+# SortedDict
+s = optdict.SortedDict()
+sref = {}
+for k, x in ops:
+    if x < 0.3 and k - 1500 in sref:
+        del s[k - 1500], sref[k - 1500]
+    else:
+        s[k - 1500] = sref[k - 1500] = x
+assert list(s) == sorted(sref)
+assert s.keys(-100, 250.5) == [k for k in sorted(sref) if -100 <= k < 250.5]
+assert s.values(1000) == [sref[k] for k in sorted(sref) if k >= 1000]
+s = optdict.SortedDict.from_arrays(numpy.arange(0., 10.), numpy.arange(10))
+assert s.items(2.5, 5) == [(3.0, 3), (4.0, 4)]
+s = optdict.SortedDict({-2**63: 'min', 0: 'zero', 2**63 - 1: 'max'})
+assert s.keys(0, float('inf')) == [0, 2**63 - 1]
+assert s.keys(0, 2**70) == [0, 2**63 - 1]
+assert s.keys(-2**70, 0) == [-2**63]
+assert s.keys(float('-inf'), 1.5) == [-2**63, 0]
+assert s.keys(2**70) == [] and s.keys(None, -2**70) == []
+for init, kt, vt in (({1: 'a', 2**70: 'b'}, int, object),
+                     ([(1, 'a'), (2, 'b', 3)], int, object),
+                     ({1.0: 1, float('nan'): 2}, float, int),
+                     ({1: 1, 2: 2**64}, int, int)):
+    s = optdict.SortedDict(keytype=kt, valtype=vt)
+    try:
+        s.update(init)
+    except (OverflowError, ValueError):
+        assert len(s) == 0
+    else:
+        raise AssertionError("SortedDict.update() took {!r}".format(init))
+
+# The lookup filter
+fl = optdict.OptDict()
+fl.enable_filter()
+ref = {}
+for k, x in ops:
+    if x < 0.3 and k in ref:
+        del fl[k], ref[k]
+    else:
+        fl[k] = ref[k] = x
+assert dict(fl.items()) == ref and all(k in fl for k in ref)
+assert not any(k in fl for k in range(3000, 6000))
+cp = fl.copy()
+cp[-1] = 'new'
+assert -1 not in fl and cp[-1] == 'new'
+fl.freeze()
+assert all(fl[k] == ref[k] for k in ref) and 3000 not in fl
+fl.enable_filter(False)
+assert all(fl[k] == ref[k] for k in ref)
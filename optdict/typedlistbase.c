@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "typedlistbase.h"
+
+    size_t
+TypedList_ItemSize(enum elem_t elem_type)
+{
+    switch(elem_type) {
+        case INT_ELEM:
+            return sizeof(int);
+        case LONG_ELEM:
+            return sizeof(long);
+        case FLOAT_ELEM:
+            return sizeof(float);
+        case DOUBLE_ELEM:
+            return sizeof(double);
+    }
+    return 0;
+}
+
+    TypedList *
+TypedList_New(enum elem_t elem_type)
+{
+    register TypedList *ls;
+    size_t itemsize = TypedList_ItemSize(elem_type);
+
+    if (itemsize == 0)
+        return NULL;
+    ls = malloc(sizeof(TypedList));
+    if (ls == NULL)
+        return NULL;
+    ls->ls_items = NULL;
+    ls->ls_size = ls->ls_allocated = 0;
+    ls->ls_itemsize = itemsize;
+    ls->ls_type = elem_type;
+    return ls;
+}
+
+/* Create an empty list with room for `size` items, so that the first `size`
+ * appends or a single extend of that many items never reallocate.
+ */
+    TypedList *
+TypedList_NewPresized(enum elem_t elem_type, size_t size)
+{
+    TypedList *ls = TypedList_New(elem_type);
+
+    if (ls != NULL && TypedList_Reserve(ls, size) != 0) {
+        TypedList_Dealloc(ls);
+        return NULL;
+    }
+    return ls;
+}
+
+    void
+TypedList_Dealloc(TypedList *ls)
+{
+    if (ls == NULL)
+        return;
+    free(ls->ls_items);
+    free(ls);
+}
+
+/* Ensure ls_items has room for at least newsize elements, and set ls_size to
+ * newsize.  If newsize > ls_size on entry, the content of the new slots at
+ * exit is undefined heap trash; it's the caller's responsibility to
+ * overwrite them with sane values.
+ * The number of allocated elements may grow, shrink, or stay the same.
+ * Failure is impossible if newsize <= ls_allocated on entry, although that
+ * partly relies on an assumption that the system realloc() never fails when
+ * passed a number of bytes <= the number of bytes last allocated.
+ * Note that ls->ls_items may change, and even if newsize is less than
+ * ls_size on entry.
+ * (This is list_resize() from CPython's listobject.c.)
+ */
+    int
+TypedList_Resize(TypedList *ls, size_t newsize)
+{
+    char *items;
+    size_t new_allocated;
+    size_t allocated = ls->ls_allocated;
+
+    /* Bypass realloc() when a previous overallocation is large enough
+       to accommodate the newsize.  If the newsize falls lower than half
+       the allocated size, then proceed with the realloc() to shrink the list.
+    */
+    if (allocated >= newsize && newsize >= (allocated >> 1)) {
+        assert(ls->ls_items != NULL || newsize == 0);
+        ls->ls_size = newsize;
+        return 0;
+    }
+
+    /* This over-allocates proportional to the list size, making room
+     * for additional growth.  The over-allocation is mild, but is
+     * enough to give linear-time amortized behavior over a long
+     * sequence of appends() in the presence of a poorly-performing
+     * system realloc().
+     * The growth pattern is:  0, 4, 8, 16, 25, 35, 46, 58, 72, 88, ...
+     */
+    new_allocated = (newsize >> 3) + (newsize < 9 ? 3 : 6);
+
+    /* check for integer overflow */
+    if (new_allocated > SIZE_MAX - newsize)
+        return ERR_NO_MEM;
+    new_allocated += newsize;
+
+    if (newsize == 0) {
+        TypedList_Clear(ls);
+        return 0;
+    }
+    if (new_allocated > SIZE_MAX / ls->ls_itemsize)
+        return ERR_NO_MEM;
+    items = realloc(ls->ls_items, new_allocated * ls->ls_itemsize);
+    if (items == NULL)
+        return ERR_NO_MEM;
+    ls->ls_items = items;
+    ls->ls_size = newsize;
+    ls->ls_allocated = new_allocated;
+    return 0;
+}
+
+/* Grow the allocation to hold at least minallocated items without changing
+ * ls_size.  Never shrinks.
+ */
+    int
+TypedList_Reserve(TypedList *ls, size_t minallocated)
+{
+    char *items;
+
+    if (minallocated <= ls->ls_allocated)
+        return 0;
+    if (minallocated > SIZE_MAX / ls->ls_itemsize)
+        return ERR_NO_MEM;
+    items = realloc(ls->ls_items, minallocated * ls->ls_itemsize);
+    if (items == NULL)
+        return ERR_NO_MEM;
+    ls->ls_items = items;
+    ls->ls_allocated = minallocated;
+    return 0;
+}
+
+    int
+TypedList_Append(TypedList *ls, const void *item)
+{
+    size_t n = ls->ls_size;
+
+    if (n == ls->ls_allocated && TypedList_Resize(ls, n + 1) != 0)
+        return ERR_NO_MEM;
+    ls->ls_size = n + 1;
+    memcpy(TypedList_GET_ITEM(ls, n), item, ls->ls_itemsize);
+    return 0;
+}
+
+/* Append n packed items of the list's element type, read from `items`.
+ * This is one resize and one memcpy, whatever n is.  `items` may point into
+ * the list itself (ls.extend(ls)), which the resize may move.
+ */
+    int
+TypedList_Extend(TypedList *ls, const void *items, size_t n)
+{
+    size_t m = ls->ls_size;
+    uintptr_t p = (uintptr_t)items, base = (uintptr_t)ls->ls_items;
+    int inside = ls->ls_items != NULL && p >= base
+                 && p < base + ls->ls_allocated * ls->ls_itemsize;
+
+    if (n == 0)
+        return 0;
+    if (n > SIZE_MAX - m)
+        return ERR_NO_MEM;
+    if (TypedList_Resize(ls, m + n) != 0)
+        return ERR_NO_MEM;
+    if (inside)
+        items = ls->ls_items + (p - base);
+    memcpy(TypedList_GET_ITEM(ls, m), items, n * ls->ls_itemsize);
+    return 0;
+}
+
+    void *
+TypedList_GetItem(TypedList *ls, size_t i)
+{
+    if (i >= ls->ls_size)
+        return NULL;
+    return TypedList_GET_ITEM(ls, i);
+}
+
+    int
+TypedList_SetItem(TypedList *ls, size_t i, const void *item)
+{
+    if (i >= ls->ls_size)
+        return -1;
+    memcpy(TypedList_GET_ITEM(ls, i), item, ls->ls_itemsize);
+    return 0;
+}
+
+    void
+TypedList_Clear(TypedList *ls)
+{
+    free(ls->ls_items);
+    ls->ls_items = NULL;
+    ls->ls_size = ls->ls_allocated = 0;
+}
@@ -0,0 +1,60 @@
+#ifndef TYPEDLIST_H
+#define TYPEDLIST_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#ifndef ERR_NO_MEM
+#define ERR_NO_MEM -1
+#endif
+
+/* Element types a TypedList can hold.  Items are stored by value, packed
+ * contiguously, so a TypedList of n doubles occupies n * sizeof(double)
+ * bytes (plus over-allocation) and can be handed to NumPy without a copy.
+ */
+enum elem_t {
+    INT_ELEM,
+    LONG_ELEM,
+    FLOAT_ELEM,
+    DOUBLE_ELEM
+};
+
+/*
+ls_items points to ls_allocated slots of ls_itemsize bytes each, of which
+the first ls_size are in use.  Invariants:
+    0 <= ls_size <= ls_allocated
+    ls_items == NULL implies ls_size == ls_allocated == 0
+*/
+typedef struct _typedlist TypedList;
+struct _typedlist {
+    char *ls_items;
+    size_t ls_size;
+    size_t ls_allocated;
+    size_t ls_itemsize;
+    enum elem_t ls_type;
+};
+
+/* No bounds checking; i must be in range(ls_size). */
+#define TypedList_GET_ITEM(ls, i) \
+    ((void *)((ls)->ls_items + (size_t)(i) * (ls)->ls_itemsize))
+#define TypedList_GET_SIZE(ls) ((ls)->ls_size)
+
+size_t TypedList_ItemSize(enum elem_t);
+
+TypedList *TypedList_New(enum elem_t);
+TypedList *TypedList_NewPresized(enum elem_t, size_t);
+void TypedList_Dealloc(TypedList *ls);
+int TypedList_Resize(TypedList *ls, size_t newsize);
+int TypedList_Reserve(TypedList *ls, size_t minallocated);
+int TypedList_Append(TypedList *ls, const void *item);
+int TypedList_Extend(TypedList *ls, const void *items, size_t n);
+void *TypedList_GetItem(TypedList *ls, size_t i);
+int TypedList_SetItem(TypedList *ls, size_t i, const void *item);
+void TypedList_Clear(TypedList *ls);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !TYPEDLIST_H */
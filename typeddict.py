@@ -13,20 +13,21 @@ class TypedDict(object):
             self.update(init)
 
     def update(self, other, **kwargs):
-        try:
-            for k in other.keys():
-                v = other[k]
-                _typecheck(k, self.keytype)
-                _typecheck(v, self.valtype)
-                self._d[k] = other[k]
-        except AttributeError:
-            pass
-        for (k, v) in other:
-            _typecheck(k, self.keytype)
-            _typecheck(v, self.valtype)
-            self._d[k] = v
-        for k in kwargs:
-            v = kwargs[k]
+        if (type(other) is type(self) and other.keytype is self.keytype
+                and other.valtype is self.valtype):
+            self._d.update(other._d)
+        else:
+            if isinstance(other, (dict, type(self))):
+                items = other.items()
+            elif hasattr(other, 'keys'):
+                items = [(k, other[k]) for k in other.keys()]
+            else:
+                items = other
+            self._checked_update(items)
+        self._checked_update(kwargs.items())
+
+    def _checked_update(self, items):
+        for (k, v) in items:
             _typecheck(k, self.keytype)
             _typecheck(v, self.valtype)
             self._d[k] = v
@@ -78,3 +79,11 @@ class TypedDict(object):
 
     def popitem(self):
         return self._d.popitem()
+
+# Use the C-backed TypedDict from the optdict extension if it's been built;
+# the class above stays available as PyTypedDict.
+PyTypedDict = TypedDict
+try:
+    from optdict.optdict import TypedDict
+except ImportError:
+    pass